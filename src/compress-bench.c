@@ -0,0 +1,260 @@
+// compress-bench
+
+// Development tool for msg-compress. Measures the compression ratio and
+// throughput on a file of messages, one per line (or a built-in sample), and
+// checks that every message decompresses to itself. With --train it instead
+// builds a dictionary from the messages and prints it as msg-compress-dict.h.
+//
+//   ./compress-bench messages.txt
+//   ./compress-bench --train history.txt > msg-compress-dict.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-compress.h"
+
+#define BENCH_USEC      (G_USEC_PER_SEC / 2)    // Per measurement
+#define GRAM            6                       // Length of the substrings counted
+#define SEGMENT         24                      // Length of the pieces chosen
+
+static const gchar *sample[] = {
+    "Hi, are you there?",
+    "Yes, I'm here. What's up?",
+    "The link to the ground station dropped out again about ten minutes ago.",
+    "Thanks, I'll check the router logs and let you know.",
+    "Can you send me the latest position report?",
+    "Position: 34.92S 138.60E, heading 270, speed 12 knots.",
+    "Weather looks clear for the rest of the afternoon.",
+    "OK, see you tomorrow morning at the station.",
+    "Sorry, I didn't get your last message. Could you send it again?",
+    "Battery is at 40%, switching to the backup now.",
+    "Roger that. Standing by.",
+    "Have you seen the update from the other team?",
+    "No, not yet. I'll have a look tonight.",
+    "Testing the new queue configuration, please ignore.",
+    "Message received, thanks!",
+    "What time do you want to meet on Friday?",
+    "How about 10am? I should be back by then.",
+    "Sounds good to me.",
+    "Packet loss is down to 1% since we changed the antenna.",
+    "Great news, well done everyone.",
+    NULL
+};
+
+static gboolean opt_train = FALSE;
+static gint     opt_size  = MSG_COMPRESS_DICT_MAX;
+
+static GOptionEntry entries[] =
+{
+    { "train", 0, 0, G_OPTION_ARG_NONE, &opt_train,
+      "Build a dictionary from the messages and print it as a C header", NULL },
+    { "size",  0, 0, G_OPTION_ARG_INT,  &opt_size,
+      "Dictionary size in bytes (default and most 3072)", "BYTES" },
+    { NULL }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Training
+
+// Greedily choose the SEGMENT byte pieces of the messages covering the most
+// frequent GRAM byte substrings not yet covered, until the dictionary is full.
+// The pieces chosen first go last, nearest the message.
+static GString *
+train (gchar **messages)
+{
+    GHashTable *counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GPtrArray  *chosen = g_ptr_array_new_with_free_func(g_free);
+    GString    *dict = g_string_new(NULL);
+    gsize       used = 0;
+
+    for (gint m = 0; messages[m] != NULL; m++) {
+        gsize length = strlen(messages[m]);
+
+        for (gsize i = 0; i + GRAM <= length; i++) {
+            gchar   *gram = g_strndup(messages[m] + i, GRAM);
+            gpointer count = g_hash_table_lookup(counts, gram);
+
+            g_hash_table_replace(counts, gram, GINT_TO_POINTER(GPOINTER_TO_INT(count) + 1));
+        }
+    }
+
+    while (used + SEGMENT <= (gsize) opt_size) {
+        const gchar *best = NULL;
+        gint         best_score = 0;
+
+        for (gint m = 0; messages[m] != NULL; m++) {
+            gsize length = strlen(messages[m]);
+
+            for (gsize i = 0; i + SEGMENT <= length; i += GRAM / 2) {
+                gint score = 0;
+
+                for (gsize j = 0; j + GRAM <= SEGMENT; j++) {
+                    gchar gram[GRAM + 1];
+
+                    memcpy(gram, messages[m] + i + j, GRAM);
+                    gram[GRAM] = '\0';
+                    score += GPOINTER_TO_INT(g_hash_table_lookup(counts, gram));
+                }
+                if (score > best_score) {
+                    best_score = score;
+                    best       = messages[m] + i;
+                }
+            }
+        }
+        if (best == NULL)
+            break;
+
+        // Covered now, so it scores nothing next time.
+        for (gsize j = 0; j + GRAM <= SEGMENT; j++) {
+            gchar *gram = g_strndup(best + j, GRAM);
+
+            g_hash_table_replace(counts, gram, GINT_TO_POINTER(0));
+        }
+        g_ptr_array_add(chosen, g_strndup(best, SEGMENT));
+        used += SEGMENT;
+    }
+
+    for (guint i = chosen->len; i > 0; i--)
+        g_string_append(dict, g_ptr_array_index(chosen, i - 1));
+
+    g_ptr_array_free(chosen, TRUE);
+    g_hash_table_destroy(counts);
+    return dict;
+}
+
+static void
+print_header (GString *dict)
+{
+    g_print("// msg-compress-dict\n\n"
+            "// Dictionary for msg-compress.c, built by 'compress-bench --train'.\n\n"
+            "#ifndef MSG_COMPRESS_DICT_H\n"
+            "#define MSG_COMPRESS_DICT_H\n\n"
+            "static const gchar msg_compress_dict[] =");
+
+    for (gsize i = 0; i < dict->len; i++) {
+        guchar c = dict->str[i];
+
+        if (i % 64 == 0)
+            g_print("\n    \"");
+        if (c == '"' || c == '\\')
+            g_print("\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            g_print("\\%03o", c);
+        else
+            g_print("%c", c);
+        if (i % 64 == 63 || i == dict->len - 1)
+            g_print("\"");
+    }
+    g_print(";\n\n#endif // MSG_COMPRESS_DICT_H\n");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+static void
+bench (gchar **messages)
+{
+    MsgCompressor *compressor = msg_compressor_new();
+    guint          count = g_strv_length(messages);
+    gchar        **packed = g_new0(gchar *, count);
+    gsize         *packed_length = g_new0(gsize, count);
+    gsize          in = 0, out = 0;
+    gchar          buffer[MSG_COMPRESS_MAX + 64];
+    guint64        rounds;
+    gint64         start, elapsed;
+
+    // Ratio, and check the round trip.
+    for (guint m = 0; m < count; m++) {
+        gsize  length = MIN(strlen(messages[m]), MSG_COMPRESS_MAX);
+        gsize  n = msg_compress(compressor, messages[m], length, buffer, sizeof(buffer));
+        gssize back;
+
+        in  += length;
+        out += n ? n : length;
+        if (n == 0)
+            continue;
+        packed[m]        = g_malloc(n);
+        packed_length[m] = n;
+        memcpy(packed[m], buffer, n);
+
+        back = msg_decompress(packed[m], n, buffer, sizeof(buffer));
+        if (back != (gssize) length || memcmp(buffer, messages[m], length) != 0) {
+            g_printerr("[ERROR] Round trip failed: %s\n", messages[m]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_print("%u messages, %" G_GSIZE_FORMAT " bytes -> %" G_GSIZE_FORMAT " bytes (%.1f%%), dictionary %u\n",
+            count, in, out, 100.0 * out / MAX(in, 1), msg_compress_dict_id());
+
+    start = g_get_monotonic_time();
+    for (rounds = 0; (elapsed = g_get_monotonic_time() - start) < BENCH_USEC; rounds++) {
+        for (guint m = 0; m < count; m++)
+            msg_compress(compressor, messages[m], MIN(strlen(messages[m]), MSG_COMPRESS_MAX),
+                         buffer, sizeof(buffer));
+    }
+    g_print("Compress:   %7.1f MB/s  %9.0f messages/s\n",
+            (gdouble) in * rounds / elapsed, (gdouble) count * rounds * G_USEC_PER_SEC / elapsed);
+
+    start = g_get_monotonic_time();
+    for (rounds = 0; (elapsed = g_get_monotonic_time() - start) < BENCH_USEC; rounds++) {
+        for (guint m = 0; m < count; m++) {
+            if (packed[m] != NULL)
+                msg_decompress(packed[m], packed_length[m], buffer, sizeof(buffer));
+        }
+    }
+    g_print("Decompress: %7.1f MB/s  %9.0f messages/s\n",
+            (gdouble) in * rounds / elapsed, (gdouble) count * rounds * G_USEC_PER_SEC / elapsed);
+
+    for (guint m = 0; m < count; m++)
+        g_free(packed[m]);
+    g_free(packed);
+    g_free(packed_length);
+    msg_compressor_free(compressor);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+int
+main (int    argc,
+      char **argv)
+{
+    GOptionContext  *context;
+    GError          *error = NULL;
+    gchar           *contents = NULL;
+    gchar          **messages;
+
+    context = g_option_context_new ("[FILE] - benchmark or train message compression");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free (context);
+
+    if (argc > 1) {
+        if (!g_file_get_contents(argv[1], &contents, NULL, &error)) {
+            g_printerr("%s\n", error->message);
+            exit(EXIT_FAILURE);
+        }
+        messages = g_strsplit(g_strchomp(contents), "\n", -1);
+        g_free(contents);
+    } else {
+        messages = g_strdupv((gchar **) sample);
+    }
+
+    if (opt_train) {
+        GString *dict;
+
+        opt_size = CLAMP(opt_size, SEGMENT, MSG_COMPRESS_DICT_MAX);
+        dict = train(messages);
+        print_header(dict);
+        g_string_free(dict, TRUE);
+    } else {
+        bench(messages);
+    }
+
+    g_strfreev(messages);
+    return 0;
+}
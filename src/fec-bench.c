@@ -0,0 +1,224 @@
+// fec-bench
+
+// Development tool for msg-fec. Measures the GF(2^8) multiply-add kernels
+// (msg-gf.h) the CPU has, then encoding and decoding groups of datagrams with
+// the best one, checking that every lost datagram is recovered intact.
+//
+//   ./fec-bench
+//   ./fec-bench --data=16 --parity=4 --size=1000 --loss=4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-fec.h"
+#include "msg-gf.h"
+
+#define BENCH_USEC      (G_USEC_PER_SEC / 2)    // Per measurement
+#define GROUPS          256                     // Encoded once, decoded repeatedly
+#define KERNEL_SIZE     (64 * 1024)             // Bytes per multiply-add
+
+static gint opt_data   = 16;
+static gint opt_parity = 4;
+static gint opt_size   = 1000;
+static gint opt_loss   = 4;
+
+static GOptionEntry entries[] =
+{
+    { "data",   0, 0, G_OPTION_ARG_INT, &opt_data,
+      "Datagrams per group (default 16)", "N" },
+    { "parity", 0, 0, G_OPTION_ARG_INT, &opt_parity,
+      "Parity shards per group (default 4)", "N" },
+    { "size",   0, 0, G_OPTION_ARG_INT, &opt_size,
+      "Datagram size in bytes (default 1000)", "BYTES" },
+    { "loss",   0, 0, G_OPTION_ARG_INT, &opt_loss,
+      "Datagrams lost from each group when decoding (default 4)", "N" },
+    { NULL }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+static void
+bench_kernels (void)
+{
+    static const gchar *kernels[] = { "avx2", "ssse3", "scalar", NULL };
+    guint8  *src = g_malloc(KERNEL_SIZE);
+    guint8  *dst = g_malloc0(KERNEL_SIZE);
+    guint64  rounds;
+    gint64   start, elapsed;
+
+    for (gsize i = 0; i < KERNEL_SIZE; i++)
+        src[i] = g_random_int();
+
+    for (gint k = 0; kernels[k] != NULL; k++) {
+        if (!msg_gf_set_kernel(kernels[k])) {
+            g_print("%-8s not available\n", kernels[k]);
+            continue;
+        }
+        start = g_get_monotonic_time();
+        for (rounds = 0; (elapsed = g_get_monotonic_time() - start) < BENCH_USEC; rounds++) {
+            for (guint c = 1; c < 17; c++)
+                msg_gf_mul_add(dst, src, c, KERNEL_SIZE);
+        }
+        g_print("%-8s %6.1f GB/s multiply-add\n", kernels[k],
+                (gdouble) KERNEL_SIZE * 16 * rounds / elapsed / 1000);
+    }
+
+    g_free(src);
+    g_free(dst);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Encoding and decoding
+
+typedef struct {
+    GPtrArray *shards;          // GBytes, in the order sent, or NULL to drop them
+} Capture;
+
+static gboolean
+capture_shard (const gchar *data, gsize length, gpointer user_data)
+{
+    Capture *capture = user_data;
+
+    if (capture->shards != NULL)
+        g_ptr_array_add(capture->shards, g_bytes_new(data, length));
+    return TRUE;
+}
+
+typedef struct {
+    gchar   **datagrams;
+    guint64   delivered;
+    guint64   bytes;
+    gboolean  check;
+} Delivery;
+
+static gboolean
+deliver (const gchar *data, gsize length, gpointer user_data)
+{
+    Delivery *delivery = user_data;
+
+    // Each datagram starts with its number.
+    if (delivery->check) {
+        guint32 n;
+
+        memcpy(&n, data, sizeof(n));
+        if (length != (gsize) opt_size || n >= (guint32) (GROUPS * opt_data) ||
+            memcmp(data, delivery->datagrams[n], length) != 0) {
+            g_printerr("[ERROR] Datagram %u decoded wrongly\n", n);
+            exit(EXIT_FAILURE);
+        }
+    }
+    delivery->delivered++;
+    delivery->bytes += length;
+    return TRUE;
+}
+
+static void
+bench_codec (void)
+{
+    guint          count = GROUPS * opt_data;
+    gchar        **datagrams = g_new(gchar *, count);
+    Capture        capture = { g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref) };
+    Delivery       delivery = { datagrams, 0, 0, TRUE };
+    MsgFecEncoder *encoder;
+    MsgFecDecoder *decoder;
+    guint          per_group = opt_data + opt_parity;
+    guint64        rounds;
+    gint64         start, elapsed;
+
+    for (guint32 n = 0; n < count; n++) {
+        datagrams[n] = g_malloc(opt_size);
+        for (gint i = 0; i < opt_size; i++)
+            datagrams[n][i] = g_random_int();
+        memcpy(datagrams[n], &n, sizeof(n));
+    }
+
+    // Encode: the shards of the first pass are kept to decode.
+    encoder = msg_fec_encoder_new(opt_data, opt_parity, 0, capture_shard, &capture);
+    for (guint n = 0; n < count; n++)
+        msg_fec_encoder_send(encoder, datagrams[n], opt_size);
+    msg_fec_encoder_free(encoder);
+    if (capture.shards->len != GROUPS * per_group) {
+        g_printerr("[ERROR] Expected %u shards, got %u\n", GROUPS * per_group, capture.shards->len);
+        exit(EXIT_FAILURE);
+    }
+
+    {
+        Capture discard = { NULL };
+
+        encoder = msg_fec_encoder_new(opt_data, opt_parity, 0, capture_shard, &discard);
+        start = g_get_monotonic_time();
+        for (rounds = 0; (elapsed = g_get_monotonic_time() - start) < BENCH_USEC; rounds++) {
+            for (guint n = 0; n < count; n++)
+                msg_fec_encoder_send(encoder, datagrams[n], opt_size);
+        }
+        msg_fec_encoder_free(encoder);
+        g_print("Encode %d+%d: %6.1f Gbit/s of datagrams\n", opt_data, opt_parity,
+                (gdouble) count * opt_size * 8 * rounds / elapsed / 1000);
+    }
+
+    // Decode, dropping the first 'loss' datagrams of each group. A fresh
+    // decoder each round, as one delivers each datagram only once.
+    start = g_get_monotonic_time();
+    for (rounds = 0; (elapsed = g_get_monotonic_time() - start) < BENCH_USEC || rounds == 0; rounds++) {
+        decoder = msg_fec_decoder_new();
+        for (guint i = 0; i < capture.shards->len; i++) {
+            GBytes      *shard = g_ptr_array_index(capture.shards, i);
+            gsize        length;
+            const gchar *data = g_bytes_get_data(shard, &length);
+
+            if (i % per_group < (guint) opt_loss)
+                continue;
+            msg_fec_decoder_receive(decoder, data, length, deliver, &delivery);
+        }
+        if (rounds == 0 && delivery.delivered != count) {
+            g_printerr("[ERROR] Recovered %" G_GUINT64_FORMAT " of %u datagrams\n",
+                       delivery.delivered, count);
+            exit(EXIT_FAILURE);
+        }
+        delivery.check = FALSE;
+        msg_fec_decoder_free(decoder);
+    }
+    g_print("Decode %d+%d, %d lost: %6.1f Gbit/s of datagrams\n", opt_data, opt_parity, opt_loss,
+            (gdouble) delivery.bytes * 8 / elapsed / 1000);
+
+    for (guint n = 0; n < count; n++)
+        g_free(datagrams[n]);
+    g_free(datagrams);
+    g_ptr_array_free(capture.shards, TRUE);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+int
+main (int    argc,
+      char **argv)
+{
+    GOptionContext *context;
+    GError         *error = NULL;
+    const gchar    *best;
+
+    context = g_option_context_new ("- benchmark forward error correction");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free (context);
+
+    opt_data   = CLAMP(opt_data, 1, MSG_FEC_MAX_DATA);
+    opt_parity = CLAMP(opt_parity, 0, MSG_FEC_MAX_PARITY);
+    opt_size   = CLAMP(opt_size, (gint) sizeof(guint32), MSG_FEC_DATAGRAM);
+    opt_loss   = CLAMP(opt_loss, 0, MIN(opt_data, opt_parity));
+
+    msg_gf_init();
+    best = msg_gf_kernel();
+    bench_kernels();
+    msg_gf_set_kernel(best);
+    g_print("Using %s\n", best);
+    bench_codec();
+
+    return 0;
+}
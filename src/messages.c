@@ -31,10 +31,31 @@
 // Modules
 #include <gmodule.h>
 
+#include "msg-dedup.h"
+#include "msg-header.h"
+#include "msg-history.h"
+#include "msg-peer.h"
+#include "msg-receiver.h"
+#include "msg-search.h"
+#include "msg-stage.h"
+#include "msg-stats.h"
+#include "msg-trace.h"
+#include "msg-transfer.h"
+
 // Maximum message size
 #define BUFSIZE 1024
+
+// Lines of history loaded at a time when scrolling back
+#define HISTORY_PAGE 200
 #define STRSIZE 32
 
+// Peers with statistics kept. Sender IDs come off the network, so once this
+// many are known the one heard from longest ago makes way for a new one.
+#define PEER_STATS_MAX 64
+
+// Tracepoints fired here (msg-trace.h)
+MSG_TRACE_SEMAPHORE(messages, display)
+
 #define DEBUG
 
 #ifdef DEBUG
@@ -48,10 +69,17 @@ typedef struct {
     const gchar *name;
     gchar       *address;
     gint         port;
+    MsgPeer     *link;      // Send context, created on first send
+    gint         fecData;   // FEC shards per group, 0 for none
+    gint         fecParity;
+    gint         bundleSize;    // Bytes per bundle, 0 for none
+    gint         bundleDelay;   // Milliseconds
+    MsgPipeline *stages;    // Send stages, NULL if none
 } peerData;
 
 // Data structure for passing Widget pointers to callbacks
 typedef struct {
+    GtkWidget *window;
     GtkWidget *messagesTextView;
     GtkTextBuffer *messagesTextBuffer;
 
@@ -65,11 +93,48 @@ typedef struct {
     GtkWidget *statusLabel;
     GtkWidget *send;
     GtkWidget *over;
-
-    guint     gSourceId;
-    gchar     packetData[BUFSIZE];
+    GtkWidget *searchEntry;
+    GtkTextBuffer *resultsTextBuffer;
+
+    // Scrollback (see echo_line)
+    GString  *pendingLines; // Lines waiting for the next frame
+    guint     pendingCount;
+    guint     scrollback;   // Most lines kept in messagesTextBuffer
+    guint     flushId;      // Tick callback, 0 if none
+
+    // History (see msg-history.h). The view holds, oldest first, the lines of
+    // records 'historyCursor' onwards restored or loaded from history, the
+    // startup banner, then one line per message sent or received (and
+    // recorded, see record_message).
+    MsgHistory *history;    // NULL if disabled
+    guint64     historyCursor;  // ID of the oldest record in the view
+    guint       historyLines;   // Lines loaded from history still in the view
+    guint       bannerLines;    // Startup lines still in the view
+    gboolean    historyLoading;
+    gboolean    scrolledBack;   // Paged back through history and not yet
+                                // returned to the end; nothing is trimmed
+    MsgSearch  *search;     // History search, NULL if no history
+
+    MsgReceiver *receiver;  // Network receive thread
+    MsgDedup    *dedup;     // Duplicate filter, NULL if disabled.
+    MsgTransfer *transfer;  // File transfers
+
+    // Stage modules (see msg-stage.h), loaded once for each direction
+    MsgPipeline *sendStages;
+    MsgPipeline *receiveStages; // Run by the receive thread
+
+    // Sequenced messages (see msg-header.h)
+    gboolean    sequenced;  // Send messages with a header
+    guint32     senderId;   // Our ID in message headers
+    guint32     sendSeq;    // Sequence number of the last message sent
+    GHashTable *peerStats;  // Sender ID -> PeerStats
 } appWidgets;
 
+typedef struct {
+    MsgPeerStats stats;
+    gint64       seen;      // Last heard from (monotonic time)
+} PeerStats;
+
 appWidgets widgetData;
 
 GDateTime *datetime; // local time
@@ -85,21 +150,126 @@ peerData peer = { .name = "gateway",
     .port = 4478
 };
 
+// Pre-declarations
+static int send_message (peerData *peer, const gchar *buffer, gsize length);
+static gdouble transfer_rtt (appWidgets *widgets);
+
 
 
 //////////////////////////////////////////////////////////////////////////////
 // Low level UI function
 
+// Account for 'count' lines trimmed from the top of the view, so that
+// scrolling back later loads the history just before the oldest line left.
+static void
+linesTrimmed (appWidgets *widgets, guint count)
+{
+    guint n;
+
+    n = MIN(count, widgets->historyLines);
+    widgets->historyLines  -= n;
+    widgets->historyCursor += n;
+    count -= n;
+
+    n = MIN(count, widgets->bannerLines);
+    widgets->bannerLines -= n;
+    count -= n;
+
+    // The rest were messages from this session, one record each.
+    widgets->historyCursor += count;
+}
+
+// Drop the oldest pending lines, keeping the last 'scrollback'.
+static void
+trimPending (appWidgets *widgets)
+{
+    GString *pending = widgets->pendingLines;
+    gsize    offset = 0;
+
+    // The lines dropped here come after the view's, so all of the view goes
+    // at the next flush, history paged in or not.
+    widgets->scrolledBack = FALSE;
+
+    while (widgets->pendingCount > widgets->scrollback) {
+        offset = (gchar *) memchr(pending->str + offset, '\n', pending->len - offset)
+                 - pending->str + 1;
+        widgets->pendingCount--;
+        linesTrimmed(widgets, 1);
+    }
+    g_string_erase(pending, 0, offset);
+}
+
+// Insert the lines collected since the last frame in one update, then trim
+// the oldest lines beyond 'scrollback', unless history paged in is being read.
+static gboolean
+flushLines (GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    appWidgets    *widgets = data;
+    GtkTextBuffer *buffer = GTK_TEXT_BUFFER(widgets->messagesTextBuffer);
+    GtkTextIter    start, end;
+    gint           lines;
+
+    widgets->flushId = 0;
+
+    gtk_text_buffer_get_end_iter(buffer, &end);
+    gtk_text_buffer_insert(buffer, &end, widgets->pendingLines->str, widgets->pendingLines->len);
+    g_string_truncate(widgets->pendingLines, 0);
+    widgets->pendingCount = 0;
+
+    // The text ends with a newline, which counts as an extra (empty) line.
+    lines = gtk_text_buffer_get_line_count(buffer) - 1;
+    if (lines > (gint) widgets->scrollback && !widgets->scrolledBack) {
+        gtk_text_buffer_get_start_iter(buffer, &start);
+        gtk_text_buffer_get_iter_at_line(buffer, &end, lines - widgets->scrollback);
+        gtk_text_buffer_delete(buffer, &start, &end);
+        linesTrimmed(widgets, lines - widgets->scrollback);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+// Lines are collected and added to the messages view once per frame (see
+// flushLines), so a burst of messages costs one buffer update.
 void
 echo_line (appWidgets *widgets, gchar *line)
 {
-    //GtkTextBuffer *messages;
-    GtkTextIter messagesIter;
-
     D("[DEBUG] echo_line()\n");
-    gtk_text_buffer_get_end_iter(GTK_TEXT_BUFFER(widgets->messagesTextBuffer),&messagesIter);
-    gtk_text_buffer_insert (GTK_TEXT_BUFFER(widgets->messagesTextBuffer), &messagesIter, line, -1);
-    gtk_text_buffer_insert (GTK_TEXT_BUFFER(widgets->messagesTextBuffer), &messagesIter, "\n", -1);
+    g_string_append(widgets->pendingLines, line);
+    g_string_append_c(widgets->pendingLines, '\n');
+    widgets->pendingCount++;
+
+    // No frames are drawn while the window is hidden. Keep only the lines
+    // that would survive the trim, letting the excess build up to amortise
+    // the copy.
+    if (widgets->pendingCount > 2 * widgets->scrollback)
+        trimPending(widgets);
+
+    if (widgets->flushId == 0)
+        widgets->flushId = gtk_widget_add_tick_callback(widgets->messagesTextView,
+                                                        flushLines, widgets, NULL);
+}
+
+// Format a message as one line of the messages view. The view keeps one line
+// per history record, so line breaks within a message are shown as a return
+// symbol.
+static void
+format_message (gchar       *text,
+                const gchar *timestamp,
+                const gchar *outdir,
+                const gchar *peer,
+                const gchar *indir,
+                const gchar *message)
+{
+    gchar  *body  = g_strchomp(g_strdup(message));
+    gchar **lines = g_strsplit(body, "\n", -1);
+    gchar  *line  = g_strjoinv(" \u21b5 ", lines);
+
+    g_snprintf(text, BUFSIZE, "%-8s  %-2s %-12s %-2s  %s", timestamp, outdir, peer, indir, line);
+    g_strdelimit(text, "\r", ' ');
+
+    g_free(line);
+    g_strfreev(lines);
+    g_free(body);
 }
 
 // Uses 'echo_line' for basic line output
@@ -113,12 +283,134 @@ echo_message (appWidgets *widgets,
 {
     gchar text[BUFSIZE];
 
-    // TODO: Handle multiple line messages.
-    g_snprintf(text, BUFSIZE, "%-8s  %-2s %-12s %-2s  %s", timestamp, outdir, peer, indir, message);
-
+    format_message(text, timestamp, outdir, peer, indir, message);
     echo_line(widgets,text);
 }
 
+// Format a history record as a line of the messages view.
+static void
+format_record (gchar *text, const MsgHistoryRecord *record)
+{
+    GDateTime *time;
+    gchar     *timestamp;
+
+    time      = g_date_time_new_from_unix_local(record->timestamp / G_USEC_PER_SEC);
+    timestamp = g_date_time_format(time, "%H:%M:%S %z");
+
+    if (record->direction == MSG_HISTORY_SENT)
+        format_message(text, timestamp, "->", record->peer, "  ", record->text);
+    else
+        format_message(text, timestamp, "  ", record->peer, "->", record->text);
+
+    g_free(timestamp);
+    g_date_time_unref(time);
+}
+
+// Append a message to the history. Returns FALSE if it could not be, in which
+// case it must not be shown either: each line of the view after the banner is
+// one record, and trimming and scrolling back count on that.
+static gboolean
+record_message (appWidgets          *widgets,
+                MsgHistoryDirection  direction,
+                const gchar         *peer,
+                const gchar         *message)
+{
+    gint64 now = g_get_real_time();
+    gint64 id;
+
+    if (widgets->history == NULL)
+        return TRUE;
+
+    id = msg_history_append(widgets->history, now, direction, peer, message);
+    if (id < 0)
+        return FALSE;
+    if (widgets->search != NULL)
+        msg_search_add(widgets->search, id, now, peer, message);
+    return TRUE;
+}
+
+static gboolean
+restoreRecord (const MsgHistoryRecord *record, gpointer data)
+{
+    appWidgets *widgets = data;
+    gchar       text[BUFSIZE];
+
+    format_record(text, record);
+    echo_line(widgets, text);
+    widgets->historyLines++;
+    return TRUE;
+}
+
+// Show the last 'count' messages from the history. Only the end of the most
+// recent segment is read.
+static void
+restoreHistory (appWidgets *widgets, guint count)
+{
+    guint64 last = msg_history_get_count(widgets->history);
+
+    widgets->historyCursor = last - MIN(last, count);
+    msg_history_read(widgets->history, widgets->historyCursor, last, restoreRecord, widgets);
+}
+
+static gboolean
+loadRecord (const MsgHistoryRecord *record, gpointer data)
+{
+    GString *lines = data;
+    gchar    text[BUFSIZE];
+
+    format_record(text, record);
+    g_string_append(lines, text);
+    g_string_append_c(lines, '\n');
+    return TRUE;
+}
+
+// When the view is scrolled to the top, load the previous page of history
+// above it, keeping the lines that were showing in place. The view may then
+// hold more than 'scrollback' lines; they are trimmed once it is scrolled
+// back to the end, rather than from under the page being read.
+static void
+scrolledMessages (GtkAdjustment *adjustment, appWidgets *widgets)
+{
+    GtkTextBuffer *buffer = GTK_TEXT_BUFFER(widgets->messagesTextBuffer);
+    GtkTextIter    start;
+    GtkTextMark   *mark;
+    GString       *lines;
+    guint64        first;
+    guint          count;
+
+    if (widgets->scrolledBack &&
+        gtk_adjustment_get_value(adjustment) >=
+        gtk_adjustment_get_upper(adjustment) - gtk_adjustment_get_page_size(adjustment)) {
+        widgets->scrolledBack = FALSE;
+        if (widgets->flushId == 0)
+            widgets->flushId = gtk_widget_add_tick_callback(widgets->messagesTextView,
+                                                            flushLines, widgets, NULL);
+    }
+
+    if (widgets->history == NULL || widgets->historyCursor == 0 ||
+        widgets->historyLoading ||
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->messagesTextView)) != buffer ||
+        gtk_adjustment_get_value(adjustment) > gtk_adjustment_get_lower(adjustment))
+        return;
+    widgets->historyLoading = TRUE;
+
+    first = widgets->historyCursor - MIN(widgets->historyCursor, HISTORY_PAGE);
+    lines = g_string_new(NULL);
+    count = msg_history_read(widgets->history, first, widgets->historyCursor, loadRecord, lines);
+
+    gtk_text_buffer_get_start_iter(buffer, &start);
+    mark = gtk_text_buffer_create_mark(buffer, NULL, &start, FALSE);
+    gtk_text_buffer_insert(buffer, &start, lines->str, lines->len);
+    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(widgets->messagesTextView), mark, 0, TRUE, 0, 0);
+    gtk_text_buffer_delete_mark(buffer, mark);
+
+    widgets->historyCursor  = first;
+    widgets->historyLines  += count;
+    widgets->historyLoading = FALSE;
+    widgets->scrolledBack   = TRUE;
+    g_string_free(lines, TRUE);
+}
+
 static gboolean
 updateClock(gpointer data)
 {
@@ -142,6 +434,36 @@ updateRTT(gchar *rtt_str, appWidgets *widgets)
     gtk_label_set_text(GTK_LABEL(widgets->rtt), rtt_str);
 }
 
+// Show a peer's smoothed RTT and jitter, with the distribution and loss in the
+// tooltip.
+static void
+updatePeerStats(MsgPeerStats *stats, appWidgets *widgets)
+{
+    gchar *srtt   = msg_stats_format(stats->srtt);
+    gchar *jitter = msg_stats_format(stats->rttvar);
+    gchar *p50    = msg_stats_format(msg_quantile_get(&stats->p50));
+    gchar *p95    = msg_stats_format(msg_quantile_get(&stats->p95));
+    gchar *min    = msg_stats_format(stats->min_rtt);
+    gchar *label, *tooltip;
+
+    label   = g_strdup_printf("%s ±%s", srtt, jitter);
+    tooltip = g_strdup_printf("RTT min %s, median %s, 95%% %s\n"
+                              "%" G_GUINT64_FORMAT " samples, %.1f%% loss",
+                              min, p50, p95, stats->samples,
+                              100 * msg_stats_loss(stats));
+
+    updateRTT(label, widgets);
+    gtk_widget_set_tooltip_text(widgets->rtt, tooltip);
+
+    g_free(label);
+    g_free(tooltip);
+    g_free(srtt);
+    g_free(jitter);
+    g_free(p50);
+    g_free(p95);
+    g_free(min);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Low level networking functions
 
@@ -175,56 +497,96 @@ gchar * skn_gio_condition_to_string(GIOCondition condition)
     return (value);
  }
 
-static gboolean
-receive_message_handler (GSocket *gSock, GIOCondition condition, appWidgets *widgets)
+// Statistics for a peer, by the sender ID in its message headers.
+static MsgPeerStats *
+peer_stats (appWidgets *widgets, guint32 sender)
 {
-    GError *error = NULL;
-    GSocketAddress *gsRmtAddr = NULL;
-    GInetAddress *gsAddr = NULL;
-    gchar * rmtHost = NULL;
-    gchar *stamp = "";
-    gssize gss_receive = 0;
-
-    gchar message[1024];
-    gssize size;
-    const gchar *timestamp;
-    gchar *peer;
-
-    // FIXME - The following is a workaround as 'widgets' is not passed properly
-    // and I don't know why. Implemented via a global variable 'widgetData'.
-    widgets = &widgetData;
-
-    // DEBUG
-    D("[DEBUG] Received UDP packet - Condition: %s\n",
-               skn_gio_condition_to_string(condition));
-
-    if ((condition & G_IO_HUP) || (condition & G_IO_ERR) || (condition & G_IO_NVAL)) {
-        /* SHUTDOWN THE MAIN LOOP */
-        D("[DEBUG] DisplayService::cb_udp_request_handler(error) G_IO_HUP => %s\n",
-                  skn_gio_condition_to_string(condition));
-        //g_main_loop_quit(pctrl->loop);
-        return ( G_SOURCE_REMOVE );
-    }
-
-    if (condition != G_IO_IN) {
-        D("[DEBUG] DisplayService::cb_udp_request_handler(error) NOT G_IO_IN => %s\n",
-          skn_gio_condition_to_string(condition));
-        return (G_SOURCE_CONTINUE);
+    PeerStats *peer;
+
+    peer = g_hash_table_lookup(widgets->peerStats, GUINT_TO_POINTER(sender));
+    if (peer == NULL) {
+        if (g_hash_table_size(widgets->peerStats) >= PEER_STATS_MAX) {
+            GHashTableIter iter;
+            gpointer       key, value, oldest = NULL;
+            gint64         seen = G_MAXINT64;
+
+            g_hash_table_iter_init(&iter, widgets->peerStats);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                if (((PeerStats *) value)->seen < seen) {
+                    seen   = ((PeerStats *) value)->seen;
+                    oldest = key;
+                }
+            }
+            g_hash_table_remove(widgets->peerStats, oldest);
+        }
+        peer = g_new(PeerStats, 1);
+        msg_stats_init(&peer->stats);
+        g_hash_table_insert(widgets->peerStats, GUINT_TO_POINTER(sender), peer);
     }
+    peer->seen = g_get_monotonic_time();
+    return &peer->stats;
+}
 
-    // If socket times out before reading data any operation will error with 'G_IO_ERROR_TIMED_OUT'.
-    gss_receive = g_socket_receive_from (gSock,
-                                         &gsRmtAddr,
-                                         widgets->packetData,
-                                         sizeof(widgets->packetData),
-                                         NULL,
-                                         &error);
+// Acknowledge a sequenced message, so that its sender can measure RTT.
+static void
+send_ack (appWidgets *widgets, const MsgHeader *received, gint64 receivedAt)
+{
+    gchar     buf[MSG_HEADER_SIZE + MSG_ACK_SIZE];
+    MsgHeader header;
+    MsgAck    ack;
+    gint64    now = g_get_real_time();
+
+    header.type      = MSG_TYPE_ACK;
+    header.flags     = 0;
+    header.sender    = widgets->senderId;
+    header.seq       = widgets->sendSeq;
+    header.timestamp = now;
+
+    ack.echo_seq       = received->seq;
+    ack.echo_delay     = MIN(now - receivedAt, G_MAXUINT32);
+    ack.echo_timestamp = received->timestamp;
+
+    msg_header_write(&header, buf);
+    msg_ack_write(&ack, buf + MSG_HEADER_SIZE);
+    send_message(&peer, buf, sizeof(buf));
+}
 
-    if (error != NULL) {
-        // gss_receive = Number of bytes read, or 0 if the connection was closed by the peer, or -1 on error
-        g_error("[ERROR] g_socket_receive_from() => %s", error->message);
-        g_clear_error(&error);
-        return (G_SOURCE_CONTINUE);
+// Called from the main loop for each message read by the receive thread (see
+// msg-receiver.h), already checked for duplicates.
+static void
+receive_message (const MsgReceived *message, gpointer data)
+{
+    appWidgets   *widgets = data;
+    const gchar  *timestamp;
+    gchar        *peer;
+    MsgAck        ack;
+    MsgPeerStats *stats;
+
+    if (message->sequenced) {
+        stats = peer_stats(widgets, message->header.sender);
+
+        switch (message->header.type) {
+        case MSG_TYPE_TEXT:
+            msg_stats_add_seq(stats, message->header.seq);
+            if (message->header.flags & MSG_FLAG_ACK_REQUEST)
+                send_ack(widgets, &message->header, message->received);
+            break;
+        case MSG_TYPE_ACK:
+            if (msg_ack_read(message->body, message->length, &ack)) {
+                msg_stats_add_rtt(stats, message->received - ack.echo_timestamp - ack.echo_delay);
+                updatePeerStats(stats, widgets);
+                msg_transfer_set_rtt(widgets->transfer, transfer_rtt(widgets));
+            }
+            return;
+        case MSG_TYPE_DATA:
+        case MSG_TYPE_SACK:
+            msg_transfer_receive(widgets->transfer, &message->header,
+                                 message->body, message->length, message->received);
+            return;
+        default:
+            D("[DEBUG] Unknown message type %d\n", message->header.type);
+            return;
+        }
     }
 
     // FIXME: Get timestamp from system clock
@@ -234,72 +596,229 @@ receive_message_handler (GSocket *gSock, GIOCondition condition, appWidgets *wid
     // FIXME: Get peer from incoming packet data
     peer = "mars-alpha";
 
+    MSG_TRACE4(messages, display, message->header.sender, message->header.seq,
+               message->length, g_get_real_time() - message->received);
+
     D("[DEBUG] Dispay message peer: %s\n", peer);
-    echo_message(&widgetData, timestamp, "  ", peer, "->", widgets->packetData);
 
-    D("[DEBUG] Received UDP packet from client! %ld bytes\n", gss_receive);
-    return (G_SOURCE_CONTINUE);
+    // Still compressed after the receive stages: stage-compress is not
+    // loaded here, or has another dictionary. Shown, and recorded, as a
+    // placeholder, so the view stays one line per history record.
+    if (message->sequenced && (message->header.flags & MSG_FLAG_COMPRESSED)) {
+        const gchar *text = "[Compressed message: add stage-compress.so to 'stages' to read it]";
+
+        if (record_message(widgets, MSG_HISTORY_RECEIVED, peer, text))
+            echo_message(widgets, timestamp, "  ", peer, "->", (gchar *) text);
+        return;
+    }
 
+    if (record_message(widgets, MSG_HISTORY_RECEIVED, peer, message->body))
+        echo_message(widgets, timestamp, "  ", peer, "->", (gchar *) message->body);
+
+    D("[DEBUG] Received UDP packet from client! %zu bytes\n", message->length);
 }
 
+// Send a datagram to a peer. The peer's socket and resolved address are kept
+// between sends (see msg-peer.h), so this never blocks on DNS.
 static int
-send_message (peerData peer, char *buffer)
-{
-    char   buf[BUFSIZE];
-    char   *hostname;
-    int    sockfd;
-    int    portno;
-    int    n;
-    int    serverlen;
-    struct sockaddr_in  serveraddr;
-    struct hostent      *server;
-
-    char   myhostname[STRSIZE];
-
-    // Networking peer
-    hostname = peer.address;
-    portno   = peer.port;
-
-    // Open Socket for writing
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
-        fprintf(stderr,"ERROR opening socket") ;
-
-    // gethostbyname: get the server's DNS entry
-    server = gethostbyname(hostname);
-    if (server == NULL) {
-        fprintf(stderr,"ERROR, no such host as %s\n", hostname);
-        exit(0);
+send_message (peerData *peer, const gchar *buffer, gsize length)
+{
+    if (peer->link == NULL) {
+        peer->link = msg_peer_new(peer->address, peer->port, 0);
+        msg_peer_set_fec(peer->link, peer->fecData, peer->fecParity);
+        msg_peer_set_bundle(peer->link, peer->bundleSize,
+                            (gint64) peer->bundleDelay * G_TIME_SPAN_MILLISECOND);
+        msg_peer_set_pipeline(peer->link, peer->stages);
+    } else
+        msg_peer_set_address(peer->link, peer->address, peer->port);
+
+    if (!msg_peer_send(peer->link, buffer, MIN(length, BUFSIZE))) {
+        g_printerr("[ERROR] Message to %s dropped\n", peer->name);
+        return -1;
     }
 
-    // Build the server's Internet address
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-          (char *)&serveraddr.sin_addr.s_addr, server->h_length);
-    serveraddr.sin_port = htons(portno);
+    // DEBUG
+    D("[DEBUG] Packet sent: %s %s:%d\n",
+      peer->name,
+      peer->address,
+      peer->port);
+    return 0;
+}
 
-    // Build message
-    n = g_snprintf(buf, BUFSIZE, "%s", buffer);
-    buf[n] = '\0';
+// Send a chat message to the peer, with a sequenced header if enabled.
+static void
+send_text (appWidgets *widgets, const gchar *text)
+{
+    gchar     buf[BUFSIZE];
+    gsize     length = 0;
+    gsize     textLength;
+    MsgHeader header;
+
+    if (widgets->sequenced) {
+        header.type      = MSG_TYPE_TEXT;
+        header.flags     = MSG_FLAG_ACK_REQUEST;
+        header.sender    = widgets->senderId;
+        header.seq       = ++widgets->sendSeq;
+        header.timestamp = g_get_real_time();
+        length = msg_header_write(&header, buf);
+    }
 
-    /* Send the packet */
-    serverlen = sizeof(serveraddr);
-    n = sendto(sockfd, buf, strlen(buf), 0,
-               (struct sockaddr *) &serveraddr, serverlen);
-    if (n < 0)
-        fprintf(stderr,"ERROR in sendto");
+    textLength = MIN(strlen(text), BUFSIZE - length);
+    memcpy(buf + length, text, textLength);
+    send_message(&peer, buf, length + textLength);
+}
 
-    // DEBUG
-    D("[DEBUG] Packet sent: %s %s:%d\n",
-      peer.name,
-      peer.address,
-      peer.port);
+static gboolean
+transfer_send (const gchar *data, gsize length, gpointer user_data)
+{
+    return send_message(&peer, data, length) == 0;
+}
+
+// Save a received file in the download directory, under its own name unless
+// that is taken. Returns the path, or NULL.
+static gchar *
+save_file (const MsgTransferInfo *info)
+{
+    const gchar *dir;
+    gchar       *name;
+    gchar       *path;
+    GError      *error = NULL;
+
+    dir = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
+    if (dir == NULL)
+        dir = g_get_home_dir();
+
+    // Never let the sender choose the directory.
+    name = g_path_get_basename(info->name);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, G_DIR_SEPARATOR_S) == 0) {
+        g_free(name);
+        name = g_strdup_printf("transfer-%08x", info->id);
+    }
+
+    path = g_build_filename(dir, name, NULL);
+    for (guint n = 1; g_file_test(path, G_FILE_TEST_EXISTS); n++) {
+        gchar *numbered = g_strdup_printf("%s.%u", name, n);
+
+        g_free(path);
+        path = g_build_filename(dir, numbered, NULL);
+        g_free(numbered);
+    }
+    g_free(name);
+
+    if (!g_file_set_contents(path, info->data, info->size, &error)) {
+        g_printerr("[ERROR] Saving %s: %s\n", path, error->message);
+        g_clear_error(&error);
+        g_clear_pointer(&path, g_free);
+    }
+    return path;
+}
+
+// A file transfer has finished: show and record it like a message.
+static void
+transfer_done (const MsgTransferInfo *info, gpointer data)
+{
+    appWidgets  *widgets = data;
+    const gchar *timestamp = gtk_label_get_text(GTK_LABEL(widgets->timestamp));
+    const gchar *peerName  = gtk_entry_get_text(GTK_ENTRY(widgets->peer));
+    gchar       *size      = g_format_size(info->size);
+    gchar       *rate      = g_format_size(info->size * G_USEC_PER_SEC / MAX(info->elapsed, 1));
+    gchar       *text;
+    gchar       *path;
+
+    if (info->incoming) {
+        path = save_file(info);
+        text = g_strdup_printf("[File %s, %s at %s/s%s%s]", info->name, size, rate,
+                               path != NULL ? ", saved as " : ", not saved",
+                               path != NULL ? path : "");
+        if (record_message(widgets, MSG_HISTORY_RECEIVED, "mars-alpha", text))
+            echo_message(widgets, timestamp, "  ", "mars-alpha", "->", text);
+        g_free(path);
+    } else if (info->failed) {
+        text = g_strdup_printf("[File %s not delivered]", info->name);
+        if (record_message(widgets, MSG_HISTORY_SENT, peerName, text))
+            echo_message(widgets, timestamp, "->", peerName, "  ", text);
+    } else {
+        text = g_strdup_printf("[File %s, %s at %s/s, %" G_GUINT64_FORMAT " fragments resent]",
+                               info->name, size, rate, info->retransmitted);
+        if (record_message(widgets, MSG_HISTORY_SENT, peerName, text))
+            echo_message(widgets, timestamp, "->", peerName, "  ", text);
+    }
+
+    g_free(text);
+    g_free(rate);
+    g_free(size);
+}
+
+// Best RTT estimate for a new transfer: the longest smoothed RTT of any peer,
+// since the transfer's peer is not known by ID.
+static gdouble
+transfer_rtt (appWidgets *widgets)
+{
+    GHashTableIter iter;
+    gpointer       value;
+    gdouble        rtt = 0;
+
+    g_hash_table_iter_init(&iter, widgets->peerStats);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        MsgPeerStats *stats = &((PeerStats *) value)->stats;
+
+        if (stats->samples > 0)
+            rtt = MAX(rtt, stats->srtt);
+    }
+    return rtt;
+}
+
+// Show search results in place of the messages, oldest first.
+static void
+showResults (const guint64 *ids, guint count, gboolean truncated, gpointer data)
+{
+    appWidgets *widgets = data;
+    GString    *lines;
+
+    // The search may have been cleared while it ran.
+    if (gtk_entry_get_text_length(GTK_ENTRY(widgets->searchEntry)) == 0)
+        return;
+
+    lines = g_string_new(NULL);
+    if (truncated)
+        g_string_append_printf(lines, "[Newest %u matches]\n", count);
+    else
+        g_string_append_printf(lines, "[%u matches]\n", count);
+
+    for (guint i = 0; i < count; i++)
+        msg_history_read(widgets->history, ids[i], ids[i] + 1, loadRecord, lines);
+
+    gtk_text_buffer_set_text(widgets->resultsTextBuffer, lines->str, lines->len);
+    gtk_text_view_set_buffer(GTK_TEXT_VIEW(widgets->messagesTextView), widgets->resultsTextBuffer);
+    g_string_free(lines, TRUE);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // callback functions
 
+// Search as the query is typed (GtkSearchEntry waits for a pause). An empty
+// query shows the messages again.
+static void
+searchChanged(GtkSearchEntry *entry,
+              appWidgets *widgets)
+{
+    const gchar *query = gtk_entry_get_text(GTK_ENTRY(entry));
+
+    if (query[0] == '\0') {
+        gtk_text_view_set_buffer(GTK_TEXT_VIEW(widgets->messagesTextView),
+                                 GTK_TEXT_BUFFER(widgets->messagesTextBuffer));
+        return;
+    }
+    msg_search_query(widgets->search, query, showResults, widgets);
+}
+
+static void
+searchStopped(GtkSearchEntry *entry,
+              appWidgets *widgets)
+{
+    gtk_entry_set_text(GTK_ENTRY(entry), "");
+}
+
 // Unused
 static void
 insertMessage(GtkEntry *textEntry,
@@ -346,19 +865,45 @@ clickedSend(GtkButton *button,
 
     // Send message
     peer.name = peerName;
-    send_message(peer, text);
-    echo_message(widgets, timestamp, "->", peerName , "  ", text);
+    send_text(widgets, text);
+    if (record_message(widgets, MSG_HISTORY_SENT, peerName, text))
+        echo_message(widgets, timestamp, "->", peerName , "  ", text);
     // Clear buffer for next message
     gtk_text_buffer_set_text (GTK_TEXT_BUFFER(widgets->messageTextBuffer), "", -1);
 
     gtk_label_set_text(GTK_LABEL(widgets->statusLabel), "Sent");
 
-    updateRTT("7h29m",widgets);
-
-// FIXME: text might be a memory leak
+    g_free(text);
 // FIXME: timestamp might be a memory leak
 }
 
+// File > Open: choose a file and send it to the peer.
+static void
+clickedOpen(GtkMenuItem *item,
+            appWidgets *widgets)
+{
+    GtkWidget *dialog;
+    gchar     *path;
+    GError    *error = NULL;
+
+    dialog = gtk_file_chooser_dialog_new("Send File", GTK_WINDOW(widgets->window),
+                                         GTK_FILE_CHOOSER_ACTION_OPEN,
+                                         "_Cancel", GTK_RESPONSE_CANCEL,
+                                         "_Send",   GTK_RESPONSE_ACCEPT,
+                                         NULL);
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        if (msg_transfer_send(widgets->transfer, path, transfer_rtt(widgets), &error) == 0) {
+            g_printerr("[ERROR] %s\n", error->message);
+            g_clear_error(&error);
+        } else {
+            gtk_label_set_text(GTK_LABEL(widgets->statusLabel), "Sending file");
+        }
+        g_free(path);
+    }
+    gtk_widget_destroy(dialog);
+}
+
 static void
 clickedOver(GtkButton *button,
             appWidgets *widgets)
@@ -367,7 +912,7 @@ clickedOver(GtkButton *button,
     clickedSend(button,widgets);
 
     // FIXME: target is currently a global structure
-    send_message(peer, "[OVER]\n");
+    send_text(widgets, "[OVER]\n");
 }
 
 
@@ -417,12 +962,14 @@ main (int    argc,
     GSocket *gSock;
     GInetAddress *anyAddr;
     GSocketAddress *gsAddr;
-    GSource *gSource;
-    guint gSourceId;
 
     // Settings
     GVariant *portSetting;
     GVariant *peerSetting;
+    gint      dedupWindow;
+    gint      historyLines;
+    gchar   **stageSpecs;
+    guint     bannerStart;
 
     GError *error = NULL;
 
@@ -437,6 +984,62 @@ main (int    argc,
     gUDPPort = atoi(g_variant_print(portSetting,FALSE));
     D("[DEBUG] - Waiting for UDP packets on port %d (from gSettings)\n", gUDPPort);
 
+    widgets->sequenced = g_settings_get_boolean (gsettings, "sequenced");
+    widgets->senderId  = g_random_int ();
+    widgets->peerStats = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+
+    widgets->scrollback   = g_settings_get_int (gsettings, "scrollback");
+    widgets->pendingLines = g_string_new (NULL);
+
+    historyLines = g_settings_get_int (gsettings, "history-lines");
+    if (g_settings_get_boolean (gsettings, "history")) {
+        gchar *historyDir = g_build_filename (g_get_user_data_dir (), "messages", "history", NULL);
+
+        widgets->history = msg_history_open (historyDir, &error);
+        if (widgets->history == NULL) {
+            g_printerr ("[ERROR] History disabled: %s\n", error->message);
+            g_clear_error (&error);
+        } else {
+            // Index the history in the background
+            widgets->search = msg_search_new (historyDir, msg_history_get_count (widgets->history));
+        }
+        g_free (historyDir);
+    }
+
+    // Reliable file transfer, paced at no more than the link rate
+    widgets->transfer = msg_transfer_new (widgets->senderId,
+                                          (guint64) g_settings_get_int (gsettings, "transfer-rate") * 1000,
+                                          transfer_send, transfer_done, widgets);
+
+    // Forward error correction on everything sent
+    peer.fecData   = host.fecData   = g_settings_get_int (gsettings, "fec-data");
+    peer.fecParity = host.fecParity = g_settings_get_int (gsettings, "fec-parity");
+
+    // Small messages packed together on busy links
+    peer.bundleSize  = host.bundleSize  = g_settings_get_int (gsettings, "bundle-size");
+    peer.bundleDelay = host.bundleDelay = g_settings_get_int (gsettings, "bundle-delay");
+
+    // Stage modules, run on everything sent and received
+    stageSpecs = g_settings_get_strv (gsettings, "stages");
+    if (stageSpecs[0] != NULL) {
+        widgets->sendStages    = msg_pipeline_new ();
+        widgets->receiveStages = msg_pipeline_new ();
+        for (gint i = 0; stageSpecs[i] != NULL; i++) {
+            if (!msg_pipeline_add (widgets->sendStages, stageSpecs[i], &error) ||
+                !msg_pipeline_add (widgets->receiveStages, stageSpecs[i], &error)) {
+                g_printerr ("[ERROR] %s\n", error->message);
+                g_clear_error (&error);
+                exit (EXIT_FAILURE);
+            }
+        }
+    }
+    g_strfreev (stageSpecs);
+    peer.stages = host.stages = widgets->sendStages;
+
+    dedupWindow = g_settings_get_int (gsettings, "dedup-window");
+    if (dedupWindow > 0)
+        widgets->dedup = msg_dedup_new (65536, (gint64) dedupWindow * G_USEC_PER_SEC);
+
     // DEBUG - The following 'g_variant_get' creates a buffer which will be the
     // source of a memory leak if not released.
     // peerSetting = g_settings_get_value (gsettings, "peer");
@@ -468,16 +1071,11 @@ main (int    argc,
         exit(EXIT_FAILURE);
     }
 
-    // Create and add socket to gmain loop for UDP service.
-    D("[DEBUG] - Add socket to main loop to service received packets.\n");
-    gSource = g_socket_create_source (gSock, G_IO_IN, NULL);
-    g_source_set_callback (gSource,
-                           (GSourceFunc) receive_message_handler,
-                           // its really a GSocketSourceFunc
-                           &widgets,
-                           NULL);
-
-    widgets->gSourceId = gSourceId = g_source_attach (gSource, NULL);
+    // Receive on a separate thread, so bursts of packets don't stall the UI.
+    D("[DEBUG] - Start thread to receive packets.\n");
+    widgets->receiver = msg_receiver_new (g_socket_get_fd (gSock), 4096,
+                                          widgets->dedup, widgets->receiveStages,
+                                          receive_message, widgets);
 
     D("[DEBUG] - Create GUI Interface.\n");
     D("[DEBUG] - Read GTK builder file (../glade/messages.glade).\n");
@@ -485,6 +1083,7 @@ main (int    argc,
 
     D("[DEBUG] - Get pointers to GTK Objects\n");
     window = gtk_builder_get_object (builder , "window");
+    widgets->window             = GTK_WIDGET(window);
     widgets->messagesTextView   = GTK_WIDGET(gtk_builder_get_object(builder, "messagesTextView"));
     widgets->messagesTextBuffer = GTK_TEXT_BUFFER(gtk_builder_get_object(builder, "messagesTextBuffer"));
     widgets->messageTextView    = GTK_WIDGET(gtk_builder_get_object(builder, "messageTextView"));
@@ -496,6 +1095,8 @@ main (int    argc,
     widgets->statusLabel        = GTK_WIDGET(gtk_builder_get_object(builder, "statusLabel"));
     widgets->send               = GTK_WIDGET(gtk_builder_get_object(builder, "send"));
     widgets->over               = GTK_WIDGET(gtk_builder_get_object(builder, "over"));
+    widgets->searchEntry        = GTK_WIDGET(gtk_builder_get_object(builder, "searchEntry"));
+    widgets->resultsTextBuffer  = gtk_text_buffer_new (NULL);
 
     messagesTextBuffer = (GtkTextBuffer*)gtk_builder_get_object (builder, "messagesTextBuffer");
     messageTextBuffer  = (GtkTextBuffer*)gtk_builder_get_object (builder, "messageTextBuffer");
@@ -505,6 +1106,10 @@ main (int    argc,
     g_signal_connect (widgets->messageTextBuffer, "key_press_event", G_CALLBACK (keyPressed), widgets);
     g_signal_connect (widgets->send,              "clicked",     G_CALLBACK (clickedSend),  widgets);
     g_signal_connect (widgets->over,              "clicked",     G_CALLBACK (clickedOver),  widgets);
+    g_signal_connect (widgets->searchEntry,       "search-changed", G_CALLBACK (searchChanged), widgets);
+    g_signal_connect (widgets->searchEntry,       "stop-search", G_CALLBACK (searchStopped), widgets);
+    g_signal_connect (gtk_builder_get_object (builder, "openMenuItem"), "activate", G_CALLBACK (clickedOpen), widgets);
+    gtk_widget_set_sensitive (widgets->searchEntry, widgets->search != NULL);
 
     gtk_widget_show_all (GTK_WIDGET (window));
 
@@ -513,8 +1118,16 @@ main (int    argc,
     // Setup periodic updates
     g_timeout_add_seconds (1, updateClock, widgets);
 
+    // Restore recent history
+    if (widgets->history != NULL) {
+        restoreHistory (widgets, historyLines);
+        g_signal_connect (gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (widgets->messagesTextView)),
+                          "value-changed", G_CALLBACK (scrolledMessages), widgets);
+    }
+
     // Splash
     D("[DEBUG] - Display welcome message\n");
+    bannerStart = widgets->pendingCount;
     echo_line(widgets, "Starting...");
 
     char buf[80];
@@ -531,16 +1144,24 @@ main (int    argc,
     echo_line(widgets,str);
     g_free(str);
     g_date_time_unref(datetime);
+    widgets->bannerLines = widgets->pendingCount - bannerStart;
 
     //updateClock(widgets);
 
     // D("[DEBUG] - Send ping to peer\n");
-    // send_message (peer, "ping");
+    // send_message (&peer, "ping", 4);
 
     D("[DEBUG] - Clear messageTextBuffer\n");
     gtk_text_buffer_set_text (messageTextBuffer, "", -1);
 
     gtk_main ();
 
+    msg_receiver_free (widgets->receiver);
+    msg_pipeline_print (widgets->sendStages, "[STAGE] ");
+    msg_pipeline_print (widgets->receiveStages, "[STAGE] ");
+    msg_transfer_free (widgets->transfer);
+    msg_search_free (widgets->search);
+    msg_history_close (widgets->history);
+
 return 0;
 }
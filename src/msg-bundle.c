@@ -0,0 +1,208 @@
+// msg-bundle
+
+// Aggregation of small datagrams. See msg-bundle.h.
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-bundle.h"
+#include "msg-fec.h"
+#include "msg-header.h"
+
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+#define ENTRY_SIZE      2           // Length prefix
+
+// A bigger bundle would go unprotected by FEC, and be cut short by the next
+// hop's receive buffer, losing every message after the cut.
+G_STATIC_ASSERT(MSG_BUNDLE_MAX <= MSG_FEC_DATAGRAM);
+
+struct _MsgBundler {
+    gsize          size;
+    gint64         delay;
+    MsgBundleFunc  send_func;
+    gpointer       user_data;
+
+    guint32        id;              // Sender ID in bundle headers
+    guint32        seq;
+    guint          count;           // Datagrams in the bundle
+    gsize          length;          // Bytes used in 'buffer', after the header
+    guint          timer_id;
+
+    guint64        sent;
+    guint64        packets;
+
+    gchar         *buffer;          // Header, then entries
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+static gboolean
+bundler_timeout (gpointer data)
+{
+    MsgBundler *bundler = data;
+
+    bundler->timer_id = 0;
+    msg_bundler_flush(bundler);
+    return G_SOURCE_REMOVE;
+}
+
+gboolean
+msg_bundler_flush (MsgBundler *bundler)
+{
+    MsgHeader  header;
+    gchar     *entries = bundler->buffer + MSG_HEADER_SIZE;
+    gboolean   sent;
+
+    if (bundler->timer_id != 0) {
+        g_source_remove(bundler->timer_id);
+        bundler->timer_id = 0;
+    }
+
+    if (bundler->count == 0)
+        return TRUE;
+
+    bundler->packets++;
+    if (bundler->count == 1) {
+        // Alone, so no bundle needed.
+        sent = bundler->send_func(entries + ENTRY_SIZE, bundler->length - ENTRY_SIZE,
+                                  bundler->user_data);
+    } else {
+        memset(&header, 0, sizeof(header));
+        header.type      = MSG_TYPE_BUNDLE;
+        header.sender    = bundler->id;
+        header.seq       = ++bundler->seq;
+        header.timestamp = g_get_real_time();
+        msg_header_write(&header, bundler->buffer);
+
+        D("[DEBUG] Bundle of %u, %lu bytes\n", bundler->count, bundler->length);
+        sent = bundler->send_func(bundler->buffer, MSG_HEADER_SIZE + bundler->length,
+                                  bundler->user_data);
+    }
+
+    bundler->count  = 0;
+    bundler->length = 0;
+    return sent;
+}
+
+gboolean
+msg_bundler_send (MsgBundler *bundler, const gchar *data, gsize length)
+{
+    gchar    *entry;
+    gboolean  sent = TRUE;
+
+    bundler->sent++;
+
+    // Too big to share: send what is held, to keep the order, then this.
+    if (MSG_HEADER_SIZE + 2 * ENTRY_SIZE + length > bundler->size ||
+        length > G_MAXUINT16) {
+        sent = msg_bundler_flush(bundler);
+        bundler->packets++;
+        return bundler->send_func(data, length, bundler->user_data) && sent;
+    }
+
+    if (MSG_HEADER_SIZE + bundler->length + ENTRY_SIZE + length > bundler->size)
+        sent = msg_bundler_flush(bundler);
+
+    entry    = bundler->buffer + MSG_HEADER_SIZE + bundler->length;
+    entry[0] = length >> 8;
+    entry[1] = length;
+    memcpy(entry + ENTRY_SIZE, data, length);
+    bundler->length += ENTRY_SIZE + length;
+
+    if (++bundler->count == 1) {
+        if (bundler->delay > 0)
+            bundler->timer_id = g_timeout_add(MAX(bundler->delay / G_TIME_SPAN_MILLISECOND, 1),
+                                              bundler_timeout, bundler);
+        else
+            bundler->timer_id = g_idle_add(bundler_timeout, bundler);
+    }
+    return sent;
+}
+
+MsgBundler *
+msg_bundler_new (gsize          size,
+                 gint64         delay,
+                 MsgBundleFunc  send_func,
+                 gpointer       user_data)
+{
+    MsgBundler *bundler = g_new0(MsgBundler, 1);
+
+    bundler->size      = CLAMP(size ? size : MSG_BUNDLE_SIZE, MSG_HEADER_SIZE + 64, MSG_BUNDLE_MAX);
+    bundler->delay     = delay;
+    bundler->send_func = send_func;
+    bundler->user_data = user_data;
+    bundler->id        = g_random_int();
+    bundler->buffer    = g_malloc(bundler->size);
+
+    return bundler;
+}
+
+void
+msg_bundler_free (MsgBundler *bundler)
+{
+    if (bundler == NULL)
+        return;
+
+    msg_bundler_flush(bundler);
+    g_free(bundler->buffer);
+    g_free(bundler);
+}
+
+guint64
+msg_bundler_get_sent (MsgBundler *bundler)
+{
+    return bundler->sent;
+}
+
+guint64
+msg_bundler_get_packets (MsgBundler *bundler)
+{
+    return bundler->packets;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Receiving
+
+gboolean
+msg_bundle_is_bundle (const gchar *data, gsize length)
+{
+    MsgHeader header;
+
+    return msg_header_read(data, length, &header) && header.type == MSG_TYPE_BUNDLE;
+}
+
+guint
+msg_bundle_unpack (const gchar   *data,
+                   gsize          length,
+                   MsgBundleFunc  func,
+                   gpointer       user_data)
+{
+    const guint8 *p;
+    gsize         offset = MSG_HEADER_SIZE;
+    guint         count = 0;
+
+    if (!msg_bundle_is_bundle(data, length))
+        return 0;
+
+    while (offset + ENTRY_SIZE <= length) {
+        gsize entry;
+
+        p     = (const guint8 *) data + offset;
+        entry = (p[0] << 8) | p[1];
+        offset += ENTRY_SIZE;
+        if (entry == 0 || offset + entry > length) {
+            D("[DEBUG] Malformed bundle entry at %lu\n", offset);
+            break;
+        }
+        func(data + offset, entry, user_data);
+        offset += entry;
+        count++;
+    }
+    return count;
+}
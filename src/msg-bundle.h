@@ -0,0 +1,76 @@
+// msg-bundle
+
+// Aggregation of small datagrams, shared by 'router' (per target) and
+// 'messages' (per peer).
+//
+// Chat messages are a few tens of bytes, so on a busy link the cost per
+// packet, not per byte, sets the message rate. A MsgBundler packs datagrams
+// sent close together into one MSG_TYPE_BUNDLE message of up to 'size' bytes,
+// sent when the next would not fit or 'delay' after the first was added. A
+// bundle holding a single datagram is sent as the datagram itself, so sparse
+// traffic pays nothing. The receiver unpacks bundles with msg_bundle_unpack().
+//
+// A bundle is a MsgHeader (type MSG_TYPE_BUNDLE, the bundler's ID as sender)
+// followed by the datagrams, each prefixed with its 16 bit big endian length:
+//
+//   header  length  datagram  length  datagram ...
+//
+// A bundler runs on a single thread, and its timer on the default main
+// context.
+
+#ifndef MSG_BUNDLE_H
+#define MSG_BUNDLE_H
+
+#include <glib.h>
+
+#include "msg-header.h"
+
+#define MSG_BUNDLE_SIZE     1400        // Default, fits an Ethernet MTU after FEC
+#define MSG_BUNDLE_MAX      1500        // MSG_FEC_DATAGRAM: FEC still covers it, and it
+                                        // fits every receive buffer after FEC
+
+// Called by a bundler with each bundle, or datagram too large to share one,
+// to put on the wire; returns FALSE if that failed. Also called by
+// msg_bundle_unpack() with each datagram in a bundle, when the return value is
+// ignored. 'data' points into the bundler's buffer or the bundle, so does not
+// outlast the call.
+typedef gboolean (*MsgBundleFunc) (const gchar *data, gsize length, gpointer user_data);
+
+typedef struct _MsgBundler MsgBundler;
+
+// 'size' is the largest bundle in bytes (0 for MSG_BUNDLE_SIZE). 'delay'
+// (microseconds) is the longest a datagram waits for others to join it; with
+// 0 a bundle takes what is sent before the main loop next goes idle.
+MsgBundler *msg_bundler_new     (gsize          size,
+                                 gint64         delay,
+                                 MsgBundleFunc  send_func,
+                                 gpointer       user_data);
+
+// Frees the bundler after sending anything it holds.
+void        msg_bundler_free    (MsgBundler *bundler);
+
+// Add a datagram to the current bundle. Datagrams too large to share a bundle
+// are sent at once, after the bundle. Returns FALSE if a send failed.
+gboolean    msg_bundler_send    (MsgBundler  *bundler,
+                                 const gchar *data,
+                                 gsize        length);
+
+// Send the current bundle now.
+gboolean    msg_bundler_flush   (MsgBundler *bundler);
+
+// Datagrams sent, and datagrams actually put on the wire (bundles and
+// datagrams sent alone).
+guint64     msg_bundler_get_sent    (MsgBundler *bundler);
+guint64     msg_bundler_get_packets (MsgBundler *bundler);
+
+// TRUE if 'data' is a MSG_TYPE_BUNDLE message.
+gboolean    msg_bundle_is_bundle (const gchar *data, gsize length);
+
+// Call 'func' with each datagram in a bundle. Stops at the first malformed
+// entry. Returns the number delivered.
+guint       msg_bundle_unpack   (const gchar   *data,
+                                 gsize          length,
+                                 MsgBundleFunc  func,
+                                 gpointer       user_data);
+
+#endif // MSG_BUNDLE_H
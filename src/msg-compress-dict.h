@@ -0,0 +1,41 @@
+// msg-compress-dict
+
+// Dictionary for msg-compress.c. Seeded by hand with common chat and link
+// phrases; rebuild it from a message history with 'compress-bench --train'.
+
+#ifndef MSG_COMPRESS_DICT_H
+#define MSG_COMPRESS_DICT_H
+
+static const gchar msg_compress_dict[] =
+    " Unfortunately, I'm not sure. Sorry about that. Could you please"
+    " send it again? Let me know if there is anything else. Thanks fo"
+    "r letting me know. I'll be back in a few minutes. What time do y"
+    "ou want to meet? See you tomorrow morning. Good afternoon, how a"
+    "re you going? Are you still there? Yes, I think that should be f"
+    "ine. No problem at all. Please confirm when received. Message re"
+    "ceived, over and out. Signal is weak, say again. Standing by for"
+    " further instructions. Copy that, will do. Roger, wilco. Battery"
+    " level is low. Position report: latitude longitude altitude head"
+    "ing speed. Weather update: wind temperature rain cloud clear. Th"
+    "e link is down again, retrying now. Can you hear me? Testing, te"
+    "sting, one two three. Check the router configuration and restart"
+    " the queue. Network status: connected, disconnected, delay, pack"
+    "et loss. ETA about an hour. On my way home now. Just arrived at "
+    "the station. Have you seen the latest update? I don't know what "
+    "happened yesterday. Something like that would be really good. Ev"
+    "erything is working as expected. That doesn't look right to me. "
+    "We should probably talk about this later tonight. Happy birthday"
+    "! Congratulations! Good luck with everything. Talk to you soon. "
+    "Take care. Don't forget to bring the charger. Where are you now?"
+    " When will you be ready? Why did that happen? How much longer do"
+    " you need? Which one would you like? Who else is coming? Because"
+    " there was nothing else we could do. Otherwise everything looks "
+    "okay from here. Meanwhile, the other team has already started. T"
+    "omorrow or the day after, depending on the weather. Monday Tuesd"
+    "ay Wednesday Thursday Friday Saturday Sunday January February Ma"
+    "rch April May June July August September October November Decemb"
+    "er morning afternoon evening night today tonight yesterday minut"
+    "es seconds hours days weeks months http://www. https:// .com .or"
+    "g .net.au @gmail.com";
+
+#endif // MSG_COMPRESS_DICT_H
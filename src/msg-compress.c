@@ -0,0 +1,266 @@
+// msg-compress
+
+// Compression of short text messages against a shared static dictionary. See
+// msg-compress.h.
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-compress.h"
+#include "msg-compress-dict.h"
+
+#define MIN_MATCH       3
+#define MAX_MATCH       10
+#define MAX_OFFSET      MSG_COMPRESS_WINDOW
+#define RAW             0xff        // Starts a run of bytes as they are
+#define MAX_RAW         256
+#define HASH_BITS       12
+#define HASH_SIZE       (1 << HASH_BITS)
+#define CHAIN_DEPTH     16          // Candidates tried per position
+
+G_STATIC_ASSERT(sizeof(msg_compress_dict) - 1 <= MSG_COMPRESS_DICT_MAX);
+
+#define DICT_SIZE       (sizeof(msg_compress_dict) - 1)
+
+// Position + 1 of the latest occurrence of each hash (0 if none), and for each
+// position the one before it. The dictionary's entries are built once. A
+// compressor's own entries are only valid for the message they were made for
+// ('epoch'); otherwise the dictionary's stand, so nothing is reset between
+// messages.
+static guint16  dict_head[HASH_SIZE];
+static guint16  dict_prev[MSG_COMPRESS_DICT_MAX];
+static guint8   dict_id;
+
+struct _MsgCompressor {
+    guint32     epoch;
+    guint32     stamp[HASH_SIZE];   // Epoch 'head' entries were made in
+    guint16     head[HASH_SIZE];
+    guint16     prev[MSG_COMPRESS_DICT_MAX + MSG_COMPRESS_MAX];
+    guint8      window[MSG_COMPRESS_DICT_MAX + MSG_COMPRESS_MAX];
+};
+
+static inline guint
+hash3 (const guint8 *p)
+{
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void
+msg_compress_init (void)
+{
+    static gsize   initialised = 0;
+    const guint8  *dict = (const guint8 *) msg_compress_dict;
+
+    if (!g_once_init_enter(&initialised))
+        return;
+
+    for (guint i = 0; i + MIN_MATCH <= DICT_SIZE; i++) {
+        guint h = hash3(dict + i);
+
+        dict_prev[i] = dict_head[h];
+        dict_head[h] = i + 1;
+    }
+    dict_id = g_str_hash(msg_compress_dict);
+
+    g_once_init_leave(&initialised, 1);
+}
+
+guint8
+msg_compress_dict_id (void)
+{
+    msg_compress_init();
+    return dict_id;
+}
+
+MsgCompressor *
+msg_compressor_new (void)
+{
+    MsgCompressor *compressor;
+
+    msg_compress_init();
+
+    compressor = g_new0(MsgCompressor, 1);
+    compressor->epoch = 1;
+    memcpy(compressor->prev, dict_prev, sizeof(dict_prev));
+    memcpy(compressor->window, msg_compress_dict, DICT_SIZE);
+    return compressor;
+}
+
+void
+msg_compressor_free (MsgCompressor *compressor)
+{
+    g_free(compressor);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static inline guint
+msg_compress_head (MsgCompressor *compressor, guint h)
+{
+    return compressor->stamp[h] == compressor->epoch ? compressor->head[h] : dict_head[h];
+}
+
+static inline void
+msg_compress_insert (MsgCompressor *compressor, guint h, gsize p)
+{
+    compressor->prev[p]  = msg_compress_head(compressor, h);
+    compressor->head[h]  = p + 1;
+    compressor->stamp[h] = compressor->epoch;
+}
+
+// Flush 'count' bytes from 'start' as literals. Returns FALSE if they don't
+// fit.
+static gboolean
+put_literals (const guint8 *start, gsize count, guint8 *out, gsize *o, gsize size)
+{
+    while (count > 0) {
+        gsize run;
+
+        // ASCII stands for itself; anything else goes in a raw run.
+        if (*start < 0x80) {
+            if (*o >= size)
+                return FALSE;
+            out[(*o)++] = *start++;
+            count--;
+            continue;
+        }
+
+        for (run = 1; run < count && run < MAX_RAW && start[run] >= 0x80; run++)
+            ;
+        if (*o + 2 + run > size)
+            return FALSE;
+        out[(*o)++] = RAW;
+        out[(*o)++] = run - 1;
+        memcpy(out + *o, start, run);
+        *o    += run;
+        start += run;
+        count -= run;
+    }
+    return TRUE;
+}
+
+gsize
+msg_compress (MsgCompressor *compressor,
+              const gchar   *data,
+              gsize          length,
+              gchar         *out_data,
+              gsize          size)
+{
+    guint8  *w   = compressor->window;
+    guint8  *out = (guint8 *) out_data;
+    gsize    end = DICT_SIZE + length;
+    gsize    p   = DICT_SIZE;
+    gsize    literal = p;           // Start of literals not yet written
+    gsize    o   = 0;
+
+    if (length == 0 || length > MSG_COMPRESS_MAX || size < 2)
+        return 0;
+    size = MIN(size, length);       // No use unless it is shorter
+
+    compressor->epoch++;
+    memcpy(w + DICT_SIZE, data, length);
+    out[o++] = dict_id;
+
+    while (p + MIN_MATCH <= end) {
+        guint  h = hash3(w + p);
+        guint  candidate = msg_compress_head(compressor, h);
+        gsize  best = 0, best_offset = 0;
+        gsize  limit = MIN(MAX_MATCH, end - p);
+
+        for (guint depth = 0; candidate != 0 && depth < CHAIN_DEPTH; depth++) {
+            gsize c = candidate - 1;
+            gsize n = 0;
+
+            if (p - c > MAX_OFFSET)
+                break;
+            while (n < limit && w[c + n] == w[p + n])
+                n++;
+            // The longest length at the furthest offsets is the raw marker.
+            if (n == MAX_MATCH && p - c > MAX_OFFSET - 256)
+                n--;
+            if (n > best) {
+                best        = n;
+                best_offset = p - c;
+                if (n == limit)
+                    break;
+            }
+            candidate = compressor->prev[c];
+        }
+
+        msg_compress_insert(compressor, h, p);
+
+        if (best < MIN_MATCH) {
+            p++;
+            continue;
+        }
+
+        if (!put_literals(w + literal, p - literal, out, &o, size) || o + 2 > size)
+            return 0;
+        out[o++] = 0x80 | (best - MIN_MATCH) << 4 | (best_offset - 1) >> 8;
+        out[o++] = (best_offset - 1) & 0xff;
+
+        // Index the positions the match covers, for later matches.
+        for (gsize i = p + 1; i < p + best && i + MIN_MATCH <= end; i++) {
+            msg_compress_insert(compressor, hash3(w + i), i);
+        }
+        p      += best;
+        literal = p;
+    }
+
+    if (!put_literals(w + literal, end - literal, out, &o, size) || o >= length)
+        return 0;
+    return o;
+}
+
+gssize
+msg_decompress (const gchar *data_in, gsize length, gchar *out_data, gsize size)
+{
+    const guint8 *data = (const guint8 *) data_in;
+    const guint8 *dict = (const guint8 *) msg_compress_dict;
+    guint8       *out  = (guint8 *) out_data;
+    gsize         i = 1, o = 0;
+
+    msg_compress_init();
+    if (length < 1 || data[0] != dict_id)
+        return -1;
+
+    while (i < length) {
+        guint8 b = data[i++];
+
+        if (b < 0x80) {
+            if (o >= size)
+                return -1;
+            out[o++] = b;
+        } else if (b == RAW) {
+            gsize run;
+
+            if (i >= length)
+                return -1;
+            run = data[i++] + 1;
+            if (i + run > length || o + run > size)
+                return -1;
+            memcpy(out + o, data + i, run);
+            i += run;
+            o += run;
+        } else {
+            gsize n, offset;
+
+            if (i >= length)
+                return -1;
+            n      = MIN_MATCH + ((b >> 4) & 7);
+            offset = (((b & 0x0f) << 8) | data[i++]) + 1;
+            if (offset > DICT_SIZE + o || o + n > size)
+                return -1;
+
+            // Byte by byte, as the copy may overlap what it writes, or start
+            // in the dictionary and run on into the message.
+            for (gsize k = 0; k < n; k++, o++) {
+                gssize from = (gssize) o - (gssize) offset;
+
+                out[o] = from >= 0 ? out[from] : dict[DICT_SIZE + from];
+            }
+        }
+    }
+    return o;
+}
@@ -0,0 +1,54 @@
+// msg-compress
+
+// Compression of short text messages against a shared static dictionary, for
+// the 'stage-compress' module (see msg-stage.h).
+//
+// General purpose compressors learn from the data they are given, and a chat
+// message is over before they have learnt anything. Here both ends start from
+// the same dictionary of common words and phrases (msg-compress-dict.h, which
+// 'compress-bench --train' can rebuild from a message history), so even a
+// short message finds matches. The format is a byte oriented LZ77 with the
+// dictionary as the start of the window:
+//
+//   0xxxxxxx                 ASCII byte x
+//   1lllhhhh oooooooo        copy 3 + lll bytes from (hhhh << 8 | o) + 1 back
+//   11111111 nnnnnnnn ...    n + 1 bytes as they are (eg. UTF-8)
+//
+// A compressed body starts with one byte identifying the dictionary, so a peer
+// with a different one drops the message rather than showing garbage.
+
+#ifndef MSG_COMPRESS_H
+#define MSG_COMPRESS_H
+
+#include <glib.h>
+
+#define MSG_COMPRESS_MAX        1024    // Longest message compressed
+#define MSG_COMPRESS_DICT_MAX   3072    // So all of it is in reach
+#define MSG_COMPRESS_WINDOW     4096
+
+typedef struct _MsgCompressor MsgCompressor;
+
+// A compressor is used by one thread at a time.
+MsgCompressor *msg_compressor_new   (void);
+void           msg_compressor_free  (MsgCompressor *compressor);
+
+// Compress 'length' bytes (up to MSG_COMPRESS_MAX) into 'out', which has
+// room for 'size'. Returns the compressed length, or 0 if it would be no
+// shorter than the input.
+gsize          msg_compress         (MsgCompressor *compressor,
+                                     const gchar   *data,
+                                     gsize          length,
+                                     gchar         *out,
+                                     gsize          size);
+
+// Decompress into 'out'. Returns the decompressed length, or -1 if the data
+// is corrupt, needs another dictionary or does not fit in 'size'.
+gssize         msg_decompress       (const gchar   *data,
+                                     gsize          length,
+                                     gchar         *out,
+                                     gsize          size);
+
+// Identifies the dictionary in use.
+guint8         msg_compress_dict_id (void);
+
+#endif // MSG_COMPRESS_H
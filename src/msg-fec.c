@@ -0,0 +1,410 @@
+// msg-fec
+
+// Forward error correction over groups of datagrams. See msg-fec.h.
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-fec.h"
+#include "msg-gf.h"
+#include "msg-header.h"
+
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+#define SHARD_SIZE      (MSG_FEC_DATAGRAM + 2)  // Length prefix and datagram
+#define PARITY_INDEX    MSG_FEC_MAX_DATA        // Index of the first parity shard
+
+struct _MsgFecEncoder {
+    guint        data;
+    guint        parity;
+    gint64       delay;
+    MsgFecFunc   send_func;
+    gpointer     user_data;
+
+    guint32      id;                // Sender ID in shard headers
+    guint32      group;
+    guint        count;             // Data shards sent in the group
+    gsize        size;              // Longest shard in the group
+    guint8      *shards;            // Parity being accumulated, 'parity' x SHARD_SIZE
+    guint        timer_id;
+    gchar        buffer[MSG_HEADER_SIZE + MSG_FEC_SIZE + SHARD_SIZE];
+};
+
+typedef struct {
+    gboolean     used;
+    gboolean     done;
+    guint32      sender;
+    guint32      group;
+    guint        data;              // Data shards in the group (exact once parity is seen)
+    guint        parity;
+    guint64      have;              // Data shards held, by index
+    guint32      have_parity;
+    guint16      length[MSG_FEC_MAX_DATA];
+    gsize        size;              // Parity shard size
+    guint8      *shards;            // (MSG_FEC_MAX_DATA + MSG_FEC_MAX_PARITY) x SHARD_SIZE
+} MsgFecGroup;
+
+struct _MsgFecDecoder {
+    MsgFecGroup  groups[MSG_FEC_GROUPS];
+    guint64      recovered;
+};
+
+// Parity row 'j', column 'i': a Cauchy matrix, 1 / (x_j + y_i), with the x
+// and y sets disjoint.
+static inline guint8
+coefficient (guint j, guint i)
+{
+    return msg_gf_inv(j ^ (MSG_FEC_MAX_PARITY + i));
+}
+
+static inline guint
+count_bits (guint64 bits)
+{
+    return __builtin_popcountll(bits);
+}
+
+static inline void
+put16 (guint8 *p, guint16 value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline guint16
+get16 (const guint8 *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static gsize
+write_shard_header (gchar *buffer, guint32 sender, guint32 group,
+                    guint index, guint data, guint parity)
+{
+    MsgHeader header;
+
+    header.type      = MSG_TYPE_FEC;
+    header.flags     = 0;
+    header.sender    = sender;
+    header.seq       = group;
+    header.timestamp = g_get_real_time();
+    msg_header_write(&header, buffer);
+
+    buffer[MSG_HEADER_SIZE]     = index;
+    buffer[MSG_HEADER_SIZE + 1] = data;
+    buffer[MSG_HEADER_SIZE + 2] = parity;
+    buffer[MSG_HEADER_SIZE + 3] = 0;
+
+    return MSG_HEADER_SIZE + MSG_FEC_SIZE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Encoding
+
+static gboolean
+encoder_timeout (gpointer data)
+{
+    MsgFecEncoder *encoder = data;
+
+    encoder->timer_id = 0;
+    msg_fec_encoder_flush(encoder);
+    return G_SOURCE_REMOVE;
+}
+
+void
+msg_fec_encoder_flush (MsgFecEncoder *encoder)
+{
+    gsize offset;
+
+    if (encoder->count == 0)
+        return;
+
+    if (encoder->timer_id != 0) {
+        g_source_remove(encoder->timer_id);
+        encoder->timer_id = 0;
+    }
+
+    for (guint j = 0; j < encoder->parity; j++) {
+        guint8 *shard = encoder->shards + j * SHARD_SIZE;
+
+        offset = write_shard_header(encoder->buffer, encoder->id, encoder->group,
+                                    PARITY_INDEX + j, encoder->count, encoder->parity);
+        memcpy(encoder->buffer + offset, shard, encoder->size);
+        encoder->send_func(encoder->buffer, offset + encoder->size, encoder->user_data);
+        memset(shard, 0, encoder->size);
+    }
+
+    encoder->group++;
+    encoder->count = 0;
+    encoder->size  = 0;
+}
+
+gboolean
+msg_fec_encoder_send (MsgFecEncoder *encoder, const gchar *data, gsize length)
+{
+    guint8   prefix[2];
+    gsize    offset;
+    gboolean sent;
+
+    if (length > MSG_FEC_DATAGRAM)
+        return encoder->send_func(data, length, encoder->user_data);
+
+    // Send the datagram straight away, so FEC adds no delay when nothing is
+    // lost.
+    offset = write_shard_header(encoder->buffer, encoder->id, encoder->group,
+                                encoder->count, encoder->data, encoder->parity);
+    memcpy(encoder->buffer + offset, data, length);
+    sent = encoder->send_func(encoder->buffer, offset + length, encoder->user_data);
+
+    // Add it to each parity shard.
+    put16(prefix, length);
+    for (guint j = 0; j < encoder->parity; j++) {
+        guint8 *shard = encoder->shards + j * SHARD_SIZE;
+        guint8  c     = coefficient(j, encoder->count);
+
+        msg_gf_mul_add(shard, prefix, c, 2);
+        msg_gf_mul_add(shard + 2, (const guint8 *) data, c, length);
+    }
+    encoder->size = MAX(encoder->size, length + 2);
+
+    if (++encoder->count == encoder->data)
+        msg_fec_encoder_flush(encoder);
+    else if (encoder->count == 1 && encoder->delay > 0)
+        encoder->timer_id = g_timeout_add(MAX(encoder->delay / G_TIME_SPAN_MILLISECOND, 1),
+                                          encoder_timeout, encoder);
+    return sent;
+}
+
+MsgFecEncoder *
+msg_fec_encoder_new (guint       data,
+                     guint       parity,
+                     gint64      delay,
+                     MsgFecFunc  send_func,
+                     gpointer    user_data)
+{
+    MsgFecEncoder *encoder;
+
+    msg_gf_init();
+
+    encoder = g_new0(MsgFecEncoder, 1);
+    encoder->data      = CLAMP(data, 1, MSG_FEC_MAX_DATA);
+    encoder->parity    = MIN(parity, MSG_FEC_MAX_PARITY);
+    encoder->delay     = delay > 0 ? delay : MSG_FEC_DELAY;
+    encoder->send_func = send_func;
+    encoder->user_data = user_data;
+    encoder->id        = g_random_int();
+    encoder->shards    = g_malloc0(MAX(encoder->parity, 1) * SHARD_SIZE);
+
+    D("[DEBUG] FEC %u+%u, %s kernel\n", encoder->data, encoder->parity, msg_gf_kernel());
+    return encoder;
+}
+
+void
+msg_fec_encoder_free (MsgFecEncoder *encoder)
+{
+    if (encoder == NULL)
+        return;
+
+    if (encoder->timer_id != 0)
+        g_source_remove(encoder->timer_id);
+    g_free(encoder->shards);
+    g_free(encoder);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Decoding
+
+// Recover the missing data shards of a group from its syndromes: for each
+// parity shard used, its contents less the contribution of the data shards
+// that arrived. That leaves a small system, missing x missing, to invert.
+static guint
+decode (MsgFecDecoder *decoder, MsgFecGroup *group, MsgFecFunc func, gpointer user_data)
+{
+    guint   missing[MSG_FEC_MAX_PARITY];
+    guint   rows[MSG_FEC_MAX_PARITY];
+    guint8  matrix[MSG_FEC_MAX_PARITY * MSG_FEC_MAX_PARITY];
+    guint   n = 0, r = 0, delivered = 0;
+    gsize   size = group->size;
+
+    for (guint i = 0; i < group->data; i++) {
+        if (!(group->have & (G_GUINT64_CONSTANT(1) << i))) {
+            missing[n++] = i;
+        } else if ((gsize) group->length[i] + 2 > size) {
+            return 0;               // Inconsistent with the parity
+        }
+    }
+    for (guint j = 0; j < group->parity && r < n; j++) {
+        if (group->have_parity & (1u << j))
+            rows[r++] = j;
+    }
+
+    // Syndromes, in place in the parity shards
+    for (guint a = 0; a < r; a++) {
+        guint8 *syndrome = group->shards + (PARITY_INDEX + rows[a]) * SHARD_SIZE;
+
+        for (guint i = 0; i < group->data; i++) {
+            guint8 *shard = group->shards + i * SHARD_SIZE;
+
+            if (!(group->have & (G_GUINT64_CONSTANT(1) << i)))
+                continue;
+            if (a == 0)
+                memset(shard + group->length[i] + 2, 0, size - group->length[i] - 2);
+            msg_gf_mul_add(syndrome, shard, coefficient(rows[a], i), size);
+        }
+    }
+
+    for (guint a = 0; a < n; a++)
+        for (guint b = 0; b < n; b++)
+            matrix[a * n + b] = coefficient(rows[a], missing[b]);
+    if (!msg_gf_invert(matrix, n))
+        return 0;                   // Cannot happen with a Cauchy matrix
+
+    for (guint b = 0; b < n; b++) {
+        guint8 *shard = group->shards + missing[b] * SHARD_SIZE;
+        guint   length;
+
+        memset(shard, 0, size);
+        for (guint a = 0; a < n; a++)
+            msg_gf_mul_add(shard, group->shards + (PARITY_INDEX + rows[a]) * SHARD_SIZE,
+                           matrix[b * n + a], size);
+
+        group->have |= G_GUINT64_CONSTANT(1) << missing[b];
+        length = get16(shard);
+        if (length + 2 > size)
+            continue;
+
+        D("[DEBUG] FEC recovered %08x group %u shard %u\n",
+          group->sender, group->group, missing[b]);
+        decoder->recovered++;
+        delivered++;
+        func((const gchar *) shard + 2, length, user_data);
+    }
+    return delivered;
+}
+
+gboolean
+msg_fec_is_shard (const gchar *data, gsize length)
+{
+    MsgHeader header;
+
+    return msg_header_read(data, length, &header) &&
+           header.type == MSG_TYPE_FEC &&
+           length >= MSG_HEADER_SIZE + MSG_FEC_SIZE;
+}
+
+guint
+msg_fec_decoder_receive (MsgFecDecoder *decoder,
+                         const gchar   *data,
+                         gsize          length,
+                         MsgFecFunc     func,
+                         gpointer       user_data)
+{
+    MsgHeader    header;
+    MsgFecGroup *group;
+    const gchar *payload = data + MSG_HEADER_SIZE + MSG_FEC_SIZE;
+    gsize        size    = length - MSG_HEADER_SIZE - MSG_FEC_SIZE;
+    guint        index, count, parity, held;
+    guint        delivered = 0;
+
+    if (!msg_fec_is_shard(data, length) || !msg_header_read(data, length, &header))
+        return 0;
+    index  = (guchar) data[MSG_HEADER_SIZE];
+    count  = (guchar) data[MSG_HEADER_SIZE + 1];
+    parity = (guchar) data[MSG_HEADER_SIZE + 2];
+    if (count == 0 || count > MSG_FEC_MAX_DATA || parity > MSG_FEC_MAX_PARITY)
+        return 0;
+
+    group = &decoder->groups[header.seq % MSG_FEC_GROUPS];
+    if (!group->used || group->sender != header.sender || group->group != header.seq) {
+        // A group older than the one in its slot can no longer be decoded, but
+        // its data is still good.
+        if (group->used && group->sender == header.sender &&
+            (gint32) (header.seq - group->group) < 0) {
+            if (index < count && size <= MSG_FEC_DATAGRAM) {
+                func(payload, size, user_data);
+                return 1;
+            }
+            return 0;
+        }
+
+        if (group->shards == NULL)
+            group->shards = g_malloc((MSG_FEC_MAX_DATA + MSG_FEC_MAX_PARITY) * SHARD_SIZE);
+        group->used        = TRUE;
+        group->done        = FALSE;
+        group->sender      = header.sender;
+        group->group       = header.seq;
+        group->data        = count;
+        group->parity      = parity;
+        group->have        = 0;
+        group->have_parity = 0;
+        group->size        = 0;
+    }
+
+    if (index < PARITY_INDEX) {
+        guint8 *shard = group->shards + index * SHARD_SIZE;
+
+        if (index >= count || size > MSG_FEC_DATAGRAM ||
+            (group->have & (G_GUINT64_CONSTANT(1) << index)))
+            return 0;
+
+        put16(shard, size);
+        memcpy(shard + 2, payload, size);
+        group->length[index] = size;
+        group->have |= G_GUINT64_CONSTANT(1) << index;
+        func(payload, size, user_data);
+        delivered = 1;
+    } else {
+        index -= PARITY_INDEX;
+        if (group->done || index >= parity || size < 2 || size > SHARD_SIZE ||
+            (group->have_parity & (1u << index)) ||
+            (group->size != 0 && group->size != size))
+            return 0;
+
+        memcpy(group->shards + (PARITY_INDEX + index) * SHARD_SIZE, payload, size);
+        group->have_parity |= 1u << index;
+        group->size = size;
+        group->data = MIN(count, group->data);
+    }
+
+    // Once parity has arrived, rebuild the group as soon as enough of its
+    // shards have.
+    if (group->done || group->size == 0)
+        return delivered;
+
+    held = count_bits(group->have & (G_MAXUINT64 >> (64 - group->data)));
+    if (held + count_bits(group->have_parity) < group->data)
+        return delivered;
+
+    group->done = TRUE;
+    if (held == group->data)
+        return delivered;
+    return delivered + decode(decoder, group, func, user_data);
+}
+
+MsgFecDecoder *
+msg_fec_decoder_new (void)
+{
+    msg_gf_init();
+    return g_new0(MsgFecDecoder, 1);
+}
+
+void
+msg_fec_decoder_free (MsgFecDecoder *decoder)
+{
+    if (decoder == NULL)
+        return;
+
+    for (guint i = 0; i < MSG_FEC_GROUPS; i++)
+        g_free(decoder->groups[i].shards);
+    g_free(decoder);
+}
+
+guint64
+msg_fec_decoder_get_recovered (MsgFecDecoder *decoder)
+{
+    return decoder->recovered;
+}
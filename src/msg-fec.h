@@ -0,0 +1,88 @@
+// msg-fec
+
+// Forward error correction over groups of datagrams, shared by 'router' (per
+// queue) and 'messages' (per peer).
+//
+// The code is a systematic Reed-Solomon style erasure code over GF(2^8) (see
+// msg-gf.h). Datagrams are sent in groups of up to 'data' shards; each is
+// sent at once, wrapped in a MSG_TYPE_FEC message, and 'parity' shards follow
+// when the group is full or 'delay' has passed since it was started. The
+// receiver recovers the whole group from any 'data' of its shards, so up to
+// 'parity' losses per group cost nothing, not even a round trip. Parity rows
+// are a Cauchy matrix, every square submatrix of which is invertible, so any
+// combination of shards will do, including a group closed early.
+//
+// Each shard is a MsgHeader (type MSG_TYPE_FEC, the encoder's ID as sender
+// and the group number as seq) followed by:
+//
+//   0      1      2       3
+//   index  data   parity  reserved   payload...
+//
+// A data shard's payload is the original datagram. A parity shard's covers
+// each datagram in the group prefixed with its 16 bit length and padded with
+// zeros to the longest.
+//
+// Encoder and decoder both run on a single thread, and the encoder's flush
+// timer on the default main context.
+
+#ifndef MSG_FEC_H
+#define MSG_FEC_H
+
+#include <glib.h>
+
+#include "msg-header.h"
+
+#define MSG_FEC_SIZE        4                           // After the header
+#define MSG_FEC_OVERHEAD    (MSG_HEADER_SIZE + MSG_FEC_SIZE + 2)
+#define MSG_FEC_DATAGRAM    1500                        // Largest protected datagram
+#define MSG_FEC_MAX_DATA    64
+#define MSG_FEC_MAX_PARITY  32
+#define MSG_FEC_GROUPS      16                          // Groups being decoded at once
+#define MSG_FEC_DELAY       (20 * G_TIME_SPAN_MILLISECOND)
+
+// Send, or deliver, one datagram. The data is only valid during the call.
+typedef gboolean (*MsgFecFunc) (const gchar *data, gsize length, gpointer user_data);
+
+typedef struct _MsgFecEncoder MsgFecEncoder;
+typedef struct _MsgFecDecoder MsgFecDecoder;
+
+// 'data' and 'parity' are shards per group, up to MSG_FEC_MAX_DATA and
+// MSG_FEC_MAX_PARITY. 'delay' (microseconds, 0 for MSG_FEC_DELAY) is the
+// longest a group stays open, which is the most latency FEC adds to a
+// recovered datagram.
+MsgFecEncoder *msg_fec_encoder_new     (guint       data,
+                                        guint       parity,
+                                        gint64      delay,
+                                        MsgFecFunc  send_func,
+                                        gpointer    user_data);
+void           msg_fec_encoder_free    (MsgFecEncoder *encoder);
+
+// Send a datagram as the next data shard. Datagrams longer than
+// MSG_FEC_DATAGRAM are sent as they are, unprotected. Returns the result of
+// 'send_func' for the datagram.
+gboolean       msg_fec_encoder_send    (MsgFecEncoder *encoder,
+                                        const gchar   *data,
+                                        gsize          length);
+
+// Close the current group now, sending its parity.
+void           msg_fec_encoder_flush   (MsgFecEncoder *encoder);
+
+MsgFecDecoder *msg_fec_decoder_new     (void);
+void           msg_fec_decoder_free    (MsgFecDecoder *decoder);
+
+// TRUE if 'data' is a MSG_TYPE_FEC shard.
+gboolean       msg_fec_is_shard        (const gchar *data, gsize length);
+
+// Handle a received shard. 'func' is called with the datagram a data shard
+// carries, then with any datagrams recovered from parity; each datagram is
+// delivered at most once. Returns the number delivered.
+guint          msg_fec_decoder_receive (MsgFecDecoder *decoder,
+                                        const gchar   *data,
+                                        gsize          length,
+                                        MsgFecFunc     func,
+                                        gpointer       user_data);
+
+// Datagrams recovered from parity so far.
+guint64        msg_fec_decoder_get_recovered (MsgFecDecoder *decoder);
+
+#endif // MSG_FEC_H
@@ -0,0 +1,232 @@
+// msg-gf
+
+// Arithmetic in GF(2^8). See msg-gf.h.
+
+#include <string.h>
+
+#include <glib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MSG_GF_X86
+#endif
+
+#include "msg-gf.h"
+
+#define POLYNOMIAL  0x11d
+
+typedef void (*MulAddFunc) (guint8 *dst, const guint8 *src, guint8 c, gsize length);
+
+static guint8       gf_exp[512];        // Doubled, so exp[log a + log b] needs no modulo
+static guint8       gf_log[256];
+static guint8       gf_table[256][256]; // Full products, for the scalar kernel
+static guint8       gf_low[256][16];    // c * x for x = 0..15
+static guint8       gf_high[256][16];   // c * (x << 4)
+static MulAddFunc   gf_mul_add;
+static const gchar *gf_kernel;
+
+//////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+static void
+mul_add_scalar (guint8 *dst, const guint8 *src, guint8 c, gsize length)
+{
+    const guint8 *row = gf_table[c];
+
+    for (gsize i = 0; i < length; i++)
+        dst[i] ^= row[src[i]];
+}
+
+#ifdef MSG_GF_X86
+
+__attribute__((target("ssse3")))
+static void
+mul_add_ssse3 (guint8 *dst, const guint8 *src, guint8 c, gsize length)
+{
+    __m128i low  = _mm_loadu_si128((const __m128i *) gf_low[c]);
+    __m128i high = _mm_loadu_si128((const __m128i *) gf_high[c]);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    gsize   i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i l = _mm_shuffle_epi8(low,  _mm_and_si128(x, mask));
+        __m128i h = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    mul_add_scalar(dst + i, src + i, c, length - i);
+}
+
+__attribute__((target("avx2")))
+static void
+mul_add_avx2 (guint8 *dst, const guint8 *src, guint8 c, gsize length)
+{
+    __m256i low  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) gf_low[c]));
+    __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) gf_high[c]));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    gsize   i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i l = _mm256_shuffle_epi8(low,  _mm256_and_si256(x, mask));
+        __m256i h = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    mul_add_scalar(dst + i, src + i, c, length - i);
+}
+
+#endif // MSG_GF_X86
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+msg_gf_init (void)
+{
+    static gsize initialised = 0;
+    guint        x = 1;
+
+    if (!g_once_init_enter(&initialised))
+        return;
+
+    for (guint i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= POLYNOMIAL;
+    }
+
+    for (guint a = 0; a < 256; a++) {
+        for (guint b = 0; b < 256; b++)
+            gf_table[a][b] = (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+        for (guint n = 0; n < 16; n++) {
+            gf_low[a][n]  = gf_table[a][n];
+            gf_high[a][n] = gf_table[a][n << 4];
+        }
+    }
+
+    gf_mul_add = mul_add_scalar;
+    gf_kernel  = "scalar";
+#ifdef MSG_GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_mul_add = mul_add_avx2;
+        gf_kernel  = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_mul_add = mul_add_ssse3;
+        gf_kernel  = "ssse3";
+    }
+#endif
+
+    g_once_init_leave(&initialised, 1);
+}
+
+guint8
+msg_gf_mul (guint8 a, guint8 b)
+{
+    return gf_table[a][b];
+}
+
+guint8
+msg_gf_inv (guint8 a)
+{
+    return a ? gf_exp[255 - gf_log[a]] : 0;
+}
+
+void
+msg_gf_mul_add (guint8 *dst, const guint8 *src, guint8 c, gsize length)
+{
+    if (c == 0)
+        return;
+    if (c == 1) {
+        for (gsize i = 0; i < length; i++)
+            dst[i] ^= src[i];
+        return;
+    }
+    gf_mul_add(dst, src, c, length);
+}
+
+// Gauss-Jordan elimination, with the identity built up alongside.
+gboolean
+msg_gf_invert (guint8 *m, guint n)
+{
+    guint8 *inv = g_malloc0(n * n);
+    guint8  row[256];
+
+    for (guint i = 0; i < n; i++)
+        inv[i * n + i] = 1;
+
+    for (guint col = 0; col < n; col++) {
+        guint  pivot = col;
+        guint8 scale;
+
+        while (pivot < n && m[pivot * n + col] == 0)
+            pivot++;
+        if (pivot == n) {
+            g_free(inv);
+            return FALSE;
+        }
+        if (pivot != col) {
+            memcpy(row, m + col * n, n);
+            memcpy(m + col * n, m + pivot * n, n);
+            memcpy(m + pivot * n, row, n);
+            memcpy(row, inv + col * n, n);
+            memcpy(inv + col * n, inv + pivot * n, n);
+            memcpy(inv + pivot * n, row, n);
+        }
+
+        scale = msg_gf_inv(m[col * n + col]);
+        for (guint j = 0; j < n; j++) {
+            m[col * n + j]   = gf_table[scale][m[col * n + j]];
+            inv[col * n + j] = gf_table[scale][inv[col * n + j]];
+        }
+
+        for (guint r = 0; r < n; r++) {
+            guint8 factor = m[r * n + col];
+
+            if (r == col || factor == 0)
+                continue;
+            msg_gf_mul_add(m + r * n, m + col * n, factor, n);
+            msg_gf_mul_add(inv + r * n, inv + col * n, factor, n);
+        }
+    }
+
+    memcpy(m, inv, n * n);
+    g_free(inv);
+    return TRUE;
+}
+
+const gchar *
+msg_gf_kernel (void)
+{
+    return gf_kernel;
+}
+
+gboolean
+msg_gf_set_kernel (const gchar *name)
+{
+    msg_gf_init();
+
+    if (g_strcmp0(name, "scalar") == 0) {
+        gf_mul_add = mul_add_scalar;
+        gf_kernel  = "scalar";
+        return TRUE;
+    }
+#ifdef MSG_GF_X86
+    if (g_strcmp0(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+        gf_mul_add = mul_add_ssse3;
+        gf_kernel  = "ssse3";
+        return TRUE;
+    }
+    if (g_strcmp0(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        gf_mul_add = mul_add_avx2;
+        gf_kernel  = "avx2";
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
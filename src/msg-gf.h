@@ -0,0 +1,37 @@
+// msg-gf
+
+// Arithmetic in GF(2^8), for the erasure code in msg-fec.h.
+//
+// Elements are bytes, addition is XOR and multiplication is modulo the
+// polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d). The bulk operation, adding a
+// constant multiple of one buffer to another, uses AVX2 or SSSE3 when the CPU
+// has them (checked once, at msg_gf_init()), with a table driven fallback.
+// The vector kernels split each byte into nibbles and look both up in 16 entry
+// tables with a byte shuffle, 32 (or 16) bytes per instruction.
+
+#ifndef MSG_GF_H
+#define MSG_GF_H
+
+#include <glib.h>
+
+// Build the tables and choose the kernels. Safe to call more than once.
+void        msg_gf_init     (void);
+
+guint8      msg_gf_mul      (guint8 a, guint8 b);
+guint8      msg_gf_inv      (guint8 a);
+
+// dst[i] ^= c * src[i] for 'length' bytes.
+void        msg_gf_mul_add  (guint8 *dst, const guint8 *src, guint8 c, gsize length);
+
+// Invert the n x n matrix 'm' (row major) in place. Returns FALSE if it is
+// singular.
+gboolean    msg_gf_invert   (guint8 *m, guint n);
+
+// Name of the kernel in use: "avx2", "ssse3" or "scalar".
+const gchar *msg_gf_kernel  (void);
+
+// Use the named kernel instead of the best one, eg. to compare them (see
+// fec-bench). Returns FALSE if the CPU does not have it.
+gboolean    msg_gf_set_kernel (const gchar *name);
+
+#endif // MSG_GF_H
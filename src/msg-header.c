@@ -0,0 +1,95 @@
+// msg-header
+
+// Optional binary message header. See msg-header.h.
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-header.h"
+
+static inline void
+put32 (gchar *p, guint32 value)
+{
+    value = GUINT32_TO_BE(value);
+    memcpy(p, &value, 4);
+}
+
+static inline void
+put64 (gchar *p, guint64 value)
+{
+    value = GUINT64_TO_BE(value);
+    memcpy(p, &value, 8);
+}
+
+static inline guint32
+get32 (const gchar *p)
+{
+    guint32 value;
+
+    memcpy(&value, p, 4);
+    return GUINT32_FROM_BE(value);
+}
+
+static inline guint64
+get64 (const gchar *p)
+{
+    guint64 value;
+
+    memcpy(&value, p, 8);
+    return GUINT64_FROM_BE(value);
+}
+
+gsize
+msg_header_write (const MsgHeader *header, gchar *buffer)
+{
+    buffer[0] = (gchar) MSG_HEADER_MAGIC;
+    buffer[1] = MSG_HEADER_VERSION;
+    buffer[2] = header->type;
+    buffer[3] = header->flags;
+    put32(buffer + 4,  header->sender);
+    put32(buffer + 8,  header->seq);
+    put64(buffer + 12, header->timestamp);
+
+    return MSG_HEADER_SIZE;
+}
+
+gboolean
+msg_header_read (const gchar *buffer, gsize length, MsgHeader *header)
+{
+    if (length < MSG_HEADER_SIZE ||
+        (guchar) buffer[0] != MSG_HEADER_MAGIC ||
+        buffer[1] != MSG_HEADER_VERSION)
+        return FALSE;
+
+    header->type      = buffer[2];
+    header->flags     = buffer[3];
+    header->sender    = get32(buffer + 4);
+    header->seq       = get32(buffer + 8);
+    header->timestamp = get64(buffer + 12);
+
+    return TRUE;
+}
+
+gsize
+msg_ack_write (const MsgAck *ack, gchar *buffer)
+{
+    put32(buffer,     ack->echo_seq);
+    put32(buffer + 4, ack->echo_delay);
+    put64(buffer + 8, ack->echo_timestamp);
+
+    return MSG_ACK_SIZE;
+}
+
+gboolean
+msg_ack_read (const gchar *buffer, gsize length, MsgAck *ack)
+{
+    if (length < MSG_ACK_SIZE)
+        return FALSE;
+
+    ack->echo_seq       = get32(buffer);
+    ack->echo_delay     = get32(buffer + 4);
+    ack->echo_timestamp = get64(buffer + 8);
+
+    return TRUE;
+}
@@ -0,0 +1,72 @@
+// msg-header
+
+// Optional binary message header, shared by 'router' and 'messages'.
+//
+// A sequenced message starts with a 20 byte header carrying the sender's ID,
+// a per sender sequence number and the send time, followed by a type specific
+// body. The first byte, MSG_HEADER_MAGIC, can never start UTF-8 text, so plain
+// text messages (eg. from 'nc') are still recognised as such.
+//
+//   0      1       2     3      4       8    12          20
+//   magic  version type  flags  sender  seq  timestamp   body...
+//
+// All fields are big endian.
+
+#ifndef MSG_HEADER_H
+#define MSG_HEADER_H
+
+#include <glib.h>
+
+#define MSG_HEADER_MAGIC    0xab    // A UTF-8 continuation byte
+#define MSG_HEADER_VERSION  1
+#define MSG_HEADER_SIZE     20
+#define MSG_ACK_SIZE        16
+
+typedef enum {
+    MSG_TYPE_TEXT = 0,              // Chat text follows the header
+    MSG_TYPE_ACK  = 1,              // MsgAck follows the header
+    MSG_TYPE_DATA = 2,              // File transfer fragment (see msg-transfer.h)
+    MSG_TYPE_SACK = 3,              // File transfer acknowledgement
+    MSG_TYPE_FEC  = 4,              // Erasure code shard (see msg-fec.h)
+    MSG_TYPE_BUNDLE = 5             // Several datagrams (see msg-bundle.h)
+} MsgType;
+
+// Flags
+#define MSG_FLAG_ACK_REQUEST 0x01   // Receiver should reply with MSG_TYPE_ACK
+#define MSG_FLAG_COMPRESSED  0x02   // Body is compressed (see msg-compress.h)
+
+typedef struct {
+    guint8  type;
+    guint8  flags;
+    guint32 sender;                 // Random ID chosen by each client at start
+    guint32 seq;                    // Per sender sequence number
+    gint64  timestamp;              // Send time, microseconds since the epoch
+} MsgHeader;
+
+// Acknowledgement of a received message. The sender's clock is only ever
+// compared with itself: RTT = now - echo_timestamp - echo_delay.
+typedef struct {
+    guint32 echo_seq;               // Sequence number being acknowledged
+    guint32 echo_delay;             // Microseconds held before acknowledging
+    gint64  echo_timestamp;         // The acknowledged message's timestamp
+} MsgAck;
+
+// Write a header into 'buffer', which must have MSG_HEADER_SIZE bytes.
+// Returns the number of bytes written.
+gsize    msg_header_write (const MsgHeader *header, gchar *buffer);
+
+// Parse a header. Returns FALSE if 'buffer' is not a sequenced message (eg.
+// plain text).
+gboolean msg_header_read  (const gchar *buffer, gsize length, MsgHeader *header);
+
+gsize    msg_ack_write    (const MsgAck *ack, gchar *buffer);
+gboolean msg_ack_read     (const gchar *buffer, gsize length, MsgAck *ack);
+
+// Unique ID of a message, for duplicate suppression.
+static inline guint64
+msg_header_id (const MsgHeader *header)
+{
+    return ((guint64) header->sender << 32) | header->seq;
+}
+
+#endif // MSG_HEADER_H
@@ -0,0 +1,590 @@
+// msg-history
+
+// Persistent message history. See msg-history.h.
+//
+// A record is a fixed header followed by the NUL terminated peer name and
+// text, padded to a multiple of 8 bytes, so the strings can be used directly
+// from the memory map:
+//
+//   0      4     8          16         17       18       20        24
+//   magic  size  timestamp  direction  peerlen  textlen  reserved  peer text
+//
+// Index entries are written after the record they describe. On opening, the
+// last segment's final index entry is checked against the end of its log; if
+// they disagree (a crash between or during the two writes) the segment is
+// scanned, the log truncated after its last complete record and the index
+// rebuilt. Only the last segment can be affected.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "msg-history.h"
+
+#define MSG_HISTORY_MAGIC   0x4d534731      // "MSG1"
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+typedef struct {
+    guint32 magic;
+    guint32 size;                   // Whole record, including padding
+    gint64  timestamp;
+    guint8  direction;
+    guint8  peer_length;            // Including the NUL
+    guint16 text_length;            // Including the NUL
+    guint32 reserved;
+} MsgHistoryHeader;
+
+typedef struct {
+    gint64  timestamp;
+    guint32 offset;                 // Of the record in the segment's log
+    guint32 peer;                   // msg_history_peer_hash()
+} MsgHistoryEntry;
+
+typedef struct {
+    guint64      first;             // ID of the first record
+    guint        count;             // Records
+    gsize        size;              // Bytes of log
+    GMappedFile *log;               // Mapped on demand; may be stale
+    GMappedFile *idx;
+} MsgHistorySegment;
+
+struct _MsgHistory {
+    gchar   *dir;
+    GArray  *segments;              // MsgHistorySegment, by 'first'
+    gint     log_fd;                // Last segment, opened for appending
+    gint     idx_fd;                // (-1 if read-only)
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+// FNV-1a. Stored on disk, so must never change.
+static guint32
+msg_history_peer_hash (const gchar *peer)
+{
+    guint32 hash = 2166136261u;
+
+    for (; *peer != '\0'; peer++)
+        hash = (hash ^ (guchar) *peer) * 16777619u;
+    return hash;
+}
+
+static gchar *
+msg_history_path (MsgHistory *history, guint64 first, const gchar *suffix)
+{
+    gchar  name[32];
+
+    g_snprintf(name, sizeof(name), "%016" G_GUINT64_FORMAT ".%s", first, suffix);
+    return g_build_filename(history->dir, name, NULL);
+}
+
+static MsgHistorySegment *
+msg_history_last (MsgHistory *history)
+{
+    return &g_array_index(history->segments, MsgHistorySegment, history->segments->len - 1);
+}
+
+static gint
+msg_history_segment_compare (gconstpointer a, gconstpointer b)
+{
+    guint64 x = ((const MsgHistorySegment *) a)->first;
+    guint64 y = ((const MsgHistorySegment *) b)->first;
+
+    return (x > y) - (x < y);
+}
+
+// Map (or re-map, if the file has grown past the old map) 'file' so that at
+// least 'length' bytes are visible.
+static gboolean
+msg_history_map (MsgHistory *history, GMappedFile **map, guint64 first,
+                 const gchar *suffix, gsize length)
+{
+    gchar  *path;
+    GError *error = NULL;
+
+    if (*map != NULL && g_mapped_file_get_length(*map) >= length)
+        return TRUE;
+
+    g_clear_pointer(map, g_mapped_file_unref);
+    path = msg_history_path(history, first, suffix);
+    *map = g_mapped_file_new(path, FALSE, &error);
+    if (*map == NULL) {
+        g_printerr("[ERROR] %s\n", error->message);
+        g_error_free(error);
+    }
+    g_free(path);
+
+    return *map != NULL && g_mapped_file_get_length(*map) >= length;
+}
+
+static const MsgHistoryEntry *
+msg_history_entries (MsgHistory *history, MsgHistorySegment *segment)
+{
+    if (!msg_history_map(history, &segment->idx, segment->first, "idx",
+                         segment->count * sizeof(MsgHistoryEntry)))
+        return NULL;
+    return (const MsgHistoryEntry *) g_mapped_file_get_contents(segment->idx);
+}
+
+// Validate the record at 'offset' in a log of 'length' bytes. Returns its
+// size, or 0 if it is missing or incomplete.
+static guint32
+msg_history_check (const gchar *log, gsize length, gsize offset)
+{
+    const MsgHistoryHeader *header = (const MsgHistoryHeader *) (log + offset);
+
+    if (offset + sizeof(MsgHistoryHeader) > length ||
+        header->magic != MSG_HISTORY_MAGIC ||
+        header->size < sizeof(MsgHistoryHeader) + header->peer_length + header->text_length ||
+        header->size > length - offset ||
+        header->peer_length == 0 || header->text_length == 0)
+        return 0;
+    return header->size;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Opening
+
+static gboolean
+msg_history_open_last (MsgHistory *history, GError **error)
+{
+    MsgHistorySegment *segment = msg_history_last(history);
+    gchar             *log_path = msg_history_path(history, segment->first, "log");
+    gchar             *idx_path = msg_history_path(history, segment->first, "idx");
+
+    history->log_fd = g_open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    history->idx_fd = g_open(idx_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history->log_fd < 0 || history->idx_fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Opening %s: %s", log_path, g_strerror(errno));
+        g_free(log_path);
+        g_free(idx_path);
+        return FALSE;
+    }
+    g_free(log_path);
+    g_free(idx_path);
+    return TRUE;
+}
+
+// Make the last segment's log and index agree, after a crash.
+static void
+msg_history_recover (MsgHistory *history)
+{
+    MsgHistorySegment     *segment = msg_history_last(history);
+    const MsgHistoryEntry *entries;
+    const gchar           *log;
+    GArray                *rebuilt;
+    gsize                  offset = 0;
+    guint32                size;
+
+    if (!msg_history_map(history, &segment->log, segment->first, "log", segment->size))
+        return;
+    log = g_mapped_file_get_contents(segment->log);
+
+    // The common case: the last entry describes the last record in the log.
+    entries = msg_history_entries(history, segment);
+    if (entries != NULL) {
+        if (segment->count == 0 && segment->size == 0)
+            return;
+        if (segment->count > 0) {
+            offset = entries[segment->count - 1].offset;
+            size   = msg_history_check(log, segment->size, offset);
+            if (size != 0 && offset + size == segment->size)
+                return;
+        }
+    }
+
+    g_printerr("[ERROR] History segment %" G_GUINT64_FORMAT " incomplete, recovering\n",
+               segment->first);
+
+    rebuilt = g_array_new(FALSE, FALSE, sizeof(MsgHistoryEntry));
+    offset  = 0;
+    while ((size = msg_history_check(log, segment->size, offset)) != 0) {
+        const MsgHistoryHeader *header = (const MsgHistoryHeader *) (log + offset);
+        MsgHistoryEntry         entry;
+
+        entry.timestamp = header->timestamp;
+        entry.offset    = offset;
+        entry.peer      = msg_history_peer_hash((const gchar *) (header + 1));
+        g_array_append_val(rebuilt, entry);
+        offset += size;
+    }
+
+    // Rewrite both files; the appending descriptors are opened afterwards.
+    g_clear_pointer(&segment->log, g_mapped_file_unref);
+    g_clear_pointer(&segment->idx, g_mapped_file_unref);
+    {
+        gchar *log_path = msg_history_path(history, segment->first, "log");
+        gchar *idx_path = msg_history_path(history, segment->first, "idx");
+
+        if (truncate(log_path, offset) < 0)
+            g_printerr("[ERROR] truncate %s: %s\n", log_path, g_strerror(errno));
+        if (!g_file_set_contents(idx_path, rebuilt->data,
+                                 rebuilt->len * sizeof(MsgHistoryEntry), NULL))
+            g_printerr("[ERROR] Rewriting %s\n", idx_path);
+        g_free(log_path);
+        g_free(idx_path);
+    }
+
+    segment->count = rebuilt->len;
+    segment->size  = offset;
+    g_array_free(rebuilt, TRUE);
+}
+
+static MsgHistory *
+msg_history_open_full (const gchar *dir, gboolean readonly, GError **error)
+{
+    MsgHistory  *history;
+    GDir        *gdir;
+    const gchar *name;
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Creating %s: %s", dir, g_strerror(errno));
+        return NULL;
+    }
+    gdir = g_dir_open(dir, 0, error);
+    if (gdir == NULL)
+        return NULL;
+
+    history = g_new0(MsgHistory, 1);
+    history->dir      = g_strdup(dir);
+    history->segments = g_array_new(FALSE, TRUE, sizeof(MsgHistorySegment));
+    history->log_fd   = -1;
+    history->idx_fd   = -1;
+
+    // Only the sizes of each segment's files are needed to open it.
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        MsgHistorySegment  segment = { 0 };
+        GStatBuf           st;
+        gchar             *end, *path;
+
+        if (!g_str_has_suffix(name, ".log"))
+            continue;
+        segment.first = g_ascii_strtoull(name, &end, 10);
+        if (strcmp(end, ".log") != 0)
+            continue;
+
+        path = msg_history_path(history, segment.first, "log");
+        if (g_stat(path, &st) == 0)
+            segment.size = st.st_size;
+        g_free(path);
+        path = msg_history_path(history, segment.first, "idx");
+        if (g_stat(path, &st) == 0)
+            segment.count = st.st_size / sizeof(MsgHistoryEntry);
+        g_free(path);
+
+        g_array_append_val(history->segments, segment);
+    }
+    g_dir_close(gdir);
+
+    if (history->segments->len == 0) {
+        MsgHistorySegment segment = { 0 };
+
+        g_array_append_val(history->segments, segment);
+    } else {
+        g_array_sort(history->segments, msg_history_segment_compare);
+        if (!readonly)
+            msg_history_recover(history);
+    }
+
+    // A read-only view may see a record whose index entry is still being
+    // written; the entry count excludes it.
+    if (readonly)
+        return history;
+
+    if (!msg_history_open_last(history, error)) {
+        msg_history_close(history);
+        return NULL;
+    }
+
+    D("[DEBUG] History: %u segments, %" G_GUINT64_FORMAT " records\n",
+      history->segments->len, msg_history_get_count(history));
+    return history;
+}
+
+MsgHistory *
+msg_history_open (const gchar *dir, GError **error)
+{
+    return msg_history_open_full(dir, FALSE, error);
+}
+
+MsgHistory *
+msg_history_open_readonly (const gchar *dir, GError **error)
+{
+    return msg_history_open_full(dir, TRUE, error);
+}
+
+void
+msg_history_close (MsgHistory *history)
+{
+    if (history == NULL)
+        return;
+
+    for (guint i = 0; i < history->segments->len; i++) {
+        MsgHistorySegment *segment = &g_array_index(history->segments, MsgHistorySegment, i);
+
+        g_clear_pointer(&segment->log, g_mapped_file_unref);
+        g_clear_pointer(&segment->idx, g_mapped_file_unref);
+    }
+    if (history->log_fd >= 0)
+        close(history->log_fd);
+    if (history->idx_fd >= 0)
+        close(history->idx_fd);
+    g_array_free(history->segments, TRUE);
+    g_free(history->dir);
+    g_free(history);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Writing
+
+static gboolean
+msg_history_write (gint fd, const gchar *data, gsize length)
+{
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        data   += n;
+        length -= n;
+    }
+    return TRUE;
+}
+
+// Start a new segment for records from the current count.
+static gboolean
+msg_history_roll (MsgHistory *history)
+{
+    MsgHistorySegment segment = { 0 };
+
+    segment.first = msg_history_get_count(history);
+
+    close(history->log_fd);
+    close(history->idx_fd);
+    g_array_append_val(history->segments, segment);
+
+    return msg_history_open_last(history, NULL);
+}
+
+gint64
+msg_history_append (MsgHistory          *history,
+                    gint64               timestamp,
+                    MsgHistoryDirection  direction,
+                    const gchar         *peer,
+                    const gchar         *text)
+{
+    MsgHistorySegment *segment = msg_history_last(history);
+    MsgHistoryHeader  *header;
+    MsgHistoryEntry    entry;
+    gsize              peer_length = MIN(strlen(peer), G_MAXUINT8 - 1) + 1;
+    gsize              text_length = MIN(strlen(text), G_MAXUINT16 - 1) + 1;
+    gsize              size;
+    gchar             *record;
+
+    if (history->log_fd < 0)
+        return -1;
+
+    size = (sizeof(MsgHistoryHeader) + peer_length + text_length + 7) & ~(gsize) 7;
+
+    if (segment->count > 0 && segment->size + size > MSG_HISTORY_SEGMENT) {
+        if (!msg_history_roll(history)) {
+            g_printerr("[ERROR] Starting history segment: %s\n", g_strerror(errno));
+            return -1;
+        }
+        segment = msg_history_last(history);
+    }
+
+    record = g_malloc0(size);
+    header = (MsgHistoryHeader *) record;
+    header->magic       = MSG_HISTORY_MAGIC;
+    header->size        = size;
+    header->timestamp   = timestamp;
+    header->direction   = direction;
+    header->peer_length = peer_length;
+    header->text_length = text_length;
+    memcpy(record + sizeof(MsgHistoryHeader), peer, peer_length - 1);
+    memcpy(record + sizeof(MsgHistoryHeader) + peer_length, text, text_length - 1);
+
+    entry.timestamp = timestamp;
+    entry.offset    = segment->size;
+    entry.peer      = msg_history_peer_hash(record + sizeof(MsgHistoryHeader));
+
+    // The record first: an entry is never written for a record that is not
+    // complete.
+    if (!msg_history_write(history->log_fd, record, size) ||
+        !msg_history_write(history->idx_fd, (const gchar *) &entry, sizeof(entry))) {
+        g_printerr("[ERROR] Writing history: %s\n", g_strerror(errno));
+        g_free(record);
+        return -1;
+    }
+    g_free(record);
+
+    segment->size += size;
+    return segment->first + segment->count++;
+}
+
+guint64
+msg_history_get_count (MsgHistory *history)
+{
+    MsgHistorySegment *segment = msg_history_last(history);
+
+    return segment->first + segment->count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Reading
+
+// Index of the segment holding record 'id'.
+static guint
+msg_history_segment_of (MsgHistory *history, guint64 id)
+{
+    guint lo = 0, hi = history->segments->len - 1;
+
+    while (lo < hi) {
+        guint mid = (lo + hi + 1) / 2;
+
+        if (g_array_index(history->segments, MsgHistorySegment, mid).first <= id)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Visit records 'from' up to 'to' (indexes within the segment), optionally
+// only those whose peer hash is 'peer' and timestamp is below 'before'.
+static guint
+msg_history_visit (MsgHistory        *history,
+                   MsgHistorySegment *segment,
+                   guint              from,
+                   guint              to,
+                   const gchar       *peer,
+                   gint64             before,
+                   MsgHistoryFunc     func,
+                   gpointer           user_data,
+                   gboolean          *stop)
+{
+    const MsgHistoryEntry *entries = msg_history_entries(history, segment);
+    const gchar           *log;
+    guint32                hash = peer != NULL ? msg_history_peer_hash(peer) : 0;
+    guint                  visited = 0;
+
+    if (entries == NULL || from >= to)
+        return 0;
+    if (!msg_history_map(history, &segment->log, segment->first, "log", segment->size))
+        return 0;
+    log = g_mapped_file_get_contents(segment->log);
+
+    for (guint i = from; i < to && !*stop; i++) {
+        const MsgHistoryHeader *header;
+        MsgHistoryRecord        record;
+
+        if (entries[i].timestamp >= before)
+            break;
+        if (peer != NULL && entries[i].peer != hash)
+            continue;
+
+        header           = (const MsgHistoryHeader *) (log + entries[i].offset);
+        record.id        = segment->first + i;
+        record.timestamp = header->timestamp;
+        record.direction = header->direction;
+        record.peer      = (const gchar *) (header + 1);
+        record.text      = record.peer + header->peer_length;
+
+        if (peer != NULL && strcmp(record.peer, peer) != 0)
+            continue;
+
+        visited++;
+        if (!func(&record, user_data))
+            *stop = TRUE;
+    }
+    return visited;
+}
+
+guint
+msg_history_read (MsgHistory     *history,
+                  guint64         first,
+                  guint64         last,
+                  MsgHistoryFunc  func,
+                  gpointer        user_data)
+{
+    gboolean stop = FALSE;
+    guint    visited = 0;
+
+    last = MIN(last, msg_history_get_count(history));
+
+    for (guint i = msg_history_segment_of(history, first);
+         i < history->segments->len && first < last && !stop; i++) {
+        MsgHistorySegment *segment = &g_array_index(history->segments, MsgHistorySegment, i);
+        guint              to = MIN(last - segment->first, segment->count);
+
+        visited += msg_history_visit(history, segment, first - segment->first, to,
+                                     NULL, G_MAXINT64, func, user_data, &stop);
+        first = segment->first + segment->count;
+    }
+    return visited;
+}
+
+guint
+msg_history_find (MsgHistory     *history,
+                  gint64          from,
+                  gint64          to,
+                  const gchar    *peer,
+                  MsgHistoryFunc  func,
+                  gpointer        user_data)
+{
+    gboolean stop = FALSE;
+    guint    visited = 0;
+
+    for (guint i = 0; i < history->segments->len && !stop; i++) {
+        MsgHistorySegment     *segment = &g_array_index(history->segments, MsgHistorySegment, i);
+        const MsgHistoryEntry *entries;
+        guint                  lo, hi;
+
+        if (segment->count == 0)
+            continue;
+        entries = msg_history_entries(history, segment);
+        if (entries == NULL)
+            continue;
+
+        // Segments are in time order, so skip those wholly before 'from' and
+        // stop at the first wholly after 'to'.
+        if (entries[segment->count - 1].timestamp < from)
+            continue;
+        if (entries[0].timestamp >= to)
+            break;
+
+        // First entry at or after 'from'.
+        lo = 0;
+        hi = segment->count;
+        while (lo < hi) {
+            guint mid = (lo + hi) / 2;
+
+            if (entries[mid].timestamp < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        visited += msg_history_visit(history, segment, lo, segment->count,
+                                     peer, to, func, user_data, &stop);
+    }
+    return visited;
+}
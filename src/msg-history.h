@@ -0,0 +1,87 @@
+// msg-history
+
+// Persistent message history for 'messages'.
+//
+// Every message sent or received is appended to a log, split into segments of
+// up to MSG_HISTORY_SEGMENT bytes. Segments are named after the ID of their
+// first record, and records are numbered from 0 in the order written, so a
+// record is found from its ID alone. Each segment has an index file alongside
+// it with one fixed size entry per record (time, offset and a hash of the
+// peer), so records can be located by ID, time or peer without reading the
+// log itself.
+//
+// Segments are read through read-only memory maps: restoring the last few
+// lines at startup touches only the pages holding them, however large the
+// history. Records are never modified once written; a record left incomplete
+// by a crash is discarded when the history is next opened.
+//
+//   <dir>/0000000000000000.log   records 0...
+//   <dir>/0000000000000000.idx
+//   <dir>/0000000000012345.log   records 12345...
+//   <dir>/0000000000012345.idx
+
+#ifndef MSG_HISTORY_H
+#define MSG_HISTORY_H
+
+#include <glib.h>
+
+#define MSG_HISTORY_SEGMENT (4 * 1024 * 1024)
+
+typedef enum {
+    MSG_HISTORY_RECEIVED = 0,
+    MSG_HISTORY_SENT     = 1
+} MsgHistoryDirection;
+
+// A record, as passed to a MsgHistoryFunc. 'peer' and 'text' point into the
+// memory map and are only valid during the call.
+typedef struct {
+    guint64      id;
+    gint64       timestamp;     // Microseconds since the epoch
+    guint8       direction;     // MsgHistoryDirection
+    const gchar *peer;
+    const gchar *text;
+} MsgHistoryRecord;
+
+// Return FALSE to stop.
+typedef gboolean (*MsgHistoryFunc) (const MsgHistoryRecord *record, gpointer user_data);
+
+typedef struct _MsgHistory MsgHistory;
+
+// Open (creating if needed) the history in 'dir'.
+MsgHistory *msg_history_open      (const gchar *dir, GError **error);
+
+// Open a read-only view of the records written so far, eg. for another thread
+// while the history is being appended to. It does not see later records.
+MsgHistory *msg_history_open_readonly (const gchar *dir, GError **error);
+
+void        msg_history_close     (MsgHistory *history);
+
+// Append a record. Returns its ID, or -1 if it could not be written.
+gint64      msg_history_append    (MsgHistory          *history,
+                                   gint64               timestamp,
+                                   MsgHistoryDirection  direction,
+                                   const gchar         *peer,
+                                   const gchar         *text);
+
+// Number of records, which is also the ID of the next record.
+guint64     msg_history_get_count (MsgHistory *history);
+
+// Call 'func' for records 'first' up to (not including) 'last', oldest first.
+// Returns the number of records visited.
+guint       msg_history_read      (MsgHistory     *history,
+                                   guint64         first,
+                                   guint64         last,
+                                   MsgHistoryFunc  func,
+                                   gpointer        user_data);
+
+// Call 'func' for records with 'from' <= timestamp < 'to', oldest first, from
+// 'peer' (or any peer if NULL). Only segments overlapping the time range are
+// read. Returns the number of records visited.
+guint       msg_history_find      (MsgHistory     *history,
+                                   gint64          from,
+                                   gint64          to,
+                                   const gchar    *peer,
+                                   MsgHistoryFunc  func,
+                                   gpointer        user_data);
+
+#endif // MSG_HISTORY_H
@@ -0,0 +1,360 @@
+// msg-peer
+
+// Send context for a 'messages' peer. See msg-peer.h.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "msg-bundle.h"
+#include "msg-fec.h"
+#include "msg-peer.h"
+#include "msg-stage.h"
+
+#define MSG_PEER_RETRY  (5 * G_USEC_PER_SEC)   // After a failed resolution
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+struct _MsgPeer {
+    gchar                  *host;
+    guint16                 port;
+    gint64                  ttl;
+
+    gint                    fd;             // Connected socket, -1 if none
+    gint                    family;
+    gint64                  expires;        // When to re-resolve 'host'
+    gboolean                resolved;       // Address known at least once
+
+    GResolver              *resolver;
+    GCancellable           *cancellable;    // Set while a lookup is running
+    GQueue                  pending;        // GBytes waiting for an address
+    MsgFecEncoder          *fec;            // NULL unless protected
+    MsgBundler             *bundler;        // NULL unless bundling
+    MsgPipeline            *pipeline;       // Send stages, not owned
+    gchar                  *buffer;         // For the stages to work in
+    gsize                   buffer_size;
+
+    guint64                 dropped;
+};
+
+static void msg_peer_resolve (MsgPeer *peer);
+
+//////////////////////////////////////////////////////////////////////////////
+// Socket
+
+// Connect the peer's socket to 'address', reopening it if the address family
+// changed.
+static gboolean
+msg_peer_connect (MsgPeer *peer, GInetAddress *address)
+{
+    GSocketAddress          *sockaddr;
+    struct sockaddr_storage  native;
+    gint                     family;
+
+    sockaddr = g_inet_socket_address_new(address, peer->port);
+    if (!g_socket_address_to_native(sockaddr, &native, sizeof(native), NULL)) {
+        g_object_unref(sockaddr);
+        return FALSE;
+    }
+    g_object_unref(sockaddr);
+
+    family = native.ss_family;
+    if (peer->fd >= 0 && peer->family != family) {
+        close(peer->fd);
+        peer->fd = -1;
+    }
+    if (peer->fd < 0) {
+        // Non-blocking, so a full socket buffer drops a message rather than
+        // stalling the main loop.
+        peer->fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (peer->fd < 0) {
+            g_printerr("[ERROR] socket: %s\n", g_strerror(errno));
+            return FALSE;
+        }
+        peer->family = family;
+    }
+
+    if (connect(peer->fd, (struct sockaddr *) &native,
+                family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                   : sizeof(struct sockaddr_in)) < 0) {
+        g_printerr("[ERROR] connect %s:%d: %s\n",
+                   peer->host, peer->port, g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+msg_peer_write (MsgPeer *peer, const gchar *data, gsize length)
+{
+    ssize_t n;
+
+    do {
+        n = send(peer->fd, data, length, 0);
+    // A connected UDP socket reports ICMP errors from earlier datagrams on a
+    // later send; they do not apply to this one.
+    } while (n < 0 && (errno == EINTR || errno == ECONNREFUSED));
+
+    if (n < 0) {
+        D("[DEBUG] send %s:%d: %s\n", peer->host, peer->port, g_strerror(errno));
+        peer->dropped++;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+msg_peer_flush (MsgPeer *peer)
+{
+    GBytes *bytes;
+    gsize   length;
+
+    while ((bytes = g_queue_pop_head(&peer->pending)) != NULL) {
+        const gchar *data = g_bytes_get_data(bytes, &length);
+
+        if (peer->fd >= 0)
+            msg_peer_write(peer, data, length);
+        else
+            peer->dropped++;
+        g_bytes_unref(bytes);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Address resolution
+
+static void
+msg_peer_resolved (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    MsgPeer      *peer = user_data;
+    GList        *addresses, *l;
+    GInetAddress *address = NULL;
+    GError       *error = NULL;
+
+    addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source), result, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        // The peer was freed or its address changed.
+        g_error_free(error);
+        return;
+    }
+    g_clear_object(&peer->cancellable);
+
+    if (error != NULL) {
+        g_printerr("[ERROR] Resolving %s: %s\n", peer->host, error->message);
+        g_error_free(error);
+        peer->expires = g_get_monotonic_time() + MSG_PEER_RETRY;
+        if (!peer->resolved)
+            msg_peer_flush(peer);       // Nowhere to send them
+        return;
+    }
+
+    // Prefer IPv4, as the router only listens on IPv4.
+    for (l = addresses; l != NULL; l = l->next) {
+        if (g_inet_address_get_family(l->data) == G_SOCKET_FAMILY_IPV4) {
+            address = l->data;
+            break;
+        }
+    }
+    if (address == NULL)
+        address = addresses->data;
+
+    if (msg_peer_connect(peer, address)) {
+        gchar *str = g_inet_address_to_string(address);
+
+        D("[DEBUG] Peer %s resolved to %s\n", peer->host, str);
+        g_free(str);
+        peer->resolved = TRUE;
+    }
+    peer->expires = g_get_monotonic_time() + peer->ttl;
+    g_resolver_free_addresses(addresses);
+
+    msg_peer_flush(peer);
+}
+
+static void
+msg_peer_resolve (MsgPeer *peer)
+{
+    GInetAddress *literal;
+
+    if (peer->cancellable != NULL)
+        return;                         // Already resolving
+
+    // Numeric addresses need no lookup and never expire.
+    literal = g_inet_address_new_from_string(peer->host);
+    if (literal != NULL) {
+        peer->resolved = msg_peer_connect(peer, literal);
+        peer->expires  = G_MAXINT64;
+        g_object_unref(literal);
+        msg_peer_flush(peer);
+        return;
+    }
+
+    peer->cancellable = g_cancellable_new();
+    g_resolver_lookup_by_name_async(peer->resolver, peer->host, peer->cancellable,
+                                    msg_peer_resolved, peer);
+}
+
+static void
+msg_peer_cancel (MsgPeer *peer)
+{
+    if (peer->cancellable != NULL) {
+        g_cancellable_cancel(peer->cancellable);
+        g_clear_object(&peer->cancellable);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+MsgPeer *
+msg_peer_new (const gchar *host, guint16 port, gint64 ttl)
+{
+    MsgPeer *peer = g_new0(MsgPeer, 1);
+
+    peer->host     = g_strdup(host);
+    peer->port     = port;
+    peer->ttl      = ttl > 0 ? ttl : MSG_PEER_TTL;
+    peer->fd       = -1;
+    peer->resolver = g_resolver_get_default();
+    g_queue_init(&peer->pending);
+
+    msg_peer_resolve(peer);
+    return peer;
+}
+
+void
+msg_peer_free (MsgPeer *peer)
+{
+    if (peer == NULL)
+        return;
+
+    msg_peer_cancel(peer);
+    msg_bundler_free(peer->bundler);
+    msg_fec_encoder_free(peer->fec);
+    g_free(peer->buffer);
+    g_queue_clear_full(&peer->pending, (GDestroyNotify) g_bytes_unref);
+    if (peer->fd >= 0)
+        close(peer->fd);
+    g_object_unref(peer->resolver);
+    g_free(peer->host);
+    g_free(peer);
+}
+
+void
+msg_peer_set_address (MsgPeer *peer, const gchar *host, guint16 port)
+{
+    if (g_strcmp0(peer->host, host) == 0 && peer->port == port)
+        return;
+
+    msg_peer_cancel(peer);
+    g_free(peer->host);
+    peer->host     = g_strdup(host);
+    peer->port     = port;
+    peer->resolved = FALSE;
+    if (peer->fd >= 0) {
+        close(peer->fd);
+        peer->fd = -1;
+    }
+    msg_peer_resolve(peer);
+}
+
+// Send one datagram (or FEC shard) as it is.
+static gboolean
+msg_peer_transmit (const gchar *data, gsize length, gpointer user_data)
+{
+    MsgPeer *peer = user_data;
+
+    // Refresh an expired address in the background; until it completes keep
+    // sending to the old one.
+    if (g_get_monotonic_time() >= peer->expires)
+        msg_peer_resolve(peer);
+
+    if (!peer->resolved) {
+        if (peer->cancellable == NULL ||
+            g_queue_get_length(&peer->pending) >= MSG_PEER_PENDING) {
+            peer->dropped++;
+            return FALSE;
+        }
+        g_queue_push_tail(&peer->pending, g_bytes_new(data, length));
+        return TRUE;
+    }
+
+    return msg_peer_write(peer, data, length);
+}
+
+// Send a datagram, or bundle, with any FEC.
+static gboolean
+msg_peer_encode (const gchar *data, gsize length, gpointer user_data)
+{
+    MsgPeer *peer = user_data;
+
+    if (peer->fec != NULL)
+        return msg_fec_encoder_send(peer->fec, data, length);
+    return msg_peer_transmit(data, length, peer);
+}
+
+void
+msg_peer_set_fec (MsgPeer *peer, guint data, guint parity)
+{
+    g_clear_pointer(&peer->fec, msg_fec_encoder_free);
+    if (data > 0 && parity > 0)
+        peer->fec = msg_fec_encoder_new(data, parity, 0, msg_peer_transmit, peer);
+}
+
+void
+msg_peer_set_bundle (MsgPeer *peer, gsize size, gint64 delay)
+{
+    g_clear_pointer(&peer->bundler, msg_bundler_free);
+    if (size > 0)
+        peer->bundler = msg_bundler_new(size, delay, msg_peer_encode, peer);
+}
+
+void
+msg_peer_set_pipeline (MsgPeer *peer, MsgPipeline *pipeline)
+{
+    peer->pipeline = pipeline;
+}
+
+gboolean
+msg_peer_send (MsgPeer *peer, const gchar *data, gsize length)
+{
+    // The stages work on a copy of the datagram, with room around it.
+    if (msg_pipeline_get_length(peer->pipeline) > 0) {
+        MsgPacket packet;
+        gsize     size = MSG_STAGE_HEADROOM + length + MSG_STAGE_TAILROOM;
+
+        if (size > peer->buffer_size) {
+            peer->buffer      = g_realloc(peer->buffer, size);
+            peer->buffer_size = size;
+        }
+        msg_packet_init(&packet, peer->buffer, size, length);
+        memcpy(packet.data, data, length);
+
+        if (msg_pipeline_process(peer->pipeline, MSG_STAGE_OUT, &packet, 1) == 0) {
+            peer->dropped++;
+            return FALSE;
+        }
+        data   = packet.data;
+        length = packet.length;
+    }
+
+    if (peer->bundler != NULL)
+        return msg_bundler_send(peer->bundler, data, length);
+    return msg_peer_encode(data, length, peer);
+}
+
+guint64
+msg_peer_get_dropped (MsgPeer *peer)
+{
+    return peer->dropped;
+}
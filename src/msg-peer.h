@@ -0,0 +1,54 @@
+// msg-peer
+
+// Send context for a 'messages' peer.
+//
+// Each peer keeps one connected UDP socket, so sending a message is a single
+// send(2) with no per message socket or address lookup. Host names are
+// resolved asynchronously with GResolver (on GLib's worker threads), so DNS
+// never stalls the GTK main loop. The resolved address is cached for 'ttl'
+// and then refreshed in the background while sends continue to the cached
+// address. Messages sent before the first resolution completes are held (up to
+// MSG_PEER_PENDING) and flushed when it does.
+//
+// A MsgPeer must only be used from the thread running the default main
+// context.
+
+#ifndef MSG_PEER_H
+#define MSG_PEER_H
+
+#include <glib.h>
+
+#include "msg-stage.h"
+
+#define MSG_PEER_PENDING    64              // Messages held while resolving
+#define MSG_PEER_TTL        (300 * G_USEC_PER_SEC)
+
+typedef struct _MsgPeer MsgPeer;
+
+// 'ttl' is in microseconds; 0 uses MSG_PEER_TTL.
+MsgPeer  *msg_peer_new          (const gchar *host, guint16 port, gint64 ttl);
+void      msg_peer_free         (MsgPeer *peer);
+
+// Change the peer's address. Does nothing if it is unchanged.
+void      msg_peer_set_address  (MsgPeer *peer, const gchar *host, guint16 port);
+
+// Protect what is sent with forward error correction: 'parity' shards for
+// every 'data' datagrams (see msg-fec.h). 'data' 0 turns it off.
+void      msg_peer_set_fec      (MsgPeer *peer, guint data, guint parity);
+
+// Pack datagrams sent close together into bundles of up to 'size' bytes,
+// holding each at most 'delay' microseconds (see msg-bundle.h). 'size' 0
+// turns it off.
+void      msg_peer_set_bundle   (MsgPeer *peer, gsize size, gint64 delay);
+
+// Run what is sent through 'pipeline' (see msg-stage.h), before any FEC. The
+// pipeline is not owned by the peer and may be shared between peers.
+void      msg_peer_set_pipeline (MsgPeer *peer, MsgPipeline *pipeline);
+
+// Send one datagram. Returns FALSE if it was dropped: the send failed, or the
+// address is not yet known and the pending queue is full.
+gboolean  msg_peer_send         (MsgPeer *peer, const gchar *data, gsize length);
+
+guint64   msg_peer_get_dropped  (MsgPeer *peer);
+
+#endif // MSG_PEER_H
@@ -0,0 +1,363 @@
+// msg-receiver
+
+// Network receive thread for 'messages'. See msg-receiver.h.
+
+#define _GNU_SOURCE // recvmmsg()
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "msg-bundle.h"
+#include "msg-fec.h"
+#include "msg-receiver.h"
+#include "msg-stage.h"
+#include "msg-trace.h"
+
+#define POLL_MSEC       100         // How often the I/O thread checks 'running'
+#define FULL_USEC       1000        // Back off while the ring is full
+
+// Tracepoints fired here (msg-trace.h)
+MSG_TRACE_SEMAPHORE(messages, receive)
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+#define SLOT_SIZE       (MSG_STAGE_HEADROOM + MSG_RECEIVER_SIZE + MSG_STAGE_TAILROOM + 1)
+
+typedef struct {
+    MsgReceived  message;           // 'body' is set on delivery
+    gsize        offset;            // Of the body within 'data'
+    gsize        start;             // Of the datagram within 'data'
+    gsize        length;            // Of the datagram
+    gchar        data[SLOT_SIZE];   // Room around the datagram for stages
+} MsgReceiverSlot;
+
+typedef struct {
+    GSource      source;
+    MsgReceiver *receiver;
+} MsgReceiverSource;
+
+struct _MsgReceiver {
+    gint              fd;
+    MsgDedup         *dedup;
+    MsgPipeline      *pipeline;
+    MsgReceiverFunc   func;
+    gpointer          user_data;
+
+    MsgFecDecoder    *fec;
+    struct sockaddr_in fec_from;    // Of the shard or bundle being unpacked
+    GQueue            recovered;    // Sender and datagram from either, waiting for a slot
+
+    MsgReceiverSlot  *slots;
+    guint             mask;
+    guint             head;         // Next slot to deliver; main loop only writes
+    guint             tail;         // Next slot to fill; I/O thread only writes
+
+    GSource          *source;
+    GThread          *thread;
+    gint              running;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// I/O thread
+
+// Parse a received datagram in place. Returns FALSE if it is a duplicate.
+static gboolean
+msg_receiver_parse (MsgReceiver *receiver, MsgReceiverSlot *slot, gint64 now)
+{
+    MsgReceived *message = &slot->message;
+    gchar       *data = slot->data + slot->start;
+
+    data[slot->length] = '\0';
+
+    // Sequenced messages carry a header; plain text (eg. from nc) does not.
+    message->received  = now;
+    message->sequenced = msg_header_read(data, slot->length, &message->header);
+
+    // Retransmissions and multipath delivery repeat messages. Drop them before
+    // they reach the main loop. Only sequenced text has an ID to tell a
+    // repeat by: plain text may well say "ok" twice on purpose.
+    if (receiver->dedup != NULL && message->sequenced &&
+        message->header.type == MSG_TYPE_TEXT &&
+        msg_dedup_check(receiver->dedup, msg_header_id(&message->header),
+                        g_get_monotonic_time())) {
+        D("[DEBUG] Duplicate message dropped\n");
+        return FALSE;
+    }
+    slot->offset       = slot->start + (message->sequenced ? MSG_HEADER_SIZE : 0);
+    message->length    = slot->length - (slot->offset - slot->start);
+
+    return TRUE;
+}
+
+// Run 'count' slots from 'first' through the stages.
+static void
+msg_receiver_stages (MsgReceiver *receiver, guint first, guint count)
+{
+    MsgPacket packets[MSG_STAGE_BATCH];
+
+    for (guint done = 0; done < count; done += MSG_STAGE_BATCH) {
+        guint n = MIN(count - done, MSG_STAGE_BATCH);
+
+        for (guint i = 0; i < n; i++) {
+            MsgReceiverSlot *slot = &receiver->slots[(first + done + i) & receiver->mask];
+
+            packets[i].data     = slot->data + slot->start;
+            packets[i].length   = slot->length;
+            packets[i].headroom = slot->start;
+            packets[i].tailroom = SLOT_SIZE - 1 - slot->start - slot->length;
+        }
+        msg_pipeline_process(receiver->pipeline, MSG_STAGE_IN, packets, n);
+        for (guint i = 0; i < n; i++) {
+            MsgReceiverSlot *slot = &receiver->slots[(first + done + i) & receiver->mask];
+
+            slot->start  = packets[i].data - slot->data;
+            slot->length = packets[i].length;
+        }
+    }
+}
+
+// Queue a datagram from a shard or bundle for a slot of its own.
+static gboolean
+msg_receiver_recovered (const gchar *data, gsize length, gpointer user_data)
+{
+    MsgReceiver *receiver = user_data;
+    gchar       *copy;
+
+    if (msg_bundle_is_bundle(data, length))
+        return msg_bundle_unpack(data, length, msg_receiver_recovered, receiver) > 0;
+
+    copy = g_malloc(sizeof(struct sockaddr_in) + length);
+
+    memcpy(copy, &receiver->fec_from, sizeof(struct sockaddr_in));
+    memcpy(copy + sizeof(struct sockaddr_in), data, length);
+    g_queue_push_tail(&receiver->recovered,
+                      g_bytes_new_take(copy, sizeof(struct sockaddr_in) + length));
+    return TRUE;
+}
+
+// Receive up to 'count' datagrams into the free slots starting at the tail,
+// decode any FEC shards among them into the rest of the 'free' slots, run them
+// through the stages and publish them. Returns the number received, or -1 if
+// none were waiting.
+static gint
+msg_receiver_batch (MsgReceiver *receiver, guint count, guint free)
+{
+    struct mmsghdr  msgs[MSG_RECEIVER_BATCH];
+    struct iovec    iov[MSG_RECEIVER_BATCH];
+    guint           tail = receiver->tail;
+    gint64          now;
+    gint            n;
+    guint           kept = 0, passed = 0;
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (guint i = 0; i < count; i++) {
+        MsgReceiverSlot *slot = &receiver->slots[(tail + i) & receiver->mask];
+
+        iov[i].iov_base            = slot->data + MSG_STAGE_HEADROOM;
+        iov[i].iov_len             = MSG_RECEIVER_SIZE;
+        msgs[i].msg_hdr.msg_iov    = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name   = &slot->message.from;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    n = recvmmsg(receiver->fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            g_printerr("[ERROR] recvmmsg: %s\n", g_strerror(errno));
+        n = 0;
+    }
+    if (n == 0 && g_queue_is_empty(&receiver->recovered))
+        return -1;
+
+    // Decode FEC shards and unpack bundles; their datagrams take slots of
+    // their own once this pass is done. The slots are not yet published, so
+    // the main loop cannot see them.
+    for (guint i = 0; i < (guint) n; i++) {
+        MsgReceiverSlot *slot = &receiver->slots[(tail + i) & receiver->mask];
+        gchar           *data = slot->data + MSG_STAGE_HEADROOM;
+
+        MSG_TRACE2(messages, receive, msgs[i].msg_len, g_get_real_time());
+        if (msg_fec_is_shard(data, msgs[i].msg_len)) {
+            receiver->fec_from = slot->message.from;
+            msg_fec_decoder_receive(receiver->fec, data, msgs[i].msg_len,
+                                    msg_receiver_recovered, receiver);
+            continue;
+        }
+        if (msg_bundle_is_bundle(data, msgs[i].msg_len)) {
+            receiver->fec_from = slot->message.from;
+            msg_receiver_recovered(data, msgs[i].msg_len, receiver);
+            continue;
+        }
+        slot->start  = MSG_STAGE_HEADROOM;
+        slot->length = msgs[i].msg_len;
+        if (kept != i)
+            receiver->slots[(tail + kept) & receiver->mask] = *slot;
+        kept++;
+    }
+
+    while (kept < free && !g_queue_is_empty(&receiver->recovered)) {
+        MsgReceiverSlot *slot = &receiver->slots[(tail + kept) & receiver->mask];
+        GBytes          *bytes = g_queue_pop_head(&receiver->recovered);
+        gsize            length;
+        const gchar     *data = g_bytes_get_data(bytes, &length);
+
+        memcpy(&slot->message.from, data, sizeof(struct sockaddr_in));
+        slot->start  = MSG_STAGE_HEADROOM;
+        slot->length = MIN(length - sizeof(struct sockaddr_in), MSG_RECEIVER_SIZE);
+        memcpy(slot->data + slot->start, data + sizeof(struct sockaddr_in), slot->length);
+        g_bytes_unref(bytes);
+        kept++;
+    }
+
+    msg_receiver_stages(receiver, tail, kept);
+
+    // Keep the messages that pass, closing up any gaps left by stages and
+    // duplicates.
+    now = g_get_real_time();
+    for (guint i = 0; i < kept; i++) {
+        MsgReceiverSlot *slot = &receiver->slots[(tail + i) & receiver->mask];
+
+        if (slot->length == 0 || !msg_receiver_parse(receiver, slot, now))
+            continue;
+        if (passed != i)
+            receiver->slots[(tail + passed) & receiver->mask] = *slot;
+        passed++;
+    }
+
+    if (passed > 0) {
+        g_atomic_int_set(&receiver->tail, tail + passed);
+        // Wake the main loop. Thread safe, and cheap if already pending.
+        g_source_set_ready_time(receiver->source, 0);
+    }
+    return n;
+}
+
+static gpointer
+msg_receiver_thread (gpointer data)
+{
+    MsgReceiver   *receiver = data;
+    struct pollfd  pfd = { .fd = receiver->fd, .events = POLLIN };
+    guint          size = receiver->mask + 1;
+
+    while (g_atomic_int_get(&receiver->running)) {
+        guint free = size - (receiver->tail - g_atomic_int_get(&receiver->head));
+
+        if (free == 0) {
+            g_usleep(FULL_USEC);
+            continue;
+        }
+
+        if (msg_receiver_batch(receiver, MIN(free, MSG_RECEIVER_BATCH), free) < 0)
+            poll(&pfd, 1, POLL_MSEC);
+    }
+
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Main loop delivery
+
+static gboolean
+msg_receiver_dispatch (GSource *source, GSourceFunc callback, gpointer data)
+{
+    MsgReceiver *receiver = ((MsgReceiverSource *) source)->receiver;
+    gint64       deadline = g_get_monotonic_time() + MSG_RECEIVER_BUDGET;
+    guint        head = receiver->head;
+    guint        tail;
+
+    g_source_set_ready_time(source, -1);
+
+    tail = g_atomic_int_get(&receiver->tail);
+    while (head != tail) {
+        MsgReceiverSlot *slot = &receiver->slots[head & receiver->mask];
+
+        slot->message.body = slot->data + slot->offset;
+        receiver->func(&slot->message, receiver->user_data);
+
+        // Hand the slot back to the I/O thread.
+        g_atomic_int_set(&receiver->head, ++head);
+
+        if (g_get_monotonic_time() >= deadline)
+            break;
+    }
+
+    // Come back after the next frame if the budget ran out, or if more
+    // arrived while delivering.
+    if (head != g_atomic_int_get(&receiver->tail))
+        g_source_set_ready_time(source, 0);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs msg_receiver_source_funcs = {
+    .dispatch = msg_receiver_dispatch,
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+MsgReceiver *
+msg_receiver_new (gint             fd,
+                  guint            slots,
+                  MsgDedup        *dedup,
+                  MsgPipeline     *pipeline,
+                  MsgReceiverFunc  func,
+                  gpointer         user_data)
+{
+    MsgReceiver *receiver;
+    guint        size = MSG_RECEIVER_BATCH;
+
+    while (size < slots)
+        size <<= 1;
+
+    receiver = g_new0(MsgReceiver, 1);
+    receiver->fd        = fd;
+    receiver->dedup     = dedup;
+    receiver->pipeline  = pipeline;
+    receiver->func      = func;
+    receiver->user_data = user_data;
+    receiver->slots     = g_new(MsgReceiverSlot, size);
+    receiver->mask      = size - 1;
+    receiver->fec       = msg_fec_decoder_new();
+    g_queue_init(&receiver->recovered);
+
+    // Below GTK's redraw priority, so the UI keeps drawing during a burst.
+    receiver->source = g_source_new(&msg_receiver_source_funcs, sizeof(MsgReceiverSource));
+    ((MsgReceiverSource *) receiver->source)->receiver = receiver;
+    g_source_set_priority(receiver->source, G_PRIORITY_DEFAULT_IDLE);
+    g_source_set_ready_time(receiver->source, -1);
+    g_source_attach(receiver->source, NULL);
+
+    receiver->running = TRUE;
+    receiver->thread  = g_thread_new("msg-receiver", msg_receiver_thread, receiver);
+
+    D("[DEBUG] Receive ring: %u slots\n", size);
+    return receiver;
+}
+
+void
+msg_receiver_free (MsgReceiver *receiver)
+{
+    if (receiver == NULL)
+        return;
+
+    g_atomic_int_set(&receiver->running, FALSE);
+    g_thread_join(receiver->thread);
+
+    g_source_destroy(receiver->source);
+    g_source_unref(receiver->source);
+    msg_fec_decoder_free(receiver->fec);
+    g_queue_clear_full(&receiver->recovered, (GDestroyNotify) g_bytes_unref);
+    g_free(receiver->slots);
+    g_free(receiver);
+}
@@ -0,0 +1,60 @@
+// msg-receiver
+
+// Network receive thread for 'messages'.
+//
+// Datagrams are read on a dedicated I/O thread (in batches, with recvmmsg),
+// checked for duplicates and parsed there, and handed to the main loop through
+// a lock-free single producer, single consumer ring. The main loop is woken by
+// one GSource, which delivers queued messages to a callback for at most
+// MSG_RECEIVER_BUDGET per dispatch and runs below GTK's redraw priority, so a
+// packet burst cannot stall the UI. Back-to-back packets each get their own
+// slot; when the ring is full the thread stops reading and the kernel's socket
+// buffer takes up the slack.
+//
+// Forward error correction shards (see msg-fec.h) are decoded, and bundles
+// (msg-bundle.h) unpacked, on the I/O thread too, so the callback only ever
+// sees the original datagrams, and then the receive stages (msg-stage.h) run
+// on each batch.
+
+#ifndef MSG_RECEIVER_H
+#define MSG_RECEIVER_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#include "msg-dedup.h"
+#include "msg-header.h"
+#include "msg-stage.h"
+
+#define MSG_RECEIVER_SIZE    2048                       // Largest datagram kept
+#define MSG_RECEIVER_BATCH   32                         // Datagrams per recvmmsg
+#define MSG_RECEIVER_BUDGET  (4 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct {
+    gint64              received;   // Real time, microseconds since the epoch
+    struct sockaddr_in  from;
+    gboolean            sequenced;  // TRUE if 'header' is valid
+    MsgHeader           header;
+    const gchar        *body;       // After any header; NUL terminated
+    gsize               length;     // Of 'body'
+} MsgReceived;
+
+typedef void (*MsgReceiverFunc) (const MsgReceived *message, gpointer user_data);
+
+typedef struct _MsgReceiver MsgReceiver;
+
+// Start receiving on 'fd', a bound UDP socket. 'func' is called from the
+// default main context for each message. 'dedup' and 'pipeline' (either may
+// be NULL) are used only by the I/O thread from then on. 'slots' is rounded up
+// to a power of two.
+MsgReceiver *msg_receiver_new        (gint             fd,
+                                      guint            slots,
+                                      MsgDedup        *dedup,
+                                      MsgPipeline     *pipeline,
+                                      MsgReceiverFunc  func,
+                                      gpointer         user_data);
+
+// Stop the I/O thread and discard undelivered messages.
+void         msg_receiver_free       (MsgReceiver *receiver);
+
+#endif // MSG_RECEIVER_H
@@ -0,0 +1,657 @@
+// msg-search
+
+// Full text search over the message history. See msg-search.h.
+//
+// Posting lists hold each record ID as the varint encoded difference from the
+// previous one, so a posting usually takes one or two bytes. A query decodes
+// the shortest list and intersects the others with it in ID order, then
+// applies the peer and time filters from a small per record table.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-history.h"
+#include "msg-search.h"
+
+#define MAX_TERM    64              // Bytes; longer terms are cut short
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+typedef enum {
+    JOB_BUILD,                      // Index the history up to 'id'
+    JOB_ADD,
+    JOB_QUERY,
+    JOB_QUIT
+} MsgSearchJobType;
+
+typedef struct {
+    MsgSearchJobType  type;
+    guint64           id;
+    gint64            timestamp;
+    gchar            *peer;
+    gchar            *text;         // Or the query
+    guint             generation;   // Of a query
+    MsgSearchFunc     func;
+    gpointer          user_data;
+} MsgSearchJob;
+
+typedef struct {
+    GByteArray *data;               // Varint deltas
+    guint64     last;               // Last ID added
+    guint       count;
+} MsgPosting;
+
+typedef struct {
+    gint64  timestamp;
+    guint32 peer;                   // Index into 'peer_names', G_MAXUINT32 if none
+} MsgSearchRecord;
+
+typedef struct {
+    MsgSearch     *search;
+    guint64       *ids;
+    guint          count;
+    gboolean       truncated;
+    MsgSearchFunc  func;
+    gpointer       user_data;
+    guint          source;          // Idle source delivering it
+} MsgSearchResult;
+
+struct _MsgSearch {
+    gchar        *dir;
+    GAsyncQueue  *jobs;
+    GThread      *thread;
+    guint         generation;       // Of the latest query
+    GMutex        lock;
+    GList        *pending;          // MsgSearchResult not yet delivered, under 'lock'
+
+    // Worker thread only
+    GHashTable   *terms;            // Term -> MsgPosting
+    GArray       *records;          // MsgSearchRecord, by ID
+    GHashTable   *peers;            // Name -> index + 1
+    GPtrArray    *peer_names;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Terms
+
+// Split 'text' into lower case terms, calling 'func' for each.
+static void
+msg_search_terms (const gchar *text,
+                  void       (*func) (const gchar *term, gpointer data),
+                  gpointer     data)
+{
+    GString     *term = g_string_sized_new(MAX_TERM + 6);
+    const gchar *p;
+
+    if (!g_utf8_validate(text, -1, NULL))
+        text = "";
+
+    for (p = text; ; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char(p);
+
+        if (c != 0 && g_unichar_isalnum(c)) {
+            if (term->len < MAX_TERM)
+                g_string_append_unichar(term, g_unichar_tolower(c));
+            continue;
+        }
+        if (term->len > 0) {
+            func(term->str, data);
+            g_string_truncate(term, 0);
+        }
+        if (c == 0)
+            break;
+    }
+    g_string_free(term, TRUE);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Posting lists
+
+static void
+msg_posting_free (gpointer data)
+{
+    MsgPosting *posting = data;
+
+    g_byte_array_free(posting->data, TRUE);
+    g_free(posting);
+}
+
+static void
+msg_posting_add (MsgPosting *posting, guint64 id)
+{
+    guint64 delta;
+    guint8  byte;
+
+    // A term repeated within a record is indexed once.
+    if (posting->count > 0 && id <= posting->last)
+        return;
+
+    delta = id - posting->last;
+    do {
+        byte    = delta & 0x7f;
+        delta >>= 7;
+        if (delta != 0)
+            byte |= 0x80;
+        g_byte_array_append(posting->data, &byte, 1);
+    } while (delta != 0);
+
+    posting->last = id;
+    posting->count++;
+}
+
+// Decode a posting list into 'ids'.
+static void
+msg_posting_decode (const MsgPosting *posting, GArray *ids)
+{
+    const guint8 *p = posting->data->data;
+    const guint8 *end = p + posting->data->len;
+    guint64       id = 0;
+
+    while (p < end) {
+        guint64 delta = 0;
+        guint   shift = 0;
+
+        do {
+            delta |= (guint64) (*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+
+        id += delta;
+        g_array_append_val(ids, id);
+    }
+}
+
+// Keep only the IDs in 'ids' that are also in 'posting'. Both are in order,
+// so this is a single merge pass.
+static void
+msg_posting_intersect (const MsgPosting *posting, GArray *ids)
+{
+    const guint8 *p = posting->data->data;
+    const guint8 *end = p + posting->data->len;
+    guint64       id = 0;
+    guint         in = 0, out = 0;
+    gboolean      valid = FALSE;
+
+    while (in < ids->len) {
+        guint64 want = g_array_index(ids, guint64, in);
+
+        while ((!valid || id < want) && p < end) {
+            guint64 delta = 0;
+            guint   shift = 0;
+
+            do {
+                delta |= (guint64) (*p & 0x7f) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+            id   += delta;
+            valid = TRUE;
+        }
+        if (!valid || id < want)
+            break;                  // Posting list exhausted
+        if (id == want)
+            g_array_index(ids, guint64, out++) = want;
+        in++;
+    }
+    g_array_set_size(ids, out);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Indexing (worker thread)
+
+typedef struct {
+    MsgSearch *search;
+    guint64    id;
+} MsgSearchAdd;
+
+static void
+msg_search_index_term (const gchar *term, gpointer data)
+{
+    MsgSearchAdd *add = data;
+    MsgPosting   *posting;
+
+    posting = g_hash_table_lookup(add->search->terms, term);
+    if (posting == NULL) {
+        posting = g_new0(MsgPosting, 1);
+        posting->data = g_byte_array_new();
+        g_hash_table_insert(add->search->terms, g_strdup(term), posting);
+    }
+    msg_posting_add(posting, add->id);
+}
+
+static guint32
+msg_search_peer (MsgSearch *search, const gchar *peer, gboolean create)
+{
+    guint index = GPOINTER_TO_UINT(g_hash_table_lookup(search->peers, peer));
+
+    if (index == 0) {
+        if (!create)
+            return G_MAXUINT32;
+        g_ptr_array_add(search->peer_names, g_strdup(peer));
+        index = search->peer_names->len;
+        g_hash_table_insert(search->peers, g_ptr_array_index(search->peer_names, index - 1),
+                            GUINT_TO_POINTER(index));
+    }
+    return index - 1;
+}
+
+static void
+msg_search_index (MsgSearch   *search,
+                  guint64      id,
+                  gint64       timestamp,
+                  const gchar *peer,
+                  const gchar *text)
+{
+    MsgSearchRecord record = { G_MININT64, G_MAXUINT32 };
+    MsgSearchAdd    add = { search, id };
+
+    if (id < search->records->len)
+        return;                     // Already indexed
+
+    // Gaps (records that failed to be written) never match.
+    if (id > search->records->len) {
+        guint gap = search->records->len;
+
+        g_array_set_size(search->records, id);
+        for (; gap < id; gap++)
+            g_array_index(search->records, MsgSearchRecord, gap) = record;
+    }
+
+    record.timestamp = timestamp;
+    record.peer      = msg_search_peer(search, peer, TRUE);
+    g_array_append_val(search->records, record);
+
+    msg_search_terms(text, msg_search_index_term, &add);
+}
+
+static gboolean
+msg_search_index_record (const MsgHistoryRecord *record, gpointer data)
+{
+    msg_search_index(data, record->id, record->timestamp, record->peer, record->text);
+    return TRUE;
+}
+
+static void
+msg_search_build (MsgSearch *search, guint64 last)
+{
+    MsgHistory *history;
+    GError     *error = NULL;
+    G_GNUC_UNUSED gint64 start = g_get_monotonic_time();
+
+    history = msg_history_open_readonly(search->dir, &error);
+    if (history == NULL) {
+        g_printerr("[ERROR] Search: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+    msg_history_read(history, 0, last, msg_search_index_record, search);
+    msg_history_close(history);
+
+    D("[DEBUG] Search: indexed %u messages, %u terms in %" G_GINT64_FORMAT "ms\n",
+      search->records->len, g_hash_table_size(search->terms),
+      (g_get_monotonic_time() - start) / 1000);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Queries (worker thread)
+
+typedef struct {
+    GPtrArray *terms;
+    gchar     *peer;
+    gint64     from;
+    gint64     to;
+} MsgSearchQuery;
+
+static void
+msg_search_query_term (const gchar *term, gpointer data)
+{
+    g_ptr_array_add(data, g_strdup(term));
+}
+
+// Parse a time: a date, a date and time, or a time ago. Returns FALSE if
+// 'text' is none of these.
+static gboolean
+msg_search_parse_time (const gchar *text, gint64 *time)
+{
+    gchar     *end;
+    gdouble    value;
+    GDateTime *date;
+    GTimeZone *local;
+    gchar     *iso;
+
+    value = g_ascii_strtod(text, &end);
+    if (end != text && end[0] != '\0' && end[1] == '\0' && end[0] != '-') {
+        gint64 unit;
+
+        switch (end[0]) {
+        case 's': unit = G_USEC_PER_SEC;                    break;
+        case 'm': unit = (gint64) 60 * G_USEC_PER_SEC;      break;
+        case 'h': unit = (gint64) 3600 * G_USEC_PER_SEC;    break;
+        case 'd': unit = (gint64) 86400 * G_USEC_PER_SEC;   break;
+        case 'w': unit = (gint64) 604800 * G_USEC_PER_SEC;  break;
+        default:  return FALSE;
+        }
+        *time = g_get_real_time() - (gint64) (value * unit);
+        return TRUE;
+    }
+
+    // Dates are local; complete a date or a time without seconds for ISO 8601.
+    if (strlen(text) == 10)
+        iso = g_strconcat(text, "T00:00:00", NULL);
+    else if (strlen(text) == 16)
+        iso = g_strconcat(text, ":00", NULL);
+    else
+        iso = g_strdup(text);
+    local = g_time_zone_new_local();
+    date  = g_date_time_new_from_iso8601(iso, local);
+    g_time_zone_unref(local);
+    g_free(iso);
+    if (date == NULL)
+        return FALSE;
+
+    *time = g_date_time_to_unix(date) * G_USEC_PER_SEC;
+    g_date_time_unref(date);
+    return TRUE;
+}
+
+static void
+msg_search_parse (const gchar *text, MsgSearchQuery *query)
+{
+    gchar **words = g_strsplit_set(text, " \t\n", -1);
+
+    query->terms = g_ptr_array_new_with_free_func(g_free);
+    query->peer  = NULL;
+    query->from  = G_MININT64;
+    query->to    = G_MAXINT64;
+
+    for (gchar **word = words; *word != NULL; word++) {
+        if (g_str_has_prefix(*word, "from:") && (*word)[5] != '\0') {
+            g_free(query->peer);
+            query->peer = g_strdup(*word + 5);
+        } else if (g_str_has_prefix(*word, "since:") &&
+                   msg_search_parse_time(*word + 6, &query->from)) {
+            ;
+        } else if (g_str_has_prefix(*word, "until:") &&
+                   msg_search_parse_time(*word + 6, &query->to)) {
+            ;
+        } else {
+            msg_search_terms(*word, msg_search_query_term, query->terms);
+        }
+    }
+    g_strfreev(words);
+}
+
+static gint
+msg_search_compare_postings (gconstpointer a, gconstpointer b)
+{
+    const MsgPosting *x = *(MsgPosting * const *) a;
+    const MsgPosting *y = *(MsgPosting * const *) b;
+
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+// Find the records matching 'query', keeping the newest MSG_SEARCH_LIMIT.
+static GArray *
+msg_search_run (MsgSearch *search, const MsgSearchQuery *query, gboolean *truncated)
+{
+    GArray    *ids = g_array_new(FALSE, FALSE, sizeof(guint64));
+    GArray    *results;
+    GPtrArray *postings = g_ptr_array_new();
+    guint32    peer = G_MAXUINT32;
+
+    if (query->peer != NULL) {
+        peer = msg_search_peer(search, query->peer, FALSE);
+        if (peer == G_MAXUINT32)
+            goto done;              // Peer never seen
+    }
+
+    // Candidates: every record if there are no terms, otherwise the
+    // intersection of the terms' postings, shortest list first.
+    if (query->terms->len == 0) {
+        for (guint64 id = 0; id < search->records->len; id++)
+            g_array_append_val(ids, id);
+    } else {
+        for (guint i = 0; i < query->terms->len; i++) {
+            MsgPosting *posting = g_hash_table_lookup(search->terms,
+                                                      g_ptr_array_index(query->terms, i));
+            if (posting == NULL)
+                goto done;          // A term that matches nothing
+            g_ptr_array_add(postings, posting);
+        }
+        g_ptr_array_sort(postings, msg_search_compare_postings);
+
+        msg_posting_decode(g_ptr_array_index(postings, 0), ids);
+        for (guint i = 1; i < postings->len && ids->len > 0; i++)
+            msg_posting_intersect(g_ptr_array_index(postings, i), ids);
+    }
+
+done:
+    // Filter, newest first, stopping at the limit.
+    results    = g_array_new(FALSE, FALSE, sizeof(guint64));
+    *truncated = FALSE;
+    for (guint i = ids->len; i-- > 0; ) {
+        guint64                id = g_array_index(ids, guint64, i);
+        const MsgSearchRecord *record = &g_array_index(search->records, MsgSearchRecord, id);
+
+        if (record->timestamp < query->from || record->timestamp >= query->to ||
+            record->timestamp == G_MININT64 ||
+            (peer != G_MAXUINT32 && record->peer != peer))
+            continue;
+        if (results->len == MSG_SEARCH_LIMIT) {
+            *truncated = TRUE;
+            break;
+        }
+        g_array_append_val(results, id);
+    }
+
+    // Oldest first.
+    for (guint i = 0, j = results->len; i + 1 < j; i++, j--) {
+        guint64 t = g_array_index(results, guint64, i);
+
+        g_array_index(results, guint64, i)     = g_array_index(results, guint64, j - 1);
+        g_array_index(results, guint64, j - 1) = t;
+    }
+
+    g_array_free(ids, TRUE);
+    g_ptr_array_free(postings, TRUE);
+    return results;
+}
+
+static void
+msg_search_result_free (MsgSearchResult *result)
+{
+    g_free(result->ids);
+    g_free(result);
+}
+
+static gboolean
+msg_search_deliver (gpointer data)
+{
+    MsgSearchResult *result = data;
+    MsgSearch       *search = result->search;
+
+    g_mutex_lock(&search->lock);
+    search->pending = g_list_remove(search->pending, result);
+    g_mutex_unlock(&search->lock);
+
+    result->func(result->ids, result->count, result->truncated, result->user_data);
+    msg_search_result_free(result);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+msg_search_answer (MsgSearch *search, MsgSearchJob *job)
+{
+    MsgSearchQuery   query;
+    MsgSearchResult *result;
+    GArray          *ids;
+    gboolean         truncated;
+    G_GNUC_UNUSED gint64 start = g_get_monotonic_time();
+
+    msg_search_parse(job->text, &query);
+    ids = msg_search_run(search, &query, &truncated);
+
+    D("[DEBUG] Search '%s': %u results in %" G_GINT64_FORMAT "us\n",
+      job->text, ids->len, g_get_monotonic_time() - start);
+
+    // A newer query may have been made while this one ran.
+    if (job->generation == g_atomic_int_get(&search->generation)) {
+        result            = g_new(MsgSearchResult, 1);
+        result->search    = search;
+        result->count     = ids->len;
+        result->truncated = truncated;
+        result->ids       = (guint64 *) g_array_free(ids, FALSE);
+        result->func      = job->func;
+        result->user_data = job->user_data;
+
+        // Held across both, so the result is listed before it can be delivered.
+        g_mutex_lock(&search->lock);
+        result->source  = g_idle_add(msg_search_deliver, result);
+        search->pending = g_list_prepend(search->pending, result);
+        g_mutex_unlock(&search->lock);
+    } else {
+        g_array_free(ids, TRUE);
+    }
+
+    g_ptr_array_free(query.terms, TRUE);
+    g_free(query.peer);
+}
+
+static void
+msg_search_job_free (MsgSearchJob *job)
+{
+    g_free(job->peer);
+    g_free(job->text);
+    g_free(job);
+}
+
+static gpointer
+msg_search_thread (gpointer data)
+{
+    MsgSearch    *search = data;
+    MsgSearchJob *job;
+    gboolean      running = TRUE;
+
+    while (running) {
+        job = g_async_queue_pop(search->jobs);
+
+        switch (job->type) {
+        case JOB_BUILD:
+            msg_search_build(search, job->id);
+            break;
+        case JOB_ADD:
+            msg_search_index(search, job->id, job->timestamp, job->peer, job->text);
+            break;
+        case JOB_QUERY:
+            if (job->generation == g_atomic_int_get(&search->generation))
+                msg_search_answer(search, job);
+            break;
+        case JOB_QUIT:
+            running = FALSE;
+            break;
+        }
+        msg_search_job_free(job);
+    }
+
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+MsgSearch *
+msg_search_new (const gchar *dir, guint64 first_new)
+{
+    MsgSearch    *search = g_new0(MsgSearch, 1);
+    MsgSearchJob *job = g_new0(MsgSearchJob, 1);
+
+    search->dir        = g_strdup(dir);
+    search->jobs       = g_async_queue_new();
+    g_mutex_init(&search->lock);
+    search->terms      = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, msg_posting_free);
+    search->records    = g_array_new(FALSE, FALSE, sizeof(MsgSearchRecord));
+    search->peers      = g_hash_table_new(g_str_hash, g_str_equal);
+    search->peer_names = g_ptr_array_new_with_free_func(g_free);
+
+    job->type = JOB_BUILD;
+    job->id   = first_new;
+    g_async_queue_push(search->jobs, job);
+
+    search->thread = g_thread_new("msg-search", msg_search_thread, search);
+    return search;
+}
+
+void
+msg_search_free (MsgSearch *search)
+{
+    MsgSearchJob *job;
+
+    if (search == NULL)
+        return;
+
+    // Abandon queued queries, then stop once earlier jobs are done.
+    g_atomic_int_inc(&search->generation);
+    job = g_new0(MsgSearchJob, 1);
+    job->type = JOB_QUIT;
+    g_async_queue_push(search->jobs, job);
+    g_thread_join(search->thread);
+
+    // Results the main loop has yet to deliver must not reach a caller that
+    // is freeing the search. Nothing adds to the list once the thread is gone.
+    for (GList *l = search->pending; l != NULL; l = l->next) {
+        MsgSearchResult *result = l->data;
+
+        g_source_remove(result->source);
+        msg_search_result_free(result);
+    }
+    g_list_free(search->pending);
+    g_mutex_clear(&search->lock);
+
+    g_async_queue_unref(search->jobs);
+    g_hash_table_destroy(search->terms);
+    g_array_free(search->records, TRUE);
+    g_hash_table_destroy(search->peers);
+    g_ptr_array_free(search->peer_names, TRUE);
+    g_free(search->dir);
+    g_free(search);
+}
+
+void
+msg_search_add (MsgSearch   *search,
+                guint64      id,
+                gint64       timestamp,
+                const gchar *peer,
+                const gchar *text)
+{
+    MsgSearchJob *job = g_new0(MsgSearchJob, 1);
+
+    job->type      = JOB_ADD;
+    job->id        = id;
+    job->timestamp = timestamp;
+    job->peer      = g_strdup(peer);
+    job->text      = g_strdup(text);
+    g_async_queue_push(search->jobs, job);
+}
+
+void
+msg_search_query (MsgSearch     *search,
+                  const gchar   *query,
+                  MsgSearchFunc  func,
+                  gpointer       user_data)
+{
+    MsgSearchJob *job = g_new0(MsgSearchJob, 1);
+
+    job->type       = JOB_QUERY;
+    job->text       = g_strdup(query);
+    job->func       = func;
+    job->user_data  = user_data;
+    job->generation = g_atomic_int_add(&search->generation, 1) + 1;
+    g_async_queue_push(search->jobs, job);
+}
@@ -0,0 +1,59 @@
+// msg-search
+
+// Full text search over the message history (see msg-history.h).
+//
+// An inverted index maps each term (a lower case run of letters and digits)
+// to the IDs of the records containing it, delta and variable length encoded.
+// The index is kept in memory by a worker thread, which owns it outright: it
+// is built from the history on start-up, extended as messages are added, and
+// queried, all by messages passed to the worker. Nothing the main loop does
+// waits for the index.
+//
+// A query is a list of terms, all of which must match, plus optional filters:
+//
+//   from:PEER          Messages to or from PEER
+//   since:WHEN         At or after WHEN
+//   until:WHEN         Before WHEN
+//
+// where WHEN is a date (2024-03-01), a date and time (2024-03-01T14:00) or a
+// time ago (30m, 2h, 7d).
+
+#ifndef MSG_SEARCH_H
+#define MSG_SEARCH_H
+
+#include <glib.h>
+
+#define MSG_SEARCH_LIMIT    500     // Most results returned
+
+// Results, oldest first. 'truncated' is TRUE if older matches were left out.
+// Called from the default main context; 'ids' is only valid during the call.
+typedef void (*MsgSearchFunc) (const guint64 *ids,
+                               guint          count,
+                               gboolean       truncated,
+                               gpointer       user_data);
+
+typedef struct _MsgSearch MsgSearch;
+
+// Start indexing the history in 'dir'. Records from 'first_new' on are not
+// read from the history, but must be passed to msg_search_add().
+MsgSearch *msg_search_new   (const gchar *dir, guint64 first_new);
+
+// Call from the thread running the default main loop. Results not yet
+// delivered are dropped.
+void       msg_search_free  (MsgSearch *search);
+
+// Index a record. IDs must increase.
+void       msg_search_add   (MsgSearch   *search,
+                             guint64      id,
+                             gint64       timestamp,
+                             const gchar *peer,
+                             const gchar *text);
+
+// Run a query. Any query still waiting to run is abandoned, and its results
+// are never delivered.
+void       msg_search_query (MsgSearch     *search,
+                             const gchar   *query,
+                             MsgSearchFunc  func,
+                             gpointer       user_data);
+
+#endif // MSG_SEARCH_H
@@ -0,0 +1,201 @@
+// msg-stage
+
+// Loadable packet processing stages. See msg-stage.h.
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <gmodule.h>
+
+#include "msg-stage.h"
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+typedef struct {
+    GModule            *module;
+    const MsgStageInfo *info;
+    gpointer            state;
+    MsgStageStats       stats[2];       // By direction
+} MsgStage;
+
+struct _MsgPipeline {
+    GArray             *stages;         // MsgStage
+};
+
+static guint64
+msg_stage_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static guint
+msg_stage_count (const MsgPacket *packets, guint count)
+{
+    guint live = 0;
+
+    for (guint i = 0; i < count; i++)
+        live += packets[i].length > 0;
+    return live;
+}
+
+static void
+msg_stage_clear (MsgStage *stage)
+{
+    if (stage->state != NULL)
+        stage->info->destroy(stage->state);
+    g_module_close(stage->module);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+MsgPipeline *
+msg_pipeline_new (void)
+{
+    MsgPipeline *pipeline = g_new0(MsgPipeline, 1);
+
+    pipeline->stages = g_array_new(FALSE, TRUE, sizeof(MsgStage));
+    return pipeline;
+}
+
+void
+msg_pipeline_free (MsgPipeline *pipeline)
+{
+    if (pipeline == NULL)
+        return;
+
+    for (guint i = 0; i < pipeline->stages->len; i++)
+        msg_stage_clear(&g_array_index(pipeline->stages, MsgStage, i));
+    g_array_free(pipeline->stages, TRUE);
+    g_free(pipeline);
+}
+
+gboolean
+msg_pipeline_add (MsgPipeline *pipeline, const gchar *spec, GError **error)
+{
+    gchar            **fields = g_strsplit(spec, ",", 2);
+    MsgStage           stage;
+    MsgStageInfoFunc   info_func;
+
+    memset(&stage, 0, sizeof(stage));
+
+    stage.module = g_module_open(fields[0], G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+    if (stage.module == NULL) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+                    "Unable to load stage %s: %s", fields[0], g_module_error());
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    if (!g_module_symbol(stage.module, "msg_stage_module_info", (gpointer *) &info_func) ||
+        (stage.info = info_func()) == NULL ||
+        stage.info->api != MSG_STAGE_API) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s is not a stage module (API %d)", fields[0], MSG_STAGE_API);
+        msg_stage_clear(&stage);
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    stage.state = stage.info->create(fields[1], error);
+    if (stage.state == NULL) {
+        g_prefix_error(error, "Stage %s: ", stage.info->name);
+        msg_stage_clear(&stage);
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    D("[DEBUG] Stage %s loaded from %s\n", stage.info->name, fields[0]);
+    g_array_append_val(pipeline->stages, stage);
+    g_strfreev(fields);
+    return TRUE;
+}
+
+guint
+msg_pipeline_get_length (MsgPipeline *pipeline)
+{
+    return pipeline ? pipeline->stages->len : 0;
+}
+
+guint
+msg_pipeline_process (MsgPipeline       *pipeline,
+                      MsgStageDirection  direction,
+                      MsgPacket         *packets,
+                      guint              count)
+{
+    guint    len  = msg_pipeline_get_length(pipeline);
+    guint    live = msg_stage_count(packets, count);
+    guint64  start, end;
+
+    if (len == 0)
+        return live;
+
+    start = msg_stage_clock();
+    for (guint i = 0; i < len && live > 0; i++) {
+        MsgStage      *stage = &g_array_index(pipeline->stages, MsgStage,
+                                              direction == MSG_STAGE_OUT ? i : len - 1 - i);
+        MsgStageStats *stats = &stage->stats[direction];
+        guint          after;
+
+        stage->info->process(stage->state, direction, packets, count);
+
+        // One clock read per stage per batch; the next stage starts its
+        // timing where this one ends.
+        end   = msg_stage_clock();
+        after = msg_stage_count(packets, count);
+
+        stats->batches++;
+        stats->packets += live;
+        stats->dropped += live - after;
+        stats->nsec    += end - start;
+
+        live  = after;
+        start = end;
+    }
+
+    return live;
+}
+
+const gchar *
+msg_pipeline_get_stats (MsgPipeline       *pipeline,
+                        guint              index,
+                        MsgStageDirection  direction,
+                        MsgStageStats     *stats)
+{
+    MsgStage *stage;
+
+    if (index >= msg_pipeline_get_length(pipeline))
+        return NULL;
+
+    stage  = &g_array_index(pipeline->stages, MsgStage, index);
+    *stats = stage->stats[direction];
+    return stage->info->name;
+}
+
+void
+msg_pipeline_print (MsgPipeline *pipeline, const gchar *prefix)
+{
+    static const gchar *directions[] = { "out", "in" };
+
+    for (guint i = 0; i < msg_pipeline_get_length(pipeline); i++) {
+        for (gint d = MSG_STAGE_OUT; d <= MSG_STAGE_IN; d++) {
+            MsgStageStats  stats;
+            const gchar   *name = msg_pipeline_get_stats(pipeline, i, d, &stats);
+
+            if (stats.batches == 0)
+                continue;
+            g_print("%s%s %-3s %" G_GUINT64_FORMAT " packets in %" G_GUINT64_FORMAT
+                    " batches, %" G_GUINT64_FORMAT " dropped, %.0f ns/packet\n",
+                    prefix, name, directions[d], stats.packets, stats.batches,
+                    stats.dropped, (gdouble) stats.nsec / MAX(stats.packets, 1));
+        }
+    }
+}
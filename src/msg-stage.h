@@ -0,0 +1,163 @@
+// msg-stage
+
+// Loadable packet processing stages, shared by 'router' (per queue) and
+// 'messages' (on everything sent and received).
+//
+// A stage is a shared module (loaded with GModule) exporting
+//
+//   const MsgStageInfo *msg_stage_module_info (void);
+//
+// A MsgPipeline runs its stages in order on packets being sent
+// (MSG_STAGE_OUT) and in reverse order on packets received (MSG_STAGE_IN), so
+// a stage that wraps packets on the way out sees them wrapped on the way in.
+// Packets are handed over in batches and changed in place: every packet has
+// at least MSG_STAGE_HEADROOM bytes free before it and MSG_STAGE_TAILROOM
+// after, so a stage can add a header or trailer by moving the packet's bounds
+// (msg_packet_push() and msg_packet_put()) rather than copying it. A stage
+// drops a packet by setting its length to 0; later stages skip it. Nothing is
+// copied or allocated between stages.
+//
+// Each stage's batches, packets, drops and time spent are counted. A pipeline
+// belongs to the thread that runs it.
+//
+// 'router' and 'messages' both link msg-header.c and export their symbols to
+// modules (gmodule-2.0 links with --export-dynamic), so a stage may call the
+// functions in msg-header.h without a copy of its own.
+
+#ifndef MSG_STAGE_H
+#define MSG_STAGE_H
+
+#include <glib.h>
+
+#define MSG_STAGE_API       1
+#define MSG_STAGE_HEADROOM  64
+#define MSG_STAGE_TAILROOM  64
+#define MSG_STAGE_BATCH     32          // Most packets callers pass at once
+
+typedef enum {
+    MSG_STAGE_OUT,
+    MSG_STAGE_IN
+} MsgStageDirection;
+
+typedef struct {
+    gchar  *data;
+    gsize   length;                     // 0 once dropped
+    gsize   headroom;                   // Free bytes before 'data'
+    gsize   tailroom;                   // Free bytes after 'data' + 'length'
+} MsgPacket;
+
+typedef struct {
+    guint         api;                  // MSG_STAGE_API
+    const gchar  *name;
+
+    // Create the stage's state from its arguments (may be NULL). Returns NULL
+    // and sets 'error' on failure.
+    gpointer    (*create)  (const gchar *args, GError **error);
+    void        (*destroy) (gpointer state);
+
+    // Process 'count' packets, skipping any of length 0.
+    void        (*process) (gpointer           state,
+                            MsgStageDirection  direction,
+                            MsgPacket         *packets,
+                            guint              count);
+} MsgStageInfo;
+
+typedef const MsgStageInfo *(*MsgStageInfoFunc) (void);
+
+typedef struct {
+    guint64     batches;
+    guint64     packets;                // Passed in, not counting dropped ones
+    guint64     dropped;                // By this stage
+    guint64     nsec;                   // Time in 'process'
+} MsgStageStats;
+
+typedef struct _MsgPipeline MsgPipeline;
+
+MsgPipeline *msg_pipeline_new        (void);
+void         msg_pipeline_free       (MsgPipeline *pipeline);
+
+// Load a stage from 'spec', PATH[,ARGS], and add it to the end. PATH is as
+// for g_module_open(). Returns FALSE and sets 'error' on failure.
+gboolean     msg_pipeline_add        (MsgPipeline  *pipeline,
+                                      const gchar  *spec,
+                                      GError      **error);
+
+guint        msg_pipeline_get_length (MsgPipeline *pipeline);
+
+// Run every stage on 'count' packets. Returns the number not dropped.
+guint        msg_pipeline_process    (MsgPipeline       *pipeline,
+                                      MsgStageDirection  direction,
+                                      MsgPacket         *packets,
+                                      guint              count);
+
+// Name and counters of stage 'index', for each direction.
+const gchar *msg_pipeline_get_stats  (MsgPipeline       *pipeline,
+                                      guint              index,
+                                      MsgStageDirection  direction,
+                                      MsgStageStats     *stats);
+
+// Print every stage's counters, one line each, starting with 'prefix'.
+void         msg_pipeline_print      (MsgPipeline *pipeline, const gchar *prefix);
+
+// Point 'packet' at 'length' bytes of 'buffer', which has 'size' bytes in all,
+// leaving MSG_STAGE_HEADROOM before it.
+static inline void
+msg_packet_init (MsgPacket *packet, gchar *buffer, gsize size, gsize length)
+{
+    packet->data     = buffer + MSG_STAGE_HEADROOM;
+    packet->length   = length;
+    packet->headroom = MSG_STAGE_HEADROOM;
+    packet->tailroom = size - MSG_STAGE_HEADROOM - length;
+}
+
+// Add 'length' bytes at the start. Returns them, or NULL if there is no room.
+static inline gchar *
+msg_packet_push (MsgPacket *packet, gsize length)
+{
+    if (length > packet->headroom)
+        return NULL;
+    packet->data     -= length;
+    packet->length   += length;
+    packet->headroom -= length;
+    return packet->data;
+}
+
+// Remove 'length' bytes from the start. Returns them, or NULL if too short.
+static inline gchar *
+msg_packet_pull (MsgPacket *packet, gsize length)
+{
+    gchar *start = packet->data;
+
+    if (length > packet->length)
+        return NULL;
+    packet->data     += length;
+    packet->length   -= length;
+    packet->headroom += length;
+    return start;
+}
+
+// Add 'length' bytes at the end. Returns them, or NULL if there is no room.
+static inline gchar *
+msg_packet_put (MsgPacket *packet, gsize length)
+{
+    gchar *end = packet->data + packet->length;
+
+    if (length > packet->tailroom)
+        return NULL;
+    packet->length   += length;
+    packet->tailroom -= length;
+    return end;
+}
+
+// Remove 'length' bytes from the end. Returns them, or NULL if too short.
+static inline gchar *
+msg_packet_trim (MsgPacket *packet, gsize length)
+{
+    if (length > packet->length)
+        return NULL;
+    packet->length   -= length;
+    packet->tailroom += length;
+    return packet->data + packet->length;
+}
+
+#endif // MSG_STAGE_H
@@ -0,0 +1,193 @@
+// msg-stats
+
+// Per peer link statistics. See msg-stats.h.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-stats.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// P-squared quantile estimator
+
+void
+msg_quantile_init (MsgQuantile *quantile, gdouble p)
+{
+    memset(quantile, 0, sizeof(*quantile));
+    quantile->p = p;
+}
+
+static gint
+msg_quantile_compare (gconstpointer a, gconstpointer b)
+{
+    gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+    return (x > y) - (x < y);
+}
+
+static gdouble
+msg_quantile_parabolic (MsgQuantile *qt, gint i, gdouble d)
+{
+    return qt->q[i] + d / (qt->n[i + 1] - qt->n[i - 1]) *
+        ((qt->n[i] - qt->n[i - 1] + d) * (qt->q[i + 1] - qt->q[i]) / (qt->n[i + 1] - qt->n[i]) +
+         (qt->n[i + 1] - qt->n[i] - d) * (qt->q[i] - qt->q[i - 1]) / (qt->n[i] - qt->n[i - 1]));
+}
+
+static gdouble
+msg_quantile_linear (MsgQuantile *qt, gint i, gint d)
+{
+    return qt->q[i] + d * (qt->q[i + d] - qt->q[i]) / (qt->n[i + d] - qt->n[i]);
+}
+
+void
+msg_quantile_add (MsgQuantile *qt, gdouble x)
+{
+    const gdouble p = qt->p;
+    const gdouble dn[5] = { 0, p / 2, p, (1 + p) / 2, 1 };
+    gint          k;
+
+    // The first five observations seed the markers.
+    if (qt->count < 5) {
+        qt->q[qt->count++] = x;
+        if (qt->count == 5) {
+            qsort(qt->q, 5, sizeof(gdouble), msg_quantile_compare);
+            for (gint i = 0; i < 5; i++)
+                qt->n[i] = i + 1;
+            qt->np[0] = 1;
+            qt->np[1] = 1 + 2 * p;
+            qt->np[2] = 1 + 4 * p;
+            qt->np[3] = 3 + 2 * p;
+            qt->np[4] = 5;
+        }
+        return;
+    }
+    qt->count++;
+
+    // Find the cell containing x, extending the extremes if needed.
+    if (x < qt->q[0]) {
+        qt->q[0] = x;
+        k = 0;
+    } else if (x >= qt->q[4]) {
+        qt->q[4] = x;
+        k = 3;
+    } else {
+        for (k = 0; k < 3 && x >= qt->q[k + 1]; k++)
+            ;
+    }
+
+    for (gint i = k + 1; i < 5; i++)
+        qt->n[i]++;
+    for (gint i = 0; i < 5; i++)
+        qt->np[i] += dn[i];
+
+    // Move the middle markers towards their desired positions.
+    for (gint i = 1; i < 4; i++) {
+        gdouble d = qt->np[i] - qt->n[i];
+
+        if ((d >= 1 && qt->n[i + 1] - qt->n[i] > 1) ||
+            (d <= -1 && qt->n[i - 1] - qt->n[i] < -1)) {
+            gint    step = d > 0 ? 1 : -1;
+            gdouble q    = msg_quantile_parabolic(qt, i, step);
+
+            if (qt->q[i - 1] < q && q < qt->q[i + 1])
+                qt->q[i] = q;
+            else
+                qt->q[i] = msg_quantile_linear(qt, i, step);
+            qt->n[i] += step;
+        }
+    }
+}
+
+gdouble
+msg_quantile_get (const MsgQuantile *qt)
+{
+    gdouble sorted[5];
+
+    if (qt->count == 0)
+        return 0;
+    if (qt->count >= 5)
+        return qt->q[2];
+
+    // Too few samples for the markers: use the exact quantile.
+    memcpy(sorted, qt->q, qt->count * sizeof(gdouble));
+    qsort(sorted, qt->count, sizeof(gdouble), msg_quantile_compare);
+    return sorted[MIN((gint) (qt->p * qt->count), qt->count - 1)];
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Peer statistics
+
+void
+msg_stats_init (MsgPeerStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    msg_quantile_init(&stats->p50, 0.50);
+    msg_quantile_init(&stats->p95, 0.95);
+}
+
+void
+msg_stats_add_rtt (MsgPeerStats *stats, gdouble rtt)
+{
+    if (rtt < 0)
+        rtt = 0;
+
+    if (stats->samples == 0) {
+        stats->srtt    = rtt;
+        stats->rttvar  = rtt / 2;
+        stats->min_rtt = rtt;
+    } else {
+        stats->rttvar  = 0.75 * stats->rttvar + 0.25 * fabs(stats->srtt - rtt);
+        stats->srtt    = 0.875 * stats->srtt + 0.125 * rtt;
+        stats->min_rtt = MIN(stats->min_rtt, rtt);
+    }
+    stats->samples++;
+
+    msg_quantile_add(&stats->p50, rtt);
+    msg_quantile_add(&stats->p95, rtt);
+}
+
+void
+msg_stats_add_seq (MsgPeerStats *stats, guint32 seq)
+{
+    if (stats->received == 0) {
+        stats->first_seq   = seq;
+        stats->highest_seq = seq;
+    } else if ((gint32) (seq - stats->highest_seq) > 0) {
+        stats->highest_seq = seq;
+    } else if ((gint32) (seq - stats->first_seq) < 0) {
+        // Reordered ahead of the first message seen.
+        stats->first_seq = seq;
+    }
+    stats->received++;
+}
+
+gdouble
+msg_stats_loss (const MsgPeerStats *stats)
+{
+    guint64 expected;
+
+    if (stats->received == 0)
+        return 0;
+
+    expected = (guint32) (stats->highest_seq - stats->first_seq) + 1;
+    if (stats->received >= expected)
+        return 0;
+    return (gdouble) (expected - stats->received) / expected;
+}
+
+gchar *
+msg_stats_format (gdouble usec)
+{
+    gdouble seconds = usec / G_USEC_PER_SEC;
+
+    if (seconds < 1)
+        return g_strdup_printf("%.0fms", usec / 1000);
+    if (seconds < 60)
+        return g_strdup_printf("%.1fs", seconds);
+    if (seconds < 3600)
+        return g_strdup_printf("%dm%02ds", (gint) seconds / 60, (gint) seconds % 60);
+    return g_strdup_printf("%dh%02dm", (gint) seconds / 3600, ((gint) seconds % 3600) / 60);
+}
@@ -0,0 +1,57 @@
+// msg-stats
+
+// Per peer link statistics for 'messages': round trip time, jitter and loss.
+// Every estimator is streaming and fixed size, so a peer costs the same
+// memory however long the session runs.
+//
+// - RTT and jitter are exponentially weighted moving averages, as used by TCP
+//   (RFC 6298): srtt gains 1/8 of each error and rttvar 1/4 of its magnitude.
+// - Median and 95th percentile RTT use the P-squared algorithm (Jain and
+//   Chlamtac, 1985), which tracks a quantile with five markers.
+// - Loss is the number of gaps in the peer's sequence numbers.
+
+#ifndef MSG_STATS_H
+#define MSG_STATS_H
+
+#include <glib.h>
+
+// P-squared single quantile estimator
+typedef struct {
+    gdouble p;            // Quantile being tracked (0..1)
+    gdouble q[5];         // Marker heights
+    gdouble n[5];         // Marker positions
+    gdouble np[5];        // Desired marker positions
+    gint    count;
+} MsgQuantile;
+
+typedef struct {
+    // Round trip time, in microseconds
+    gdouble     srtt;
+    gdouble     rttvar;
+    gdouble     min_rtt;
+    MsgQuantile p50;
+    MsgQuantile p95;
+    guint64     samples;
+
+    // Sequence numbers received from the peer
+    guint32     first_seq;
+    guint32     highest_seq;
+    guint64     received;
+} MsgPeerStats;
+
+void     msg_stats_init      (MsgPeerStats *stats);
+void     msg_stats_add_rtt   (MsgPeerStats *stats, gdouble rtt);
+void     msg_stats_add_seq   (MsgPeerStats *stats, guint32 seq);
+
+// Fraction of the peer's messages that never arrived (0..1).
+gdouble  msg_stats_loss      (const MsgPeerStats *stats);
+
+void     msg_quantile_init   (MsgQuantile *quantile, gdouble p);
+void     msg_quantile_add    (MsgQuantile *quantile, gdouble x);
+gdouble  msg_quantile_get    (const MsgQuantile *quantile);
+
+// Format a duration in microseconds for display, eg. "850ms", "1.3s",
+// "12m40s" or "7h29m".
+gchar   *msg_stats_format    (gdouble usec);
+
+#endif // MSG_STATS_H
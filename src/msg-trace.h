@@ -0,0 +1,73 @@
+// msg-trace
+
+// Static tracepoints on the message path, shared by 'router' and 'messages'.
+//
+// Built with 'make TRACE=1' (which needs <sys/sdt.h>, from systemtap-sdt-dev
+// or systemtap-sdt-devel), each probe is a Linux USDT probe: a single nop in
+// the code, with its arguments' locations noted in the ELF file for a tracer
+// to find. Each probe also has a semaphore, which the tracer raises while it
+// is attached, and its arguments are only worked out then: until one attaches
+// a probe costs a load and a branch. Built without, the probes and their
+// arguments compile to nothing at all.
+//
+// With semaphores every probe in a file needs one, defined once in the file
+// that fires it with MSG_TRACE_SEMAPHORE(provider, name).
+//
+// Any USDT aware tool can use them, eg.
+//
+//   sudo bpftrace -e 'usdt:./router:router:dequeue { @wait[str(arg0)] = hist(arg3); }'
+//   sudo perf probe -x ./router sdt_router:send && sudo perf record -e sdt_router:send -a
+//
+// Probes, with their arguments (times in microseconds since the epoch, or
+// nanoseconds where noted):
+//
+//   router:receive   queue, length, kernel receive time (ns)
+//   router:enqueue   queue, class, length, packets queued, time in
+//   router:schedule  queue, next service, wait until then
+//   router:turn      link, queue, deficit          (a queue's turn on a link)
+//   router:dequeue   queue, class, length, time spent queued
+//   router:send      queue, length, sendto() result
+//
+//   messages:receive length, receive time
+//   messages:display sender, seq, length, time since receipt
+
+#ifndef MSG_TRACE_H
+#define MSG_TRACE_H
+
+#ifdef MSG_TRACE
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define MSG_TRACE_SEMAPHORE(provider, name)             \
+    volatile unsigned short provider##_##name##_semaphore \
+        __attribute__((unused, section(".probes")));
+#define MSG_TRACE_ENABLED(provider, name)               \
+    __builtin_expect(provider##_##name##_semaphore != 0, 0)
+
+#define MSG_TRACE2(provider, name, a, b)                \
+    do { if (MSG_TRACE_ENABLED(provider, name))         \
+        DTRACE_PROBE2(provider, name, a, b); } while (0)
+#define MSG_TRACE3(provider, name, a, b, c)             \
+    do { if (MSG_TRACE_ENABLED(provider, name))         \
+        DTRACE_PROBE3(provider, name, a, b, c); } while (0)
+#define MSG_TRACE4(provider, name, a, b, c, d)          \
+    do { if (MSG_TRACE_ENABLED(provider, name))         \
+        DTRACE_PROBE4(provider, name, a, b, c, d); } while (0)
+#define MSG_TRACE5(provider, name, a, b, c, d, e)       \
+    do { if (MSG_TRACE_ENABLED(provider, name))         \
+        DTRACE_PROBE5(provider, name, a, b, c, d, e); } while (0)
+
+#else
+
+#define MSG_TRACE_SEMAPHORE(provider, name)
+#define MSG_TRACE_ENABLED(provider, name)               0
+
+#define MSG_TRACE2(provider, name, a, b)                do { } while (0)
+#define MSG_TRACE3(provider, name, a, b, c)             do { } while (0)
+#define MSG_TRACE4(provider, name, a, b, c, d)          do { } while (0)
+#define MSG_TRACE5(provider, name, a, b, c, d, e)       do { } while (0)
+
+#endif
+
+#endif // MSG_TRACE_H
@@ -0,0 +1,999 @@
+// msg-transfer
+
+// Reliable file transfer. See msg-transfer.h.
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "msg-header.h"
+#include "msg-transfer.h"
+
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+#define TICK            (2 * G_TIME_SPAN_MILLISECOND)   // Pacing timer
+#define ACK_DELAY       (20 * G_TIME_SPAN_MILLISECOND)  // Delayed SACK
+#define INITIAL_RTT     G_USEC_PER_SEC                  // Until measured
+#define MIN_RTO         (200 * G_TIME_SPAN_MILLISECOND)     // Least RTO beyond the RTT
+#define MAX_BACKOFF     6                               // RTO doubles up to 64x
+#define MIN_RATE        (4 * MSG_TRANSFER_PAYLOAD)      // Bytes per second
+#define CONGESTED       0.8                             // Of the rate, delivered
+#define MIN_WINDOW      (16 * MSG_TRANSFER_PAYLOAD)
+#define TIMEOUT_SCAN    4096                            // Fragments checked per tick
+#define EXPIRE_SCAN     1                               // Seconds between incoming expiry checks
+#define IDLE_TIMEOUT    (5 * 60 * G_USEC_PER_SEC)       // Least wait for a silent sender...
+#define IDLE_RTTS       8                               // ...or this many RTTs
+#define LINGER_RTTS     4                               // Finished transfers kept for late duplicates
+
+#define DATAGRAM_SIZE   (MSG_HEADER_SIZE + MSG_TRANSFER_DATA_SIZE + MSG_TRANSFER_PAYLOAD)
+
+// Fragment state, on the sending side
+enum {
+    FRAGMENT_UNSENT = 0,
+    FRAGMENT_SENT,                  // In flight
+    FRAGMENT_LOST,                  // Waiting in the retransmit queue
+    FRAGMENT_ACKED
+};
+
+typedef struct {
+    guint32      id;
+    guint32      peer;              // Receiver, known from its first SACK
+    gboolean     peer_known;
+    gchar       *name;
+    GMappedFile *file;
+    const gchar *contents;
+    gsize        name_size;         // Including the NUL
+    gsize        size;              // Name and contents
+    guint32      count;             // Fragments
+
+    guint8      *state;
+    gint64      *sent;              // Last send time of each fragment
+    guint32     *skip;              // Union-find over acknowledged fragments
+    guint32      cum;               // First fragment not acknowledged
+    guint32      next;              // First fragment never sent
+    guint32      highest;           // One past the highest acknowledged
+    guint32      loss_scan;         // Fragments before this checked for loss
+    GQueue       retransmit;
+    GQueue       resent;            // Retransmissions in flight, oldest first
+    gint64       acked_sent;        // Latest send time of any acknowledged fragment
+    guint64      inflight;          // Bytes
+
+    gdouble      srtt;              // Microseconds
+    gdouble      rttvar;
+    guint64      rtt_samples;
+    gdouble      rate;              // Pacing rate, bytes per second
+    gdouble      budget;            // Bytes that may be sent now
+    gint64       last_pump;
+    gint64       recovery_until;    // One rate cut per RTT
+    guint64      delivered;         // Bytes acknowledged
+    guint64      sample_delivered;  // ...at the start of the sample
+    gint64       sample_start;
+    gdouble      delivery_rate;     // Recent best per RTT, 0 until known
+    guint        backoff;
+    guint        timeouts;          // Since the last progress
+
+    gint64       started;
+    guint64      retransmitted;
+} MsgOutgoing;
+
+typedef struct {
+    guint32 start;
+    guint32 end;
+} MsgRange;
+
+typedef struct {
+    guint64      key;               // Sender and transfer ID
+    MsgTransfer *transfer;
+    guint32      peer;
+    guint32      id;
+    guint32      count;
+    gsize        size;
+    gchar       *data;
+    guint8      *have;
+    guint32      received;
+    guint32      cum;               // Fragments before this all received
+    GArray      *ranges;            // MsgRange received beyond 'cum', in order
+    guint32      last;              // Most recent fragment
+    gint64       echo_timestamp;    // Its header timestamp...
+    gint64       echo_received;     // ...and when it arrived
+    guint        unacked;
+    guint        ack_id;            // Delayed SACK timer
+    gboolean     complete;
+    gint64       started;
+} MsgIncoming;
+
+struct _MsgTransfer {
+    guint32              sender;
+    guint32              seq;
+    guint64              rate;
+    MsgTransferSendFunc  send_func;
+    MsgTransferDoneFunc  done_func;
+    gpointer             user_data;
+
+    guint32              next_id;
+    GHashTable          *outgoing;  // ID -> MsgOutgoing
+    GHashTable          *incoming;  // Sender and ID -> MsgIncoming
+    guint                tick_id;
+
+    gsize                incoming_bytes;    // Held in incoming buffers
+    gdouble              rtt;               // Microseconds, see msg_transfer_set_rtt()
+    guint                expire_id;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Encoding
+
+static inline void
+put32 (gchar *p, guint32 value)
+{
+    value = GUINT32_TO_BE(value);
+    memcpy(p, &value, 4);
+}
+
+static inline void
+put64 (gchar *p, guint64 value)
+{
+    value = GUINT64_TO_BE(value);
+    memcpy(p, &value, 8);
+}
+
+static inline guint32
+get32 (const gchar *p)
+{
+    guint32 value;
+
+    memcpy(&value, p, 4);
+    return GUINT32_FROM_BE(value);
+}
+
+static inline guint64
+get64 (const gchar *p)
+{
+    guint64 value;
+
+    memcpy(&value, p, 8);
+    return GUINT64_FROM_BE(value);
+}
+
+// CRC-32C (Castagnoli), reflected, one table lookup per byte.
+static guint32 crc_table[256];
+
+static void
+crc_init (void)
+{
+    for (guint32 i = 0; i < 256; i++) {
+        guint32 crc = i;
+
+        for (gint k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc_table[i] = crc;
+    }
+}
+
+static guint32
+crc_update (guint32 crc, const gchar *data, gsize length)
+{
+    const guchar *p = (const guchar *) data;
+
+    while (length--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// The CRC of a DATA body covers everything but the CRC field itself.
+static guint32
+data_crc (const gchar *body, gsize length)
+{
+    guint32 crc = 0xffffffff;
+
+    crc = crc_update(crc, body, 20);
+    crc = crc_update(crc, body + MSG_TRANSFER_DATA_SIZE, length - MSG_TRANSFER_DATA_SIZE);
+    return ~crc;
+}
+
+static inline gsize
+fragment_length (gsize size, guint32 index)
+{
+    return MIN(MSG_TRANSFER_PAYLOAD, size - (gsize) index * MSG_TRANSFER_PAYLOAD);
+}
+
+static inline guint32
+fragment_count (gsize size)
+{
+    return (size + MSG_TRANSFER_PAYLOAD - 1) / MSG_TRANSFER_PAYLOAD;
+}
+
+static void
+write_header (MsgTransfer *transfer, MsgType type, gchar *buffer, gint64 now)
+{
+    MsgHeader header;
+
+    // Each transmission is a new message, so a retransmitted fragment is not
+    // mistaken for a duplicate along the way.
+    header.type      = type;
+    header.flags     = 0;
+    header.sender    = transfer->sender;
+    header.seq       = ++transfer->seq;
+    header.timestamp = now;
+    msg_header_write(&header, buffer);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sending
+
+// First fragment at or after 'index' not yet acknowledged, or 'count'.
+static guint32
+next_unacked (MsgOutgoing *out, guint32 index)
+{
+    guint32 *skip = out->skip;
+
+    while (skip[index] != index) {
+        skip[index] = skip[skip[index]];
+        index = skip[index];
+    }
+    return index;
+}
+
+static void
+outgoing_free (gpointer data)
+{
+    MsgOutgoing *out = data;
+
+    g_queue_clear(&out->retransmit);
+    g_queue_clear(&out->resent);
+    g_mapped_file_unref(out->file);
+    g_free(out->name);
+    g_free(out->state);
+    g_free(out->sent);
+    g_free(out->skip);
+    g_free(out);
+}
+
+static void
+send_fragment (MsgTransfer *transfer, MsgOutgoing *out, guint32 index, gint64 now)
+{
+    gchar  buffer[DATAGRAM_SIZE];
+    gchar *body    = buffer + MSG_HEADER_SIZE;
+    gchar *payload = body + MSG_TRANSFER_DATA_SIZE;
+    gsize  offset  = (gsize) index * MSG_TRANSFER_PAYLOAD;
+    gsize  length  = fragment_length(out->size, index);
+    gsize  n       = 0;
+
+    write_header(transfer, MSG_TYPE_DATA, buffer, now);
+    put32(body,      out->id);
+    put32(body + 4,  index);
+    put32(body + 8,  out->count);
+    put64(body + 12, out->size);
+
+    // The object is the name then the contents.
+    if (offset < out->name_size) {
+        n = MIN(length, out->name_size - offset);
+        memcpy(payload, out->name + offset, n);
+    }
+    if (n < length)
+        memcpy(payload + n, out->contents + offset + n - out->name_size, length - n);
+
+    put32(body + 20, data_crc(body, MSG_TRANSFER_DATA_SIZE + length));
+
+    transfer->send_func(buffer, MSG_HEADER_SIZE + MSG_TRANSFER_DATA_SIZE + length,
+                        transfer->user_data);
+
+    out->state[index] = FRAGMENT_SENT;
+    out->sent[index]  = now;
+    out->inflight    += length;
+}
+
+static void
+mark_lost (MsgOutgoing *out, guint32 index)
+{
+    out->state[index] = FRAGMENT_LOST;
+    out->inflight    -= fragment_length(out->size, index);
+    g_queue_push_tail(&out->retransmit, GUINT_TO_POINTER(index));
+}
+
+// Resend fragments in flight for longer than the retransmission timeout.
+// Fragments are checked from the oldest unacknowledged, up to the first one
+// that has not timed out. Returns FALSE if the transfer should be abandoned.
+static gboolean
+check_timeouts (MsgOutgoing *out, gint64 now)
+{
+    gint64   rto = (out->srtt + MAX(4 * out->rttvar, MIN_RTO)) * (1 << out->backoff);
+    gboolean expired = FALSE;
+    guint    n = 0;
+
+    for (guint32 i = next_unacked(out, out->cum);
+         i < out->next && n < TIMEOUT_SCAN;
+         i = next_unacked(out, i + 1), n++) {
+        if (out->state[i] != FRAGMENT_SENT)
+            continue;
+        if (out->sent[i] + rto > now)
+            break;
+        mark_lost(out, i);
+        expired = TRUE;
+    }
+
+    // Fragments sent together time out one after another: count them as one
+    // timeout.
+    if (expired && now >= out->recovery_until) {
+        D("[DEBUG] Transfer %u: timeout (%" G_GINT64_FORMAT "us)\n", out->id, rto);
+        if (++out->timeouts > MSG_TRANSFER_RETRIES)
+            return FALSE;
+        out->backoff = MIN(out->backoff + 1, MAX_BACKOFF);
+        out->rate    = MAX(out->rate / 2, MIN_RATE);
+        out->recovery_until = now + rto;
+    }
+    return TRUE;
+}
+
+// Send what the pacing rate and window allow. Returns FALSE if the transfer
+// should be abandoned.
+static gboolean
+pump (MsgTransfer *transfer, MsgOutgoing *out, gint64 now)
+{
+    gdouble window;
+    gdouble burst;
+    guint32 index;
+
+    // Credit for the time since the last pump, but never enough for a burst
+    // of more than a couple of ticks' worth.
+    out->budget += out->rate * (now - out->last_pump) / G_USEC_PER_SEC;
+    out->last_pump = now;
+    burst = MAX(2 * out->rate * TICK / G_USEC_PER_SEC, 4 * MSG_TRANSFER_PAYLOAD);
+    out->budget = MIN(out->budget, burst);
+
+    if (!check_timeouts(out, now))
+        return FALSE;
+
+    // Two bandwidth delay products, so the link stays busy while losses are
+    // repaired.
+    window = MAX(2 * out->rate * out->srtt / G_USEC_PER_SEC, MIN_WINDOW);
+
+    while (out->budget > 0 && out->inflight < window) {
+        if (!g_queue_is_empty(&out->retransmit)) {
+            index = GPOINTER_TO_UINT(g_queue_pop_head(&out->retransmit));
+            if (out->state[index] != FRAGMENT_LOST)
+                continue;           // Acknowledged since
+            g_queue_push_tail(&out->resent, GUINT_TO_POINTER(index));
+            out->retransmitted++;
+        } else if (out->next < out->count) {
+            index = out->next++;
+        } else {
+            break;
+        }
+        send_fragment(transfer, out, index, now);
+        out->budget -= fragment_length(out->size, index);
+    }
+    return TRUE;
+}
+
+static void
+outgoing_done (MsgTransfer *transfer, MsgOutgoing *out, gboolean failed, gint64 now)
+{
+    MsgTransferInfo info;
+
+    info.incoming      = FALSE;
+    info.failed        = failed;
+    info.peer          = out->peer;
+    info.id            = out->id;
+    info.name          = out->name;
+    info.data          = NULL;
+    info.size          = out->size - out->name_size;
+    info.elapsed       = now - out->started;
+    info.retransmitted = out->retransmitted;
+    transfer->done_func(&info, transfer->user_data);
+}
+
+static gboolean
+tick (gpointer data)
+{
+    MsgTransfer    *transfer = data;
+    GHashTableIter  iter;
+    gpointer        value;
+    gint64          now = g_get_real_time();
+
+    g_hash_table_iter_init(&iter, transfer->outgoing);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        if (!pump(transfer, value, now)) {
+            outgoing_done(transfer, value, TRUE, now);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    if (g_hash_table_size(transfer->outgoing) == 0) {
+        transfer->tick_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Acknowledge fragments 'start' up to (not including) 'end'. Returns the
+// number of bytes newly acknowledged.
+static gsize
+ack_range (MsgOutgoing *out, guint32 start, guint32 end)
+{
+    gsize acked = 0;
+
+    start = MIN(start, out->count);
+    end   = MIN(end, out->next);
+    for (guint32 i = next_unacked(out, start); i < end; i = next_unacked(out, i + 1)) {
+        gsize length = fragment_length(out->size, i);
+
+        if (out->state[i] == FRAGMENT_SENT) {
+            out->inflight  -= length;
+            out->acked_sent = MAX(out->acked_sent, out->sent[i]);
+        }
+        out->state[i] = FRAGMENT_ACKED;
+        out->skip[i]  = i + 1;
+        acked += length;
+    }
+    out->highest = MAX(out->highest, end);
+    return acked;
+}
+
+static void
+receive_sack (MsgTransfer     *transfer,
+              const MsgHeader *header,
+              const gchar     *body,
+              gsize            length,
+              gint64           received)
+{
+    MsgOutgoing *out;
+    guint32      cum;
+    gint64       echo_timestamp;
+    guint32      echo_delay;
+    guint32      blocks;
+    gsize        acked;
+    gboolean     lost = FALSE;
+
+    if (length < 24)
+        return;
+    out = g_hash_table_lookup(transfer->outgoing, GUINT_TO_POINTER(get32(body)));
+    if (out == NULL)
+        return;
+
+    // The first SACK says who is receiving the transfer. Any from someone
+    // else, whose transfer ID matches by chance or otherwise, are dropped
+    // rather than allowed to acknowledge it.
+    if (!out->peer_known) {
+        out->peer       = header->sender;
+        out->peer_known = TRUE;
+    } else if (header->sender != out->peer) {
+        D("[DEBUG] Transfer %u: SACK from %08x, not %08x, dropped\n",
+          out->id, header->sender, out->peer);
+        return;
+    }
+
+    cum            = get32(body + 4);
+    echo_timestamp = get64(body + 8);
+    echo_delay     = get32(body + 16);
+    blocks         = MIN(get32(body + 20), (length - 24) / 8);
+
+    // RTT, as for chat acknowledgements (RFC 6298). The first measurement
+    // replaces the initial guess outright.
+    if (echo_timestamp > 0 && received - echo_timestamp - echo_delay > 0) {
+        gdouble rtt = received - echo_timestamp - echo_delay;
+
+        if (out->rtt_samples++ == 0) {
+            out->srtt   = rtt;
+            out->rttvar = rtt / 2;
+        } else {
+            out->rttvar = 0.75 * out->rttvar + 0.25 * ABS(out->srtt - rtt);
+            out->srtt   = 0.875 * out->srtt + 0.125 * rtt;
+        }
+    }
+
+    acked = ack_range(out, 0, cum);
+    for (guint32 b = 0; b < blocks; b++)
+        acked += ack_range(out, get32(body + 24 + 8 * b), get32(body + 28 + 8 * b));
+    out->cum = next_unacked(out, out->cum);
+
+    out->delivered += acked;
+    if (received - out->sample_start >= out->srtt) {
+        // The recent maximum, so that a sample cut short by losses being
+        // repaired does not count as congestion.
+        if (out->sample_start > 0) {
+            gdouble sample = (gdouble) (out->delivered - out->sample_delivered) *
+                             G_USEC_PER_SEC / (received - out->sample_start);
+
+            out->delivery_rate = MAX(sample, 0.9 * out->delivery_rate);
+        }
+        out->sample_start     = received;
+        out->sample_delivered = out->delivered;
+    }
+
+    if (out->cum >= out->count) {
+        outgoing_done(transfer, out, FALSE, received);
+        g_hash_table_remove(transfer->outgoing, GUINT_TO_POINTER(out->id));
+        return;
+    }
+
+    // A fragment still in flight with MSG_TRANSFER_DUPTHRESH later fragments
+    // acknowledged is taken as lost. Each fragment is only checked once this
+    // way; a lost retransmission waits for the timeout.
+    if (out->highest > MSG_TRANSFER_DUPTHRESH) {
+        guint32 limit = out->highest - MSG_TRANSFER_DUPTHRESH;
+
+        for (guint32 i = next_unacked(out, MAX(out->loss_scan, out->cum));
+             i < limit;
+             i = next_unacked(out, i + 1)) {
+            if (out->state[i] == FRAGMENT_SENT) {
+                mark_lost(out, i);
+                lost = TRUE;
+            }
+        }
+        out->loss_scan = MAX(out->loss_scan, limit);
+    }
+
+    // A retransmission is lost if a fragment sent well after it has been
+    // acknowledged (as in RACK, RFC 8985), rather than waiting for a timeout.
+    while (!g_queue_is_empty(&out->resent)) {
+        guint32 i = GPOINTER_TO_UINT(g_queue_peek_head(&out->resent));
+
+        if (out->state[i] == FRAGMENT_SENT) {
+            if (out->sent[i] + out->srtt / 4 >= out->acked_sent)
+                break;
+            mark_lost(out, i);
+            lost = TRUE;
+        }
+        g_queue_pop_head(&out->resent);
+    }
+
+    if (lost) {
+        // Slow down only if fragments are getting through well below the
+        // sending rate. Random loss barely changes that, so a lossy link is
+        // still used fully; congestion further on brings the rate down to
+        // the bottleneck's.
+        if (received >= out->recovery_until) {
+            if (out->delivery_rate == 0)
+                out->rate = MAX(out->rate * 0.85, MIN_RATE);
+            else if (out->delivery_rate < CONGESTED * out->rate)
+                out->rate = MAX(MAX(out->delivery_rate, out->rate / 2), MIN_RATE);
+            out->recovery_until = received + out->srtt;
+        }
+    } else if (acked > 0) {
+        // Grow back towards the link rate by about an eighth per RTT.
+        gdouble flight = MAX(out->rate * out->srtt / G_USEC_PER_SEC, MSG_TRANSFER_PAYLOAD);
+
+        out->rate = MIN(out->rate * (1 + acked / (8 * flight)), transfer->rate);
+    }
+
+    if (acked > 0) {
+        out->timeouts = 0;
+        out->backoff  = 0;
+    }
+
+    // Send into the space just opened.
+    pump(transfer, out, received);
+}
+
+guint32
+msg_transfer_send (MsgTransfer  *transfer,
+                   const gchar  *path,
+                   gdouble       rtt,
+                   GError      **error)
+{
+    MsgOutgoing *out;
+    GMappedFile *file;
+    gsize        size;
+
+    file = g_mapped_file_new(path, FALSE, error);
+    if (file == NULL)
+        return 0;
+
+    size = g_mapped_file_get_length(file);
+    if (size > MSG_TRANSFER_MAX) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FBIG,
+                    "%s is too large to send (%" G_GSIZE_FORMAT " bytes)", path, size);
+        g_mapped_file_unref(file);
+        return 0;
+    }
+
+    out = g_new0(MsgOutgoing, 1);
+    if (++transfer->next_id == 0)
+        transfer->next_id = 1;
+    out->id        = transfer->next_id;
+    out->file      = file;
+    out->contents  = g_mapped_file_get_contents(file);
+    out->name      = g_path_get_basename(path);
+    out->name_size = strlen(out->name) + 1;
+    out->size      = out->name_size + size;
+    out->count     = fragment_count(out->size);
+
+    out->state = g_new0(guint8, out->count);
+    out->sent  = g_new0(gint64, out->count);
+    out->skip  = g_new(guint32, out->count + 1);
+    for (guint32 i = 0; i <= out->count; i++)
+        out->skip[i] = i;
+    g_queue_init(&out->retransmit);
+    g_queue_init(&out->resent);
+
+    out->srtt      = rtt > 0 ? rtt : INITIAL_RTT;
+    out->rttvar    = out->srtt / 2;
+    out->rate      = transfer->rate;
+    out->started   = g_get_real_time();
+    out->last_pump = out->started;
+
+    g_hash_table_insert(transfer->outgoing, GUINT_TO_POINTER(out->id), out);
+
+    D("[DEBUG] Transfer %u: sending %s, %" G_GSIZE_FORMAT " bytes in %u fragments\n",
+      out->id, out->name, size, out->count);
+
+    pump(transfer, out, out->started);
+    if (transfer->tick_id == 0)
+        transfer->tick_id = g_timeout_add(TICK / G_TIME_SPAN_MILLISECOND, tick, transfer);
+
+    return out->id;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Receiving
+
+static void
+incoming_free (gpointer data)
+{
+    MsgIncoming *in = data;
+
+    if (in->ack_id != 0)
+        g_source_remove(in->ack_id);
+    if (in->data != NULL)
+        in->transfer->incoming_bytes -= in->size;
+    g_free(in->data);
+    g_free(in->have);
+    if (in->ranges != NULL)
+        g_array_free(in->ranges, TRUE);
+    g_free(in);
+}
+
+static void
+send_sack (MsgTransfer *transfer, MsgIncoming *in)
+{
+    gchar     buffer[MSG_HEADER_SIZE + MSG_TRANSFER_SACK_SIZE];
+    gchar    *body = buffer + MSG_HEADER_SIZE;
+    gint64    now  = g_get_real_time();
+    guint32   blocks = 0;
+    MsgRange *range;
+
+    write_header(transfer, MSG_TYPE_SACK, buffer, now);
+    put32(body,      in->id);
+    put32(body + 4,  in->complete ? in->count : in->cum);
+    put64(body + 8,  in->echo_timestamp);
+    put32(body + 16, MIN(now - in->echo_received, G_MAXUINT32));
+
+    // The range holding the latest fragment first, then the highest others.
+    if (!in->complete) {
+        gint latest = -1;
+
+        for (guint i = 0; i < in->ranges->len; i++) {
+            range = &g_array_index(in->ranges, MsgRange, i);
+            if (range->start <= in->last && in->last < range->end) {
+                put32(body + 24, range->start);
+                put32(body + 28, range->end);
+                blocks++;
+                latest = i;
+                break;
+            }
+        }
+        for (gint i = in->ranges->len - 1; i >= 0 && blocks < MSG_TRANSFER_BLOCKS; i--) {
+            if (i == latest)
+                continue;
+            range = &g_array_index(in->ranges, MsgRange, i);
+            put32(body + 24 + 8 * blocks, range->start);
+            put32(body + 28 + 8 * blocks, range->end);
+            blocks++;
+        }
+    }
+    put32(body + 20, blocks);
+
+    transfer->send_func(buffer, MSG_HEADER_SIZE + 24 + 8 * blocks, transfer->user_data);
+
+    in->unacked = 0;
+    if (in->ack_id != 0) {
+        g_source_remove(in->ack_id);
+        in->ack_id = 0;
+    }
+}
+
+static gboolean
+delayed_sack (gpointer data)
+{
+    MsgIncoming *in = data;
+
+    in->ack_id = 0;
+    send_sack(in->transfer, in);
+    return G_SOURCE_REMOVE;
+}
+
+// Record fragment 'index', received beyond 'cum'.
+static void
+add_range (MsgIncoming *in, guint32 index)
+{
+    GArray   *ranges = in->ranges;
+    MsgRange *left   = NULL;
+    MsgRange *right  = NULL;
+    MsgRange  range  = { index, index + 1 };
+    guint     low    = 0;
+    guint     high   = ranges->len;
+
+    // First range starting after 'index'
+    while (low < high) {
+        guint mid = (low + high) / 2;
+
+        if (g_array_index(ranges, MsgRange, mid).start > index)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    if (low > 0 && g_array_index(ranges, MsgRange, low - 1).end == index)
+        left = &g_array_index(ranges, MsgRange, low - 1);
+    if (low < ranges->len && g_array_index(ranges, MsgRange, low).start == index + 1)
+        right = &g_array_index(ranges, MsgRange, low);
+
+    if (left != NULL && right != NULL) {
+        left->end = right->end;
+        g_array_remove_index(ranges, low);
+    } else if (left != NULL) {
+        left->end++;
+    } else if (right != NULL) {
+        right->start--;
+    } else {
+        g_array_insert_val(ranges, low, range);
+    }
+}
+
+static void
+incoming_done (MsgTransfer *transfer, MsgIncoming *in, gint64 now)
+{
+    MsgTransferInfo info;
+    gsize           name_size;
+
+    in->complete = TRUE;
+
+    name_size = strnlen(in->data, in->size);
+    if (name_size < in->size) {
+        name_size++;
+        info.incoming      = TRUE;
+        info.failed        = FALSE;
+        info.peer          = in->peer;
+        info.id            = in->id;
+        info.name          = in->data;
+        info.data          = in->data + name_size;
+        info.size          = in->size - name_size;
+        info.elapsed       = now - in->started;
+        info.retransmitted = 0;
+        transfer->done_func(&info, transfer->user_data);
+    } else {
+        g_printerr("[ERROR] Transfer %u from %08x has no file name\n", in->id, in->peer);
+    }
+
+    // Keep only what is needed to acknowledge late duplicates.
+    transfer->incoming_bytes -= in->size;
+    g_clear_pointer(&in->data, g_free);
+    g_clear_pointer(&in->have, g_free);
+    g_array_free(in->ranges, TRUE);
+    in->ranges = NULL;
+}
+
+// Drop incoming transfers whose sender has gone quiet, and finished ones
+// whose last acknowledgement has had time to arrive.
+static gboolean
+expire_incoming (gpointer data)
+{
+    MsgTransfer    *transfer = data;
+    GHashTableIter  iter;
+    gpointer        value;
+    gint64          now    = g_get_real_time();
+    gdouble         idle   = MAX(IDLE_TIMEOUT, IDLE_RTTS * transfer->rtt);
+    gdouble         linger = LINGER_RTTS * transfer->rtt;
+
+    g_hash_table_iter_init(&iter, transfer->incoming);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        MsgIncoming *in = value;
+        gint64       quiet = now - in->echo_received;
+
+        if (in->complete ? quiet > linger : quiet > idle) {
+            if (!in->complete)
+                g_printerr("[ERROR] Transfer %u from %08x abandoned with %u of %u fragments\n",
+                           in->id, in->peer, in->received, in->count);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    if (g_hash_table_size(transfer->incoming) == 0) {
+        transfer->expire_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+receive_data (MsgTransfer     *transfer,
+              const MsgHeader *header,
+              const gchar     *body,
+              gsize            length,
+              gint64           received)
+{
+    MsgIncoming *in;
+    guint64      key;
+    guint32      id, index, count;
+    guint64      size;
+    gsize        payload = length - MSG_TRANSFER_DATA_SIZE;
+    gboolean     in_order;
+
+    if (length < MSG_TRANSFER_DATA_SIZE)
+        return;
+    if (get32(body + 20) != data_crc(body, length)) {
+        D("[DEBUG] Transfer fragment from %08x failed its CRC\n", header->sender);
+        return;
+    }
+
+    id    = get32(body);
+    index = get32(body + 4);
+    count = get32(body + 8);
+    size  = get64(body + 12);
+    if (size == 0 || size > MSG_TRANSFER_MAX + MSG_TRANSFER_PAYLOAD ||
+        count != fragment_count(size) || index >= count ||
+        payload != fragment_length(size, index))
+        return;
+
+    key = ((guint64) header->sender << 32) | id;
+    in  = g_hash_table_lookup(transfer->incoming, &key);
+    if (in == NULL) {
+        // A fragment of a new transfer claims the whole file's buffer, so
+        // hold no more than MSG_TRANSFER_INCOMING_MAX for all senders.
+        if (transfer->incoming_bytes + size > MSG_TRANSFER_INCOMING_MAX) {
+            D("[DEBUG] Transfer %u from %08x: no room for %" G_GUINT64_FORMAT " bytes\n",
+              id, header->sender, size);
+            return;
+        }
+        in = g_new0(MsgIncoming, 1);
+        in->key      = key;
+        in->transfer = transfer;
+        in->peer     = header->sender;
+        in->id       = id;
+        in->count    = count;
+        in->size     = size;
+        in->data     = g_try_malloc(size);
+        in->have     = g_try_malloc0(count);
+        in->ranges   = g_array_new(FALSE, FALSE, sizeof(MsgRange));
+        in->started  = received;
+        if (in->data == NULL || in->have == NULL) {
+            g_printerr("[ERROR] No memory for a transfer of %" G_GUINT64_FORMAT " bytes\n", size);
+            g_clear_pointer(&in->data, g_free);
+            incoming_free(in);
+            return;
+        }
+        transfer->incoming_bytes += size;
+        g_hash_table_insert(transfer->incoming, &in->key, in);
+        if (transfer->expire_id == 0)
+            transfer->expire_id = g_timeout_add_seconds(EXPIRE_SCAN, expire_incoming, transfer);
+        D("[DEBUG] Transfer %u from %08x: %u fragments\n", id, in->peer, count);
+    } else if (in->count != count || in->size != size) {
+        return;
+    }
+
+    in->echo_timestamp = header->timestamp;
+    in->echo_received  = received;
+
+    // A duplicate means our acknowledgement was lost or late: repeat it now.
+    if (in->complete || in->have[index]) {
+        send_sack(transfer, in);
+        return;
+    }
+
+    memcpy(in->data + (gsize) index * MSG_TRANSFER_PAYLOAD, body + MSG_TRANSFER_DATA_SIZE, payload);
+    in->have[index] = 1;
+    in->received++;
+    in->last = index;
+
+    in_order = index == in->cum;
+    if (in_order) {
+        in->cum++;
+        if (in->ranges->len > 0 && g_array_index(in->ranges, MsgRange, 0).start == in->cum) {
+            in->cum = g_array_index(in->ranges, MsgRange, 0).end;
+            g_array_remove_index(in->ranges, 0);
+        }
+    } else {
+        add_range(in, index);
+    }
+
+    if (in->received == in->count) {
+        incoming_done(transfer, in, received);
+        send_sack(transfer, in);
+        return;
+    }
+
+    // Acknowledge every second fragment, or at once while there is a gap so
+    // the sender learns of losses quickly.
+    if (!in_order || in->ranges->len > 0 || ++in->unacked >= 2)
+        send_sack(transfer, in);
+    else if (in->ack_id == 0)
+        in->ack_id = g_timeout_add(ACK_DELAY / G_TIME_SPAN_MILLISECOND, delayed_sack, in);
+}
+
+void
+msg_transfer_receive (MsgTransfer     *transfer,
+                      const MsgHeader *header,
+                      const gchar     *body,
+                      gsize            length,
+                      gint64           received)
+{
+    switch (header->type) {
+    case MSG_TYPE_DATA:
+        receive_data(transfer, header, body, length, received);
+        break;
+    case MSG_TYPE_SACK:
+        receive_sack(transfer, header, body, length, received);
+        break;
+    default:
+        break;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+MsgTransfer *
+msg_transfer_new (guint32              sender,
+                  guint64              rate,
+                  MsgTransferSendFunc  send_func,
+                  MsgTransferDoneFunc  done_func,
+                  gpointer             user_data)
+{
+    MsgTransfer *transfer = g_new0(MsgTransfer, 1);
+
+    crc_init();
+
+    transfer->sender    = sender;
+    transfer->rate      = MAX(rate, MIN_RATE);
+    transfer->send_func = send_func;
+    transfer->done_func = done_func;
+    transfer->user_data = user_data;
+    transfer->next_id   = g_random_int();
+    transfer->rtt       = INITIAL_RTT;
+    transfer->outgoing  = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, outgoing_free);
+    transfer->incoming  = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, incoming_free);
+
+    return transfer;
+}
+
+void
+msg_transfer_free (MsgTransfer *transfer)
+{
+    if (transfer == NULL)
+        return;
+
+    if (transfer->tick_id != 0)
+        g_source_remove(transfer->tick_id);
+    if (transfer->expire_id != 0)
+        g_source_remove(transfer->expire_id);
+    g_hash_table_destroy(transfer->outgoing);
+    g_hash_table_destroy(transfer->incoming);
+    g_free(transfer);
+}
+
+void
+msg_transfer_set_rate (MsgTransfer *transfer, guint64 rate)
+{
+    GHashTableIter  iter;
+    gpointer        value;
+
+    transfer->rate = MAX(rate, MIN_RATE);
+
+    g_hash_table_iter_init(&iter, transfer->outgoing);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        MsgOutgoing *out = value;
+
+        out->rate = MIN(out->rate, transfer->rate);
+    }
+}
+
+void
+msg_transfer_set_rtt (MsgTransfer *transfer, gdouble rtt)
+{
+    if (rtt > 0)
+        transfer->rtt = rtt;
+}
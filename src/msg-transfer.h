@@ -0,0 +1,98 @@
+// msg-transfer
+
+// Reliable file transfer for 'messages', over the same datagrams (and
+// routers) as chat.
+//
+// A file is sent as one object, its name then its contents, cut into
+// fragments of MSG_TRANSFER_PAYLOAD bytes so every datagram fits the router's
+// and receiver's buffers. Each fragment is a MSG_TYPE_DATA message carrying
+// its index and a CRC-32C of the fragment; a corrupt fragment is dropped as if
+// lost. The receiver answers with MSG_TYPE_SACK messages: the count of
+// fragments received without a gap, plus up to MSG_TRANSFER_BLOCKS ranges
+// received beyond it, so one acknowledgement repairs many losses.
+//
+// The sender keeps a window of about two bandwidth delay products in flight
+// (the sending rate times the smoothed RTT), paced evenly over time rather
+// than in bursts, so a link with a long delay (eg. minutes) is kept full. A
+// fragment is resent when MSG_TRANSFER_DUPTHRESH later fragments have been
+// acknowledged, or after a retransmission timeout; each loss event cuts the
+// rate, which otherwise grows back to the configured link rate.
+//
+//   DATA   0    4      8      12     20    24
+//          id   index  count  size   crc   payload...
+//
+//   SACK   0    4    8               16           20       24
+//          id   cum  echo_timestamp  echo_delay   blocks   start end ...
+//
+// Like the header, all fields are big endian.
+
+#ifndef MSG_TRANSFER_H
+#define MSG_TRANSFER_H
+
+#include <glib.h>
+
+#include "msg-header.h"
+
+#define MSG_TRANSFER_DATA_SIZE  24
+#define MSG_TRANSFER_PAYLOAD    960     // Fragment size; datagrams stay < 1024
+#define MSG_TRANSFER_BLOCKS     4       // SACK ranges per acknowledgement
+#define MSG_TRANSFER_SACK_SIZE  (24 + MSG_TRANSFER_BLOCKS * 8)
+#define MSG_TRANSFER_DUPTHRESH  3
+#define MSG_TRANSFER_RETRIES    10      // Timeouts in a row before giving up
+#define MSG_TRANSFER_MAX        (256 * 1024 * 1024)     // Largest file
+#define MSG_TRANSFER_INCOMING_MAX (2 * MSG_TRANSFER_MAX) // Held for all incoming transfers
+
+// A transfer that has finished, either way. 'data' and 'name' are only valid
+// during the call.
+typedef struct {
+    gboolean     incoming;
+    gboolean     failed;            // Sending gave up after MSG_TRANSFER_RETRIES timeouts
+    guint32      peer;              // Sender ID of the other end
+    guint32      id;
+    const gchar *name;
+    const gchar *data;              // Contents of a received file, else NULL
+    gsize        size;
+    gint64       elapsed;           // Microseconds from first to last fragment
+    guint64      retransmitted;     // Fragments sent more than once
+} MsgTransferInfo;
+
+// Send one datagram. Returns FALSE if it was dropped locally.
+typedef gboolean (*MsgTransferSendFunc) (const gchar *data, gsize length, gpointer user_data);
+typedef void     (*MsgTransferDoneFunc) (const MsgTransferInfo *info, gpointer user_data);
+
+typedef struct _MsgTransfer MsgTransfer;
+
+// 'sender' is our ID in message headers. 'rate' is the link rate in bytes per
+// second, the most the sender will ever use. Both functions are called from
+// the default main context.
+MsgTransfer *msg_transfer_new      (guint32              sender,
+                                    guint64              rate,
+                                    MsgTransferSendFunc  send_func,
+                                    MsgTransferDoneFunc  done_func,
+                                    gpointer             user_data);
+void         msg_transfer_free     (MsgTransfer *transfer);
+
+void         msg_transfer_set_rate (MsgTransfer *transfer, guint64 rate);
+
+// The round trip time to peers (microseconds), eg. from chat acknowledgements.
+// Incoming transfers are dropped when their sender has been silent for much
+// longer than this, and finished ones are forgotten a few RTTs after their
+// last acknowledgement, so nothing is held on behalf of a sender forever.
+void         msg_transfer_set_rtt  (MsgTransfer *transfer, gdouble rtt);
+
+// Start sending a file. 'rtt' (microseconds, 0 if unknown) seeds the RTT
+// estimate, eg. from the peer's chat acknowledgements. Returns the transfer
+// ID, or 0 with 'error' set if the file could not be read.
+guint32      msg_transfer_send     (MsgTransfer  *transfer,
+                                    const gchar  *path,
+                                    gdouble       rtt,
+                                    GError      **error);
+
+// Handle a received MSG_TYPE_DATA or MSG_TYPE_SACK message.
+void         msg_transfer_receive  (MsgTransfer     *transfer,
+                                    const MsgHeader *header,
+                                    const gchar     *body,
+                                    gsize            length,
+                                    gint64           received);
+
+#endif // MSG_TRANSFER_H
@@ -51,7 +51,7 @@ typedef struct {
     RtTarget target;
     guint16  port_in;
     GQueue   *queue;
-    gint64   delay;       // Default delay to target in seconds.
+    gint64   delay;       // Default delay to target in microseconds.
     gint64   nextservice; // When the next packet should be sent. Stored here so
                           // that the queue does not need to store this time
                           // (uint64) for every packet. It is calculated by
@@ -0,0 +1,528 @@
+// router-replay
+
+// This program re-injects previously captured traffic. It reads pcap files
+// (such as those written by 'router --capture') or router journal output (the
+// "date | message" lines printed by the router) and re-sends the datagrams to
+// configured ports, either at the original inter-packet timing, at a speed
+// multiple, or as fast as possible. Datagrams that fall due together are sent
+// with a single sendmmsg() call.
+
+#define _GNU_SOURCE // sendmmsg()
+
+// Required for networking code with GNU libc. Is not portable to other libc.
+#include <errno.h>
+
+// GLib headers
+#include <glib.h>
+
+// Networking
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+
+#define BUFSIZE 1024
+#define STRSIZE 32
+
+// #define DEBUG
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+#define MAX_BATCH       256
+#define SPIN_USEC       200     // Busy-wait instead of sleeping this close to a send
+#define HISTOGRAM_SIZE  32      // log2(microseconds) buckets
+#define FULL_MSEC       1       // Longest wait for room in a full socket buffer
+
+// pcap link types understood
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LINUX_SLL  113
+
+// Packet to replay. 'data' points into the mapped input file.
+typedef struct {
+    gint64       timestamp;   // Nanoseconds
+    guint16      port;        // Original destination port (0 if unknown)
+    const gchar *data;
+    gsize        length;
+} RpPacket;
+
+// Destination for a given original port (0 = default target).
+typedef struct {
+    guint16            port;
+    struct sockaddr_in addr;
+} RpTarget;
+
+// Command line options
+static gchar   **opt_map       = NULL;
+static gchar    *opt_target    = NULL;
+static gdouble   opt_speed     = 1.0;
+static gint      opt_batch     = 32;
+static gint      opt_loop      = 1;
+static gchar    *opt_direction = "any";
+
+static GOptionEntry entries[] =
+{
+    { "target",    't', 0, G_OPTION_ARG_STRING,       &opt_target,
+      "Send all packets to HOST:PORT", "HOST:PORT" },
+    { "map",       'm', 0, G_OPTION_ARG_STRING_ARRAY, &opt_map,
+      "Send packets originally for PORT to HOST:PORT (repeatable)", "PORT=HOST:PORT" },
+    { "speed",     's', 0, G_OPTION_ARG_DOUBLE,       &opt_speed,
+      "Timing multiple (1 = original, 2 = twice as fast, 0 = as fast as possible)", "X" },
+    { "batch",     'b', 0, G_OPTION_ARG_INT,          &opt_batch,
+      "Maximum datagrams per sendmmsg() call (default 32)", "N" },
+    { "loop",      'l', 0, G_OPTION_ARG_INT,          &opt_loop,
+      "Replay the trace N times (default 1)", "N" },
+    { "direction", 'd', 0, G_OPTION_ARG_STRING,       &opt_direction,
+      "With router captures, replay only 'in' (received) or 'out' (forwarded) packets", "in|out|any" },
+    { NULL }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Utilities
+
+static gboolean
+rp_parse_address (const gchar *str, struct sockaddr_in *addr)
+{
+    struct addrinfo  hints, *result;
+    gchar          **parts;
+    gboolean         ok = FALSE;
+
+    parts = g_strsplit(str, ":", 2);
+    if (g_strv_length(parts) == 2) {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(parts[0], parts[1], &hints, &result) == 0) {
+            memcpy(addr, result->ai_addr, sizeof(*addr));
+            freeaddrinfo(result);
+            ok = TRUE;
+        }
+    }
+    g_strfreev(parts);
+
+    if (!ok)
+        g_printerr("[ERROR] Unable to resolve %s\n", str);
+    return ok;
+}
+
+static gint64
+rp_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleep until 'when' (monotonic nanoseconds), spinning for the last stretch.
+static void
+rp_wait_until (gint64 when)
+{
+    gint64          remaining;
+    struct timespec ts;
+
+    while ((remaining = when - rp_now()) > SPIN_USEC * 1000) {
+        remaining -= SPIN_USEC * 1000;
+        ts.tv_sec  = remaining / 1000000000;
+        ts.tv_nsec = remaining % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+    while (rp_now() < when)
+        ;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Input
+
+static guint16
+rp_get16 (const guchar *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static guint32
+rp_swap32 (guint32 value, gboolean swapped)
+{
+    return swapped ? GUINT32_SWAP_LE_BE(value) : value;
+}
+
+// Extract the UDP payload from a captured frame. Returns FALSE for anything
+// that is not an unfragmented IPv4/UDP datagram.
+static gboolean
+rp_pcap_udp (const guchar *frame, gsize length, guint32 linktype, RpPacket *packet)
+{
+    gsize   offset = 0;
+    guint   ihl;
+    guint16 ip_id;
+    gint    payload;
+
+    switch (linktype) {
+    case LINKTYPE_NULL:
+        offset = 4;
+        break;
+    case LINKTYPE_ETHERNET:
+        if (length < 14 || rp_get16(frame + 12) != 0x0800)
+            return FALSE;
+        offset = 14;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (length < 16 || rp_get16(frame + 14) != 0x0800)
+            return FALSE;
+        offset = 16;
+        break;
+    case LINKTYPE_RAW:
+        break;
+    default:
+        return FALSE;
+    }
+
+    frame  += offset;
+    length -= MIN(offset, length);
+    if (length < 20 || (frame[0] >> 4) != 4 || frame[9] != IPPROTO_UDP)
+        return FALSE;
+    if (rp_get16(frame + 6) & 0x3fff)   // Fragment
+        return FALSE;
+
+    // router --capture marks forwarded packets with an IP id of 1.
+    ip_id = rp_get16(frame + 4);
+    if (g_strcmp0(opt_direction, "in") == 0 && ip_id != 0)
+        return FALSE;
+    if (g_strcmp0(opt_direction, "out") == 0 && ip_id != 1)
+        return FALSE;
+
+    ihl = (frame[0] & 0x0f) * 4;
+    if (length < ihl + 8)
+        return FALSE;
+    payload = rp_get16(frame + ihl + 4) - 8;
+    if (payload < 0)
+        return FALSE;
+
+    packet->port   = rp_get16(frame + ihl + 2);
+    packet->data   = (const gchar *) frame + ihl + 8;
+    packet->length = MIN((gsize) payload, length - ihl - 8);
+    return TRUE;
+}
+
+static gboolean
+rp_load_pcap (const gchar *contents, gsize size, GArray *packets)
+{
+    const guchar *p = (const guchar *) contents;
+    guint32       magic, linktype;
+    gboolean      swapped, nsec;
+    gsize         offset;
+    RpPacket      packet;
+
+    memcpy(&magic, p, 4);
+    switch (magic) {
+    case 0xa1b2c3d4: swapped = FALSE; nsec = FALSE; break;
+    case 0xa1b23c4d: swapped = FALSE; nsec = TRUE;  break;
+    case 0xd4c3b2a1: swapped = TRUE;  nsec = FALSE; break;
+    case 0x4d3cb2a1: swapped = TRUE;  nsec = TRUE;  break;
+    default:
+        return FALSE;
+    }
+
+    if (size < 24)
+        return FALSE;
+    memcpy(&linktype, p + 20, 4);
+    linktype = rp_swap32(linktype, swapped) & 0xffff;
+
+    for (offset = 24; offset + 16 <= size; ) {
+        guint32 record[4];
+
+        memcpy(record, p + offset, sizeof(record));
+        for (gint i = 0; i < 4; i++)
+            record[i] = rp_swap32(record[i], swapped);
+        offset += 16;
+        if (offset + record[2] > size)
+            break;
+
+        packet.timestamp = (gint64) record[0] * 1000000000 +
+                           (nsec ? record[1] : (gint64) record[1] * 1000);
+        if (rp_pcap_udp(p + offset, record[2], linktype, &packet))
+            g_array_append_val(packets, packet);
+        offset += record[2];
+    }
+
+    return TRUE;
+}
+
+// Router journal lines look like "2022/03/01 10:00:00 +1030 | message".
+static gboolean
+rp_load_journal (const gchar *contents, gsize size, GArray *packets)
+{
+    const gchar *line = contents;
+    const gchar *end  = contents + size;
+    RpPacket     packet;
+
+    while (line < end) {
+        const gchar *eol = memchr(line, '\n', end - line);
+        gint         year, month, day, hour, minute, second, zone_hour, zone_minute;
+        gchar        sign, sep;
+        gint         n = 0;
+
+        if (eol == NULL)
+            eol = end;
+
+        // The zone's sign is read on its own: as a number, -0030 would lose
+        // it to zone / 100 == 0.
+        if (sscanf(line, "%4d/%2d/%2d %2d:%2d:%2d %c%2d%2d %c%n",
+                   &year, &month, &day, &hour, &minute, &second,
+                   &sign, &zone_hour, &zone_minute, &sep, &n) == 10 &&
+            (sign == '+' || sign == '-') && sep == '|' && line + n < eol) {
+            gchar     *iso;
+            GDateTime *datetime;
+
+            iso = g_strdup_printf("%04d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d",
+                                  year, month, day, hour, minute, second,
+                                  sign, zone_hour, zone_minute);
+            datetime = g_date_time_new_from_iso8601(iso, NULL);
+            g_free(iso);
+
+            if (datetime != NULL) {
+                packet.timestamp = g_date_time_to_unix(datetime) * 1000000000;
+                packet.port      = 0;
+                packet.data      = line + n + 1;   // Skip the space after '|'
+                packet.length    = MAX(eol - packet.data, 0);
+                g_array_append_val(packets, packet);
+                g_date_time_unref(datetime);
+            }
+        }
+        line = eol + 1;
+    }
+
+    return TRUE;
+}
+
+static gint
+rp_packet_compare (gconstpointer a, gconstpointer b)
+{
+    const RpPacket *pa = a, *pb = b;
+
+    return (pa->timestamp > pb->timestamp) - (pa->timestamp < pb->timestamp);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Replay
+
+static const struct sockaddr_in *
+rp_target_for (GArray *targets, guint16 port)
+{
+    RpTarget *fallback = NULL;
+
+    for (guint i = 0; i < targets->len; i++) {
+        RpTarget *target = &g_array_index(targets, RpTarget, i);
+        if (target->port == port)
+            return &target->addr;
+        if (target->port == 0)
+            fallback = target;
+    }
+    return fallback ? &fallback->addr : NULL;
+}
+
+static void
+rp_report (guint64 sent, guint64 bytes, guint64 skipped, gint64 elapsed, guint64 *histogram)
+{
+    gdouble seconds = MAX(elapsed, 1) / 1e9;
+    guint64 total = 0;
+
+    g_print("[REPLAY] Sent %" G_GUINT64_FORMAT " packets, %" G_GUINT64_FORMAT " bytes in %.3f s\n",
+            sent, bytes, seconds);
+    g_print("[REPLAY] Throughput: %.0f packets/s, %.3f Mbit/s\n",
+            sent / seconds, bytes * 8 / seconds / 1e6);
+    if (skipped)
+        g_print("[REPLAY] Skipped %" G_GUINT64_FORMAT " packets with no target\n", skipped);
+
+    g_print("[REPLAY] Send lateness (actual - scheduled):\n");
+    for (gint i = 0; i < HISTOGRAM_SIZE; i++) {
+        total += histogram[i];
+        if (histogram[i] == 0)
+            continue;
+        g_print("  < %10" G_GUINT64_FORMAT " us  %10" G_GUINT64_FORMAT "  %6.2f%%\n",
+                (guint64) 1 << i, histogram[i], 100.0 * total / MAX(sent, 1));
+    }
+}
+
+static void
+rp_replay (gint sockfd, GArray *packets, GArray *targets)
+{
+    struct mmsghdr  msgs[MAX_BATCH];
+    struct iovec    iovs[MAX_BATCH];
+    guint64         histogram[HISTOGRAM_SIZE] = { 0 };
+    guint64         sent = 0, bytes = 0, skipped = 0;
+    gint64          first, start, now;
+    gint            batch = CLAMP(opt_batch, 1, MAX_BATCH);
+
+    if (packets->len == 0)
+        return;
+
+    first = g_array_index(packets, RpPacket, 0).timestamp;
+    start = rp_now();
+
+    for (gint loop = 0; loop < opt_loop; loop++) {
+        gint64 offset = rp_now() - start;
+        guint  i = 0;
+
+        while (i < packets->len) {
+            gint64 due = start + offset;
+            gint   n = 0;
+
+            if (opt_speed > 0)
+                due += (g_array_index(packets, RpPacket, i).timestamp - first) / opt_speed;
+            rp_wait_until(due);
+            now = rp_now();
+
+            // Gather everything that is now due into one batch.
+            while (i < packets->len && n < batch) {
+                RpPacket                 *packet = &g_array_index(packets, RpPacket, i);
+                const struct sockaddr_in *addr;
+                gint64                    packet_due = start + offset;
+
+                if (opt_speed > 0)
+                    packet_due += (packet->timestamp - first) / opt_speed;
+                if (packet_due > now)
+                    break;
+                i++;
+
+                addr = rp_target_for(targets, packet->port);
+                if (addr == NULL) {
+                    skipped++;
+                    continue;
+                }
+
+                iovs[n].iov_base = (gpointer) packet->data;
+                iovs[n].iov_len  = packet->length;
+                memset(&msgs[n], 0, sizeof(msgs[n]));
+                msgs[n].msg_hdr.msg_name    = (gpointer) addr;
+                msgs[n].msg_hdr.msg_namelen = sizeof(*addr);
+                msgs[n].msg_hdr.msg_iov     = &iovs[n];
+                msgs[n].msg_hdr.msg_iovlen  = 1;
+                histogram[MIN(g_bit_storage((now - packet_due) / 1000), HISTOGRAM_SIZE - 1)]++;
+                n++;
+            }
+
+            for (gint done = 0; done < n; ) {
+                gint r = sendmmsg(sockfd, msgs + done, n - done, 0);
+                if (r < 0) {
+                    struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+
+                    if (errno == EINTR)
+                        continue;
+                    // The socket buffer (EAGAIN) or the device queue (ENOBUFS,
+                    // which poll() does not wait for) is full: wait for room
+                    // rather than spin.
+                    if (errno == EAGAIN) {
+                        poll(&pfd, 1, FULL_MSEC);
+                        continue;
+                    }
+                    if (errno == ENOBUFS) {
+                        g_usleep(FULL_MSEC * 1000);
+                        continue;
+                    }
+                    g_printerr("[ERROR] sendmmsg() => %s\n", g_strerror(errno));
+                    break;
+                }
+                for (gint k = done; k < done + r; k++)
+                    bytes += iovs[k].iov_len;
+                sent += r;
+                done += r;
+            }
+        }
+    }
+
+    rp_report(sent, bytes, skipped, rp_now() - start, histogram);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+int
+main (int    argc,
+      char **argv)
+{
+    GOptionContext *context;
+    GError         *error = NULL;
+    GArray         *packets;
+    GArray         *targets;
+    RpTarget        target;
+    gint            sockfd;
+
+    context = g_option_context_new ("FILE... - replay captured traffic");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free (context);
+
+    if (argc < 2) {
+        g_printerr("Usage: ./router-replay [OPTION...] FILE...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Destinations
+    targets = g_array_new (FALSE, FALSE, sizeof(RpTarget));
+    if (opt_target != NULL) {
+        target.port = 0;
+        if (!rp_parse_address(opt_target, &target.addr))
+            exit(EXIT_FAILURE);
+        g_array_append_val (targets, target);
+    }
+    for (gint i = 0; opt_map != NULL && opt_map[i] != NULL; i++) {
+        gchar **parts = g_strsplit(opt_map[i], "=", 2);
+        if (g_strv_length(parts) != 2 || !rp_parse_address(parts[1], &target.addr)) {
+            g_printerr("[ERROR] Bad --map %s\n", opt_map[i]);
+            exit(EXIT_FAILURE);
+        }
+        target.port = atoi(parts[0]);
+        g_array_append_val (targets, target);
+        g_strfreev(parts);
+    }
+    if (targets->len == 0) {
+        g_printerr("[ERROR] No destination given (--target or --map)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Input traces. The mapped files are kept for the lifetime of the program
+    // as the packets point into them.
+    packets = g_array_new (FALSE, FALSE, sizeof(RpPacket));
+    for (gint i = 1; i < argc; i++) {
+        GMappedFile *file;
+        const gchar *contents;
+        gsize        size;
+        guint        before = packets->len;
+
+        file = g_mapped_file_new(argv[i], FALSE, &error);
+        if (file == NULL) {
+            g_printerr("[ERROR] %s\n", error->message);
+            exit(EXIT_FAILURE);
+        }
+        contents = g_mapped_file_get_contents(file);
+        size     = g_mapped_file_get_length(file);
+
+        if (size < 4 || !rp_load_pcap(contents, size, packets))
+            rp_load_journal(contents, size, packets);
+        g_print("[REPLAY] %s: %u packets\n", argv[i], packets->len - before);
+    }
+    g_array_sort(packets, rp_packet_compare);
+
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        g_printerr("[ERROR] socket() => %s\n", g_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    rp_replay(sockfd, packets, targets);
+
+    close(sockfd);
+    return 0;
+}
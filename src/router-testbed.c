@@ -0,0 +1,603 @@
+// router-testbed
+
+// Development tool: runs the network described by a routes file on this
+// machine and measures it. Every node's interfaces are moved to loopback
+// ports, one router is started per node (except the destination, which the
+// testbed plays itself), and messages are sent from one node to another
+// through them. At the end the routers are stopped and their --stats are
+// collected into a per hop breakdown of where the time went.
+//
+//   ./router-testbed --routes=routes.json --from=earth-alpha --to=mars-alpha
+//   ./router-testbed --scale=0.001 --rate=0 --count=100000 --netns
+//
+// Link delays are multiplied by --scale (default 0), as the real ones are
+// minutes long. With --netns everything runs in a private network namespace,
+// when the kernel allows unprivileged ones, so the ports used cannot clash
+// with anything else on the machine.
+
+#define _GNU_SOURCE // unshare()
+
+// Required for networking code with GNU libc. Is not portable to other libc.
+#include <errno.h>
+
+// GLib headers
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "msg-header.h"
+#include "msg-stats.h"
+#include "rt-topology.h"
+
+#define BUFSIZE     2048
+#define SPIN_USEC   200         // Busy-wait instead of sleeping this close to a send
+#define MAX_SINKS   16
+#define DRAIN_USEC  (G_USEC_PER_SEC)    // Wait for stragglers after the path delay
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+// Command line options
+static gchar    *opt_routes = "routes.json";
+static gchar    *opt_router = "./router";
+static gchar    *opt_from   = "earth-alpha";
+static gchar    *opt_to     = "mars-alpha";
+static gint      opt_port   = 20000;
+static gdouble   opt_scale  = 0;
+static gint      opt_count  = 10000;
+static gint      opt_size   = 64;
+static gint      opt_rate   = 10000;
+static gboolean  opt_netns  = FALSE;
+static gboolean  opt_keep   = FALSE;
+
+static GOptionEntry entries[] =
+{
+    { "routes", 0, 0, G_OPTION_ARG_FILENAME, &opt_routes,
+      "Topology to run (default routes.json)", "FILE" },
+    { "router", 0, 0, G_OPTION_ARG_FILENAME, &opt_router,
+      "Router program (default ./router)", "PATH" },
+    { "from",   0, 0, G_OPTION_ARG_STRING,   &opt_from,
+      "Node the messages start from (default earth-alpha)", "NODE" },
+    { "to",     0, 0, G_OPTION_ARG_STRING,   &opt_to,
+      "Node the messages are sent to (default mars-alpha)", "NODE" },
+    { "port",   0, 0, G_OPTION_ARG_INT,      &opt_port,
+      "First loopback port to use (default 20000)", "PORT" },
+    { "scale",  0, 0, G_OPTION_ARG_DOUBLE,   &opt_scale,
+      "Multiply link delays by this (default 0)", "FACTOR" },
+    { "count",  0, 0, G_OPTION_ARG_INT,      &opt_count,
+      "Messages to send (default 10000)", "N" },
+    { "size",   0, 0, G_OPTION_ARG_INT,      &opt_size,
+      "Bytes per message, header included (default 64)", "BYTES" },
+    { "rate",   0, 0, G_OPTION_ARG_INT,      &opt_rate,
+      "Messages per second, 0 for as fast as possible (default 10000)", "N" },
+    { "netns",  0, 0, G_OPTION_ARG_NONE,     &opt_netns,
+      "Run in a private network namespace if possible", NULL },
+    { "keep",   0, 0, G_OPTION_ARG_NONE,     &opt_keep,
+      "Keep the working directory with the routes file and router logs", NULL },
+    { NULL }
+};
+
+// A router started for a node.
+typedef struct {
+    gchar  *node;
+    gchar  *log;
+    GPid    pid;
+} TbRouter;
+
+// What arrives at the destination. Written by the sink thread only, read by
+// the main thread once it has been joined (apart from 'received').
+typedef struct {
+    gint         fds[MAX_SINKS];
+    guint        nfds;
+    guint32      sender;
+    volatile gint received;
+    gint         stop;
+    guint64      bytes;
+    gint64       first, last;       // Real time of the first and last arrival
+    gint64       latency_sum;
+    gint64       latency_max;
+    MsgQuantile  latency_p50;
+    MsgQuantile  latency_p99;
+} TbSink;
+
+//////////////////////////////////////////////////////////////////////////////
+// Setup
+
+// Enter a new user and network namespace, as root within it, and bring up
+// its loopback interface. Only possible while single threaded.
+static gboolean
+tb_enter_netns (void)
+{
+    uid_t         uid = getuid();
+    gid_t         gid = getgid();
+    gchar        *map;
+    struct ifreq  ifr;
+    gint          fd;
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0) {
+        g_printerr("[TESTBED] No private network namespace (%s), using loopback\n",
+                   g_strerror(errno));
+        return FALSE;
+    }
+
+    g_file_set_contents("/proc/self/setgroups", "deny", -1, NULL);
+    map = g_strdup_printf("0 %u 1", uid);
+    g_file_set_contents("/proc/self/uid_map", map, -1, NULL);
+    g_free(map);
+    map = g_strdup_printf("0 %u 1", gid);
+    g_file_set_contents("/proc/self/gid_map", map, -1, NULL);
+    g_free(map);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    g_strlcpy(ifr.ifr_name, "lo", IFNAMSIZ);
+    if (fd < 0 || ioctl(fd, SIOCGIFFLAGS, &ifr) < 0 ||
+        (ifr.ifr_flags |= IFF_UP | IFF_RUNNING, ioctl(fd, SIOCSIFFLAGS, &ifr) < 0)) {
+        g_printerr("[TESTBED] Unable to bring up loopback: %s\n", g_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    g_print("[TESTBED] Running in a private network namespace\n");
+    return TRUE;
+}
+
+// Copy the routes file into 'dir' with every interface on its own loopback
+// port and the link delays scaled. Returns the new file's name.
+static gchar *
+tb_write_routes (const gchar *dir, GError **error)
+{
+    JsonParser    *parser = json_parser_new();
+    JsonGenerator *generator;
+    JsonArray     *regions;
+    gchar         *filename = NULL;
+    gint           port = opt_port;
+
+    if (!json_parser_load_from_file(parser, opt_routes, error))
+        goto out;
+
+    regions = json_object_get_array_member(json_node_get_object(json_parser_get_root(parser)),
+                                           "regions");
+    for (guint i = 0; regions != NULL && i < json_array_get_length(regions); i++) {
+        JsonObject *region = json_array_get_object_element(regions, i);
+        JsonArray  *routes = json_object_get_array_member(region, "routes");
+
+        if (json_object_has_member(region, "delay"))
+            json_object_set_double_member(region, "delay",
+                json_object_get_double_member(region, "delay") * opt_scale);
+
+        // [name, address, port] becomes [name, "127.0.0.1", next port]
+        for (guint j = 0; routes != NULL && j < json_array_get_length(routes); j++) {
+            JsonArray *route = json_array_get_array_element(routes, j);
+            gchar     *number = g_strdup_printf("%d", port++);
+
+            while (json_array_get_length(route) > 1)
+                json_array_remove_element(route, json_array_get_length(route) - 1);
+            json_array_add_string_element(route, "127.0.0.1");
+            json_array_add_string_element(route, number);
+            g_free(number);
+        }
+    }
+
+    filename  = g_build_filename(dir, "routes.json", NULL);
+    generator = json_generator_new();
+    json_generator_set_pretty(generator, TRUE);
+    json_generator_set_root(generator, json_parser_get_root(parser));
+    if (!json_generator_to_file(generator, filename, error))
+        g_clear_pointer(&filename, g_free);
+    g_object_unref(generator);
+
+out:
+    g_object_unref(parser);
+    return filename;
+}
+
+// Router output goes to its log file.
+static void
+tb_child_setup (gpointer user_data)
+{
+    gint fd = GPOINTER_TO_INT(user_data);
+
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+}
+
+// Start a router for 'node', with a queue on each of its interfaces
+// forwarding to the destination.
+static gboolean
+tb_router_start (TbRouter *router, RtNode *node, const gchar *routes,
+                 const gchar *dir, GError **error)
+{
+    GPtrArray *argv = g_ptr_array_new_with_free_func(g_free);
+    gint       fd;
+    gboolean   started;
+
+    router->node = g_strdup(node->name);
+    router->log  = g_strdup_printf("%s/%s.log", dir, node->name);
+
+    g_ptr_array_add(argv, g_strdup(opt_router));
+    g_ptr_array_add(argv, g_strdup_printf("--routes=%s", routes));
+    g_ptr_array_add(argv, g_strdup_printf("--node=%s", node->name));
+    g_ptr_array_add(argv, g_strdup("--stats"));
+    g_ptr_array_add(argv, g_strdup("--quiet"));     // Per packet output would be measured too
+    for (guint i = 0; i < node->interfaces->len; i++) {
+        RtInterface *iface = &g_array_index(node->interfaces, RtInterface, i);
+
+        g_ptr_array_add(argv, g_strdup_printf("--queue=%s,%u,%s",
+                                              iface->region, iface->port, opt_to));
+    }
+    g_ptr_array_add(argv, NULL);
+
+    fd = g_open(router->log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "%s: %s", router->log, g_strerror(errno));
+        g_ptr_array_free(argv, TRUE);
+        return FALSE;
+    }
+
+    started = g_spawn_async(NULL, (gchar **) argv->pdata, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                            tb_child_setup, GINT_TO_POINTER(fd), &router->pid, error);
+    close(fd);
+    g_ptr_array_free(argv, TRUE);
+    return started;
+}
+
+static void
+tb_router_stop (TbRouter *router)
+{
+    kill(router->pid, SIGTERM);
+    waitpid(router->pid, NULL, 0);
+    g_spawn_close_pid(router->pid);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Traffic
+
+static gint64
+tb_now (void)
+{
+    return g_get_real_time();
+}
+
+static gpointer
+tb_sink_thread (gpointer data)
+{
+    TbSink        *sink = data;
+    struct pollfd  pfds[MAX_SINKS];
+    gchar          buffer[BUFSIZE];
+
+    for (guint i = 0; i < sink->nfds; i++) {
+        pfds[i].fd     = sink->fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    while (!g_atomic_int_get(&sink->stop)) {
+        if (poll(pfds, sink->nfds, 100) <= 0)
+            continue;
+
+        for (guint i = 0; i < sink->nfds; i++) {
+            gssize    length;
+            MsgHeader header;
+            gint64    now, latency;
+
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+            while ((length = recv(pfds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                now = tb_now();
+                if (!msg_header_read(buffer, length, &header) || header.sender != sink->sender)
+                    continue;
+
+                latency = now - header.timestamp;
+                if (sink->first == 0)
+                    sink->first = now;
+                sink->last         = now;
+                sink->bytes       += length;
+                sink->latency_sum += latency;
+                sink->latency_max  = MAX(sink->latency_max, latency);
+                msg_quantile_add(&sink->latency_p50, latency);
+                msg_quantile_add(&sink->latency_p99, latency);
+                g_atomic_int_inc(&sink->received);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Listen on every interface of the destination.
+static void
+tb_sink_open (TbSink *sink, RtNode *node)
+{
+    for (guint i = 0; i < node->interfaces->len && sink->nfds < MAX_SINKS; i++) {
+        RtInterface        *iface = &g_array_index(node->interfaces, RtInterface, i);
+        struct sockaddr_in  addr;
+        gint                fd, size = 4 * 1024 * 1024;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = htons(iface->port);
+
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            g_printerr("[TESTBED] Unable to listen on port %u: %s\n",
+                       iface->port, g_strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        sink->fds[sink->nfds++] = fd;
+    }
+}
+
+// Send the messages, paced to --rate.
+static gint64
+tb_send (TbSink *sink, const RtInterface *entry)
+{
+    struct sockaddr_in addr;
+    gchar              buffer[BUFSIZE];
+    gsize              length = CLAMP(opt_size, MSG_HEADER_SIZE, BUFSIZE);
+    MsgHeader          header;
+    gint64             start = tb_now();
+    gint               fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(entry->port);
+
+    memset(buffer, 'x', sizeof(buffer));
+    memset(&header, 0, sizeof(header));
+    header.type   = MSG_TYPE_TEXT;
+    header.sender = sink->sender;
+
+    for (gint i = 0; i < opt_count; i++) {
+        if (opt_rate > 0) {
+            gint64 due = start + (gint64) i * G_USEC_PER_SEC / opt_rate;
+            gint64 remaining;
+
+            while ((remaining = due - tb_now()) > SPIN_USEC)
+                g_usleep(remaining - SPIN_USEC);
+            while (tb_now() < due)
+                ;
+        }
+
+        header.seq       = i;
+        header.timestamp = tb_now();
+        msg_header_write(&header, buffer);
+        while (sendto(fd, buffer, length, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+                g_printerr("[ERROR] sendto() => %s\n", g_strerror(errno));
+                break;
+            }
+        }
+    }
+    close(fd);
+    return tb_now() - start;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Report
+
+typedef struct {
+    guint64  received, forwarded;
+    gdouble  mean, p50, p99;
+    gint64   max;
+} TbStats;
+
+// Find a queue's --stats line in a router's log.
+static gboolean
+tb_read_stats (const gchar *log, const gchar *queue, TbStats *stats)
+{
+    gchar    *contents, **lines;
+    gchar    *prefix = g_strdup_printf("[STATS] %s: ", queue);
+    gboolean  found = FALSE;
+
+    if (!g_file_get_contents(log, &contents, NULL, NULL)) {
+        g_free(prefix);
+        return FALSE;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (gint i = 0; lines[i] != NULL && !found; i++) {
+        if (!g_str_has_prefix(lines[i], prefix))
+            continue;
+        found = sscanf(lines[i] + strlen(prefix),
+                       "received %" G_GUINT64_FORMAT ", forwarded %" G_GUINT64_FORMAT
+                       ", residence mean %lf p50 %lf p99 %lf max %" G_GINT64_FORMAT,
+                       &stats->received, &stats->forwarded,
+                       &stats->mean, &stats->p50, &stats->p99, &stats->max) == 6;
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    g_free(prefix);
+    return found;
+}
+
+static void
+tb_report (RtTopology *topology, GArray *path, TbSink *sink, GPtrArray *routers, gint64 sending)
+{
+    gint     from = g_array_index(path, gint, 0);
+    gint     to   = g_array_index(path, gint, path->len - 1);
+    gdouble  seconds = MAX(sink->last - sink->first, 1) / 1e6;
+    gdouble  total = 0;
+    GString *route = g_string_new(NULL);
+
+    for (guint i = 0; i < path->len; i++) {
+        RtNode *node = g_ptr_array_index(topology->nodes, g_array_index(path, gint, i));
+
+        g_string_append_printf(route, "%s%s", i ? " -> " : "", node->name);
+    }
+    g_print("[TESTBED] Path: %s (%u hops)\n", route->str, path->len - 1);
+    g_string_free(route, TRUE);
+
+    g_print("[TESTBED] Sent %d in %.3f s, received %d (%.2f%% lost)\n",
+            opt_count, sending / 1e6, sink->received,
+            100.0 * (opt_count - sink->received) / MAX(opt_count, 1));
+    if (sink->received == 0)
+        return;
+    g_print("[TESTBED] Throughput: %.0f messages/s, %.3f Mbit/s\n",
+            sink->received / seconds, sink->bytes * 8 / seconds / 1e6);
+    g_print("[TESTBED] End to end (us): mean %.0f  p50 %.0f  p99 %.0f  max %" G_GINT64_FORMAT
+            "  (links %" G_GINT64_FORMAT ")\n",
+            (gdouble) sink->latency_sum / sink->received,
+            msg_quantile_get(&sink->latency_p50), msg_quantile_get(&sink->latency_p99),
+            sink->latency_max, rt_topology_delay(topology, from, to));
+
+    // The queue a router's traffic arrives on is its interface in the region
+    // of the link from the previous hop; the first router's is where the
+    // testbed sends.
+    g_print("[TESTBED] %-14s %-16s %9s %9s %9s %9s %9s %9s\n",
+            "Hop", "Queue", "Packets", "Link", "Mean", "p50", "p99", "Max (us)");
+    for (guint i = 0; i + 1 < path->len; i++) {
+        gint         hop  = g_array_index(path, gint, i);
+        gint         next = g_array_index(path, gint, i + 1);
+        RtNode      *node = g_ptr_array_index(topology->nodes, hop);
+        const gchar *queue;
+        TbRouter    *router = NULL;
+        TbStats      stats;
+
+        if (i == 0)
+            queue = g_array_index(node->interfaces, RtInterface, 0).region;
+        else
+            queue = rt_topology_interface(topology, g_array_index(path, gint, i - 1), hop)->region;
+
+        for (guint r = 0; r < routers->len; r++) {
+            if (g_strcmp0(((TbRouter *) g_ptr_array_index(routers, r))->node, node->name) == 0)
+                router = g_ptr_array_index(routers, r);
+        }
+
+        if (router == NULL || !tb_read_stats(router->log, queue, &stats)) {
+            g_print("[TESTBED] %-14s %-16s (no stats)\n", node->name, queue);
+            continue;
+        }
+        g_print("[TESTBED] %-14s %-16s %9" G_GUINT64_FORMAT " %9" G_GINT64_FORMAT
+                " %9.0f %9.0f %9.0f %9" G_GINT64_FORMAT "\n",
+                node->name, queue, stats.forwarded,
+                topology->link[hop * topology->n + next],
+                stats.mean, stats.p50, stats.p99, stats.max);
+        total += stats.mean;
+    }
+    g_print("[TESTBED] In routers: mean %.0f us of %.0f; the rest is the kernel and the sockets\n",
+            total, (gdouble) sink->latency_sum / sink->received);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+int
+main (int    argc,
+      char **argv)
+{
+    GOptionContext *context;
+    GError         *error = NULL;
+    RtTopology     *topology;
+    GPtrArray      *routers = g_ptr_array_new();
+    GArray         *path = g_array_new(FALSE, FALSE, sizeof(gint));
+    TbSink          sink;
+    GThread        *thread;
+    gchar          *dir, *routes;
+    gint            from, to, hop, last;
+    gint64          sending, wait;
+
+    context = g_option_context_new ("- run a routes file's network locally and measure it");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free (context);
+
+    // Before any threads are started.
+    if (opt_netns)
+        tb_enter_netns();
+
+    dir = g_dir_make_tmp("router-testbed-XXXXXX", &error);
+    if (dir == NULL || (routes = tb_write_routes(dir, &error)) == NULL ||
+        (topology = rt_topology_load(routes, &error)) == NULL) {
+        g_printerr("[TESTBED] %s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+
+    from = rt_topology_node_index(topology, opt_from);
+    to   = rt_topology_node_index(topology, opt_to);
+    if (from < 0 || to < 0 || from == to) {
+        g_printerr("[TESTBED] --from and --to must be two nodes in %s\n", opt_routes);
+        exit(EXIT_FAILURE);
+    }
+    for (hop = from; hop >= 0 && hop != to; hop = rt_topology_next_hop(topology, hop, to))
+        g_array_append_val(path, hop);
+    if (hop < 0) {
+        g_printerr("[TESTBED] No route from %s to %s\n", opt_from, opt_to);
+        exit(EXIT_FAILURE);
+    }
+    g_array_append_val(path, to);
+
+    // The destination is the testbed; every other node gets a router.
+    memset(&sink, 0, sizeof(sink));
+    sink.sender = g_random_int();
+    msg_quantile_init(&sink.latency_p50, 0.5);
+    msg_quantile_init(&sink.latency_p99, 0.99);
+    tb_sink_open(&sink, g_ptr_array_index(topology->nodes, to));
+
+    for (guint i = 0; i < topology->n; i++) {
+        TbRouter *router;
+
+        if ((gint) i == to)
+            continue;
+        router = g_new0(TbRouter, 1);
+        if (!tb_router_start(router, g_ptr_array_index(topology->nodes, i), routes, dir, &error)) {
+            g_printerr("[TESTBED] %s\n", error->message);
+            for (guint r = 0; r < routers->len; r++)
+                tb_router_stop(g_ptr_array_index(routers, r));
+            exit(EXIT_FAILURE);
+        }
+        g_ptr_array_add(routers, router);
+    }
+    g_print("[TESTBED] %u routers started, logs in %s\n", routers->len, dir);
+    g_usleep(G_USEC_PER_SEC / 2);   // For them to open their sockets
+
+    thread  = g_thread_new("sink", tb_sink_thread, &sink);
+    sending = tb_send(&sink, &g_array_index(((RtNode *) g_ptr_array_index(topology->nodes, from))->interfaces,
+                                            RtInterface, 0));
+
+    // Wait for everything to arrive, or for nothing more to.
+    wait = rt_topology_delay(topology, from, to) + DRAIN_USEC;
+    last = -1;
+    for (gint64 idle = 0; idle < wait && g_atomic_int_get(&sink.received) < opt_count; ) {
+        gint received = g_atomic_int_get(&sink.received);
+
+        g_usleep(10000);
+        idle = (received == last) ? idle + 10000 : 0;
+        last = received;
+    }
+    g_atomic_int_set(&sink.stop, 1);
+    g_thread_join(thread);
+
+    for (guint i = 0; i < routers->len; i++)
+        tb_router_stop(g_ptr_array_index(routers, i));
+
+    tb_report(topology, path, &sink, routers, sending);
+
+    if (!opt_keep) {
+        for (guint i = 0; i < routers->len; i++)
+            g_unlink(((TbRouter *) g_ptr_array_index(routers, i))->log);
+        g_unlink(routes);
+        g_rmdir(dir);
+    }
+    rt_topology_free(topology);
+    return 0;
+}
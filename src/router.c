@@ -4,20 +4,66 @@
 // messages. It will listen on configurd UDP ports and queue the
 // contents of any packets received in queues for further processing.
 
+#define _GNU_SOURCE // pthread_setaffinity_np()
+
 #include <errno.h>  // Required for networking code with GNU libc. Is not
                     // portable to other libc.
 
 // GLib headers
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 #include <gmodule.h>
 
 // Gtk
 #include <gtk/gtk.h>
 
-#define BUFSIZE 1024
+// Networking
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+// Router modules
+#include "rt-capture.h"
+#include "rt-timer.h"
+#include "rt-topology.h"
+#include "msg-bundle.h"
+#include "msg-dedup.h"
+#include "msg-fec.h"
+#include "msg-header.h"
+#include "msg-stage.h"
+#include "msg-stats.h"
+#include "msg-trace.h"
+
+#define BUFSIZE 2048    // Room for an FEC shard around a full message
 #define TEXTBUF 256
 #define STRSIZE 32
+#define RT_BATCH  MSG_STAGE_BATCH   // Datagrams read, or sent, at once
+#define RT_PACKET (MSG_STAGE_HEADROOM + BUFSIZE + MSG_STAGE_TAILROOM)
+#define RT_QUANTUM 1500             // Bytes per round for a queue of weight 1
+#define RT_SPIN   100000            // Empty polls before a busy worker yields
+#define RT_YIELD  1000              // ... and yields before it blocks
+#define RT_BLOCK_MS 100             // Longest a blocked worker waits
+#define RT_BUSY_POLL 50             // SO_BUSY_POLL, microseconds
+#define RT_HISTOGRAM (40 * 4)       // Quarter octaves of nanoseconds, to 2^41
+#define RT_SHAPE_BURST 10000         // Default bucket depth, in microseconds
+#define RT_LINK_AHEAD 1000          // Microseconds a link may run ahead, as
+                                    // timers only wake to the millisecond
+
+// Tracepoints fired here (msg-trace.h)
+MSG_TRACE_SEMAPHORE(router, receive)
+MSG_TRACE_SEMAPHORE(router, enqueue)
+MSG_TRACE_SEMAPHORE(router, schedule)
+MSG_TRACE_SEMAPHORE(router, turn)
+MSG_TRACE_SEMAPHORE(router, dequeue)
+MSG_TRACE_SEMAPHORE(router, send)
 
 // #define DEBUG
 #ifdef DEBUG
@@ -31,23 +77,50 @@ typedef struct {
     gchar* name;
     gchar* address;
     guint16 port;
+    gint   node;                // Destination node in the routing topology, or
+                                // -1 to always send to 'addr'.
+    struct sockaddr_in addr;    // Resolved 'address' and 'port'
+    MsgBundler *bundler;        // Packs small packets together, NULL if not
 } RtTarget;
 
+// Priority classes within a queue, most urgent first. Due packets of a class
+// are sent before any of the next.
+typedef enum {
+    RT_CLASS_CONTROL,           // Acknowledgements and [OVER] markers
+    RT_CLASS_TEXT,              // Chat messages
+    RT_CLASS_BULK,              // File transfers and anything else
+    RT_CLASSES
+} RtClass;
+
+static const gchar *rt_class_names[RT_CLASSES] = { "control", "text", "bulk" };
+
 // Message data
 typedef struct {
     gint64 timein;
+    RtClass class;
     gchar* message;
+    gsize  length;              // Datagrams are binary safe; 'message' is also
+                                // NUL terminated for display.
+    gsize  headroom;            // Free space around 'message', for stages
+    gsize  tailroom;
 } RtData;
 
+typedef struct _RtLink RtLink;
+typedef struct _RtWorker RtWorker;
+
 // Queues - messages are sorted into queues, which may have different delay
 // times.
 typedef struct {
     gchar    *name;
     RtTarget target;
     guint16  port_in;
-    GQueue   *queue;
-    gint64   delay;       // Default delay to target in seconds.
-    gint64   nextservice; // When the next packet should be sent. Stored here so
+    GQueue   *queue[RT_CLASSES];  // One per priority class, each in arrival order
+    gint     fd;          // Socket, used for both receiving and forwarding.
+    gint64   delay;       // Default delay to target in microseconds.
+    gboolean link_delay;  // Use the delay of the topology link to the next hop
+                          // instead of 'delay'.
+    gint64   nextservice; // When the next packet should be sent, allowing for
+                          // any shaping. Stored here so
                           // that the queue does not need to store this time
                           // (uint64) for every packet. It is calculated by
                           // looking at the next message packet after a packet
@@ -55,9 +128,48 @@ typedef struct {
                           // sent. If a packet is added to an empty queue (first
                           // packet) then this value also needs to be set.
 
-    guint    gsourceid;
+    RtTimer  timer;       // Set for 'nextservice'
+    MsgDedup *dedup;      // Duplicate filter, NULL if disabled.
+    MsgFecEncoder *fec;   // Parity for forwarded packets, NULL if disabled.
+    MsgFecDecoder *fec_decoder; // Recovers packets from received shards.
+    MsgPipeline *pipeline; // Stages run on packets received and forwarded.
+
+    RtLink   *link;       // Outbound link shared with other queues, NULL if not
+    RtWorker *worker;     // Busy polling thread forwarding the queue, NULL if
+                          // the main loop serves it
+    gint      quantum;    // Bytes added to 'deficit' each round on the link
+    gint      deficit;    // Bytes the queue may still send this round
+    gboolean  active;     // In the link's round robin
+    gboolean  in_turn;    // Has had this round's quantum
+
+    gint64    rate;       // Shaped to this many bytes per second, 0 if not
+    gint64    burst;      // Microseconds of 'rate' the token bucket holds
+    gint64    tat;        // When the bucket would be empty again if nothing
+                          // more were sent (GCRA's theoretical arrival time)
+    guint64   sent[RT_CLASSES];
+
+    // Time from receipt to forwarding, in microseconds (see --stats)
+    guint64     received;
+    guint64     forwarded;
+    gint64      residence_sum;
+    gint64      residence_max;
+    MsgQuantile residence_p50;
+    MsgQuantile residence_p99;
 } RtQueue;
 
+// An outbound link of limited rate, shared by the queues sending to the same
+// target. Due packets are sent in deficit round robin over the queues with
+// any due, each getting a share in proportion to its weight.
+struct _RtLink {
+    gchar    *name;       // The target
+    gint64    rate;       // Bytes per second
+    gint64    free_at;    // When the last packet sent will have gone
+    GQueue   *active;     // Queues with packets due, in round robin order
+    RtTimer   timer;      // Set while the link is busy and queues wait
+    guint64   packets;
+    guint64   bytes;
+};
+
 // FIXME: No longer a widget data structure. Should be renamed.
 typedef struct {
   guint     gSourceId;
@@ -69,6 +181,16 @@ typedef struct {
 appWidgets widgetData;
 appWidgets *widgets = &widgetData;
 
+// Packet capture tap (NULL unless enabled with --capture)
+RtCapture *capture = NULL;
+
+// Routing topology (NULL unless loaded with --routes) and this router's node
+RtTopology *topology = NULL;
+gint        self     = -1;
+
+// Leave out the line printed for each packet received (--quiet)
+static gboolean opt_quiet = FALSE;
+
 // Pre-declarations
 void rt_queue_display(RtQueue *rtqueue);
 
@@ -107,25 +229,581 @@ gchar * skn_gio_condition_to_string(GIOCondition condition)
 
 //////////////////////////////////////////////////////////////////////////////
 // Networking
-// Receive Packets
+// Forward Packets
 
 static gboolean
-rt_queue_message_handler (GSocket *gSock, GIOCondition condition, RtQueue* rtqueue_p)
+rt_queue_has_target (RtQueue *rtqueue)
+{
+    return rtqueue->target.node >= 0 || rtqueue->target.address != NULL;
+}
+
+// Delay applied to packets in the queue, in microseconds.
+static gint64
+rt_queue_delay (RtQueue *rtqueue)
+{
+    gint hop;
+
+    if (!rtqueue->link_delay || topology == NULL || self < 0)
+        return rtqueue->delay;
+
+    hop = rt_topology_next_hop(topology, self, rtqueue->target.node);
+    if (hop < 0)
+        return rtqueue->delay;
+    return topology->link[self * topology->n + hop];
+}
+
+// Where to send the queue's packets: the fixed target address, or the next hop
+// towards the target node. NULL if there is no route.
+static const struct sockaddr_in *
+rt_queue_next_hop (RtQueue *rtqueue)
+{
+    const RtInterface *iface;
+    gint               hop;
+
+    if (rtqueue->target.address != NULL)
+        return &rtqueue->target.addr;
+    if (self < 0 || rtqueue->target.node < 0)
+        return NULL;
+
+    hop = rt_topology_next_hop(topology, self, rtqueue->target.node);
+    if (hop < 0)
+        return NULL;
+    iface = rt_topology_interface(topology, self, hop);
+    return iface ? &iface->addr : NULL;
+}
+
+// Send one datagram (or FEC shard) to the next hop.
+static gboolean
+rt_queue_transmit (const gchar *message, gsize length, gpointer user_data)
+{
+    RtQueue                  *rtqueue = user_data;
+    const struct sockaddr_in *addr;
+    struct sockaddr_in        src;
+    gssize                    sent;
+
+    addr = rt_queue_next_hop(rtqueue);
+    if (addr == NULL) {
+        g_printerr("[QUEUE] %s: no route to %s, packet dropped\n",
+                   rtqueue->name, rtqueue->target.name);
+        return FALSE;
+    }
+
+    sent = sendto(rtqueue->fd, message, length, 0,
+                  (struct sockaddr *) addr, sizeof(*addr));
+    MSG_TRACE3(router, send, rtqueue->name, length, sent);
+    if (sent < 0) {
+        g_printerr("[QUEUE] %s: sendto() => %s\n", rtqueue->name, g_strerror(errno));
+        return FALSE;
+    }
+
+    if (rt_capture_get_enabled(capture)) {
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_port   = htons(rtqueue->port_in);
+        rt_capture_packet(capture, RT_CAPTURE_OUT, g_get_real_time() * 1000,
+                          &src, addr, message, length);
+    }
+    return TRUE;
+}
+
+// Send a packet, or bundle, with any FEC.
+static gboolean
+rt_queue_encode (const gchar *message, gsize length, gpointer user_data)
+{
+    RtQueue *rtqueue = user_data;
+
+    if (rtqueue->fec != NULL)
+        return msg_fec_encoder_send(rtqueue->fec, message, length);
+    return rt_queue_transmit(message, length, rtqueue);
+}
+
+static void
+rt_queue_forward (RtQueue *rtqueue, const gchar *message, gsize length)
+{
+    if (rtqueue->target.bundler != NULL)
+        msg_bundler_send(rtqueue->target.bundler, message, length);
+    else
+        rt_queue_encode(message, length, rtqueue);
+}
+
+static void
+rt_data_free (RtData *data)
+{
+    g_free(data->message - data->headroom);
+    g_slice_free1(sizeof(RtData), data);
+}
+
+static void rt_queue_schedule (RtQueue *rtqueue);
+static void rt_link_activate (RtLink *link, RtQueue *rtqueue);
+
+// Token bucket shaping, as the generic cell rate algorithm: rather than count
+// tokens, keep the time 'tat' at which the bucket would be full again. A
+// packet may go once 'now' is within the bucket's depth of it, so the queue's
+// next service is simply the later of when its packet falls due and
+// rt_queue_shape_time(); shaping needs no timers of its own.
+static inline gint64
+rt_queue_shape_time (RtQueue *rtqueue)
+{
+    return rtqueue->rate > 0 ? rtqueue->tat - rtqueue->burst : 0;
+}
+
+// Take a packet from the queue, charging it to the bucket.
+static inline void
+rt_queue_pop (RtQueue *rtqueue, RtData *data, gint64 now)
+{
+    gint64 residence = now - data->timein;
+
+    g_queue_pop_head(rtqueue->queue[data->class]);
+    MSG_TRACE4(router, dequeue, rtqueue->name, data->class, data->length, residence);
+
+    rtqueue->forwarded++;
+    rtqueue->residence_sum += residence;
+    rtqueue->residence_max  = MAX(rtqueue->residence_max, residence);
+    msg_quantile_add(&rtqueue->residence_p50, residence);
+    msg_quantile_add(&rtqueue->residence_p99, residence);
+    if (rtqueue->rate > 0)
+        rtqueue->tat = MAX(rtqueue->tat, now) +
+                       data->length * G_USEC_PER_SEC / rtqueue->rate;
+}
+
+// The most urgent packet due to be sent by 'now', or NULL if none is or the
+// queue's shaping holds it back.
+static RtData *
+rt_queue_peek_due (RtQueue *rtqueue, gint64 now, gint64 delay)
+{
+    if (rt_queue_shape_time(rtqueue) > now)
+        return NULL;
+
+    for (gint class = 0; class < RT_CLASSES; class++) {
+        RtData *data = g_queue_peek_head(rtqueue->queue[class]);
+
+        if (data != NULL && data->timein + delay <= now)
+            return data;
+    }
+    return NULL;
+}
+
+// Packets waiting in all classes.
+static guint
+rt_queue_length (RtQueue *rtqueue)
+{
+    guint length = 0;
+
+    for (gint class = 0; class < RT_CLASSES; class++)
+        length += g_queue_get_length(rtqueue->queue[class]);
+    return length;
+}
+
+// Set the timer for the next packet to fall due, and the bucket to allow it,
+// if any.
+static void
+rt_queue_reschedule (RtQueue *rtqueue, gint64 delay)
+{
+    rtqueue->nextservice = 0;
+    for (gint class = 0; class < RT_CLASSES; class++) {
+        RtData *data = g_queue_peek_head(rtqueue->queue[class]);
+
+        if (data != NULL && (rtqueue->nextservice == 0 ||
+                             data->timein + delay < rtqueue->nextservice))
+            rtqueue->nextservice = data->timein + delay;
+    }
+    if (rtqueue->nextservice != 0) {
+        rtqueue->nextservice = MAX(rtqueue->nextservice, rt_queue_shape_time(rtqueue));
+        rt_queue_schedule(rtqueue);
+    }
+}
+
+// Pass packets taken from the queue through its stages and on to the target.
+static void
+rt_queue_send_batch (RtQueue *rtqueue, RtData **batch, guint count)
+{
+    MsgPacket packets[RT_BATCH];
+
+    for (guint i = 0; i < count; i++) {
+        packets[i].data     = batch[i]->message;
+        packets[i].length   = batch[i]->length;
+        packets[i].headroom = batch[i]->headroom;
+        packets[i].tailroom = batch[i]->tailroom;
+        rtqueue->sent[batch[i]->class]++;
+    }
+
+    msg_pipeline_process(rtqueue->pipeline, MSG_STAGE_OUT, packets, count);
+    for (guint i = 0; i < count; i++) {
+        if (packets[i].length > 0)
+            rt_queue_forward(rtqueue, packets[i].data, packets[i].length);
+        rt_data_free(batch[i]);
+    }
+}
+
+// Send every packet that is due, most urgent first, as far as the queue's
+// shaping allows, then wait for the next one. On a shared link the link sends
+// them instead, as its rate allows.
+static void
+rt_queue_service (gpointer user_data)
+{
+    RtQueue   *rtqueue = user_data;
+    RtData    *data;
+    RtData    *batch[RT_BATCH];
+    guint      count;
+    gint64     now = g_get_real_time();
+    gint64     delay = rt_queue_delay(rtqueue);
+
+    if (rtqueue->link != NULL) {
+        rtqueue->nextservice = 0;
+        rt_link_activate(rtqueue->link, rtqueue);
+        return;
+    }
+
+    // Due packets go through the queue's stages a batch at a time.
+    do {
+        count = 0;
+        while (count < RT_BATCH &&
+               (data = rt_queue_peek_due(rtqueue, now, delay)) != NULL) {
+            rt_queue_pop(rtqueue, data, now);
+            batch[count++] = data;
+        }
+        rt_queue_send_batch(rtqueue, batch, count);
+    } while (count == RT_BATCH);
+
+    rt_queue_reschedule(rtqueue, delay);
+}
+
+// (Re)arm the queue's timer for 'nextservice'.
+static void
+rt_queue_schedule (RtQueue *rtqueue)
+{
+    MSG_TRACE3(router, schedule, rtqueue->name, rtqueue->nextservice,
+               rtqueue->nextservice - g_get_real_time());
+    rt_timer_set(&rtqueue->timer, rtqueue->nextservice);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Link scheduling
+
+static void rt_link_schedule (RtLink *link);
+
+// Deficit round robin over the link's active queues: each turn a queue adds
+// its quantum to its deficit and sends due packets while they fit in it. A
+// queue with nothing due leaves the round, and is timed by itself again until
+// it has. The link sends only while it is free, so each packet costs O(1).
+static void
+rt_link_service (gpointer user_data)
+{
+    RtLink  *link = user_data;
+    RtQueue *rtqueue;
+    RtData  *batch[RT_BATCH];
+    gint64   now = g_get_real_time();
+
+    while ((rtqueue = g_queue_peek_head(link->active)) != NULL &&
+           link->free_at <= now + RT_LINK_AHEAD) {
+        gint64  delay = rt_queue_delay(rtqueue);
+        RtData *data;
+        guint   count = 0;
+
+        if (!rtqueue->in_turn) {
+            rtqueue->deficit += rtqueue->quantum;
+            rtqueue->in_turn  = TRUE;
+        }
+        MSG_TRACE3(router, turn, link->name, rtqueue->name, rtqueue->deficit);
+
+        while ((data = rt_queue_peek_due(rtqueue, now, delay)) != NULL &&
+               data->length <= (gsize) rtqueue->deficit &&
+               count < RT_BATCH && link->free_at <= now + RT_LINK_AHEAD) {
+            rt_queue_pop(rtqueue, data, now);
+            batch[count++]    = data;
+            rtqueue->deficit -= data->length;
+            link->free_at     = MAX(link->free_at, now) +
+                                data->length * G_USEC_PER_SEC / link->rate;
+            link->packets++;
+            link->bytes      += data->length;
+        }
+        rt_queue_send_batch(rtqueue, batch, count);
+
+        if (data == NULL) {
+            // Nothing more due, or shaped: out of the round until there is.
+            g_queue_pop_head(link->active);
+            rtqueue->active  = FALSE;
+            rtqueue->in_turn = FALSE;
+            rtqueue->deficit = 0;
+            rt_queue_reschedule(rtqueue, delay);
+        } else if (data->length > (gsize) rtqueue->deficit) {
+            // Turn over, keep what is left for the next.
+            g_queue_pop_head(link->active);
+            g_queue_push_tail(link->active, rtqueue);
+            rtqueue->in_turn = FALSE;
+        }
+    }
+
+    if (!g_queue_is_empty(link->active))
+        rt_link_schedule(link);
+}
+
+// Wake when the link is next free.
+static void
+rt_link_schedule (RtLink *link)
 {
-    GError         *error = NULL;
-    GSocketAddress *gsRmtAddr = NULL;
-    GInetAddress   *gsAddr = NULL;
-    gchar          *rmtHost = NULL;
-    gchar          *stamp = "";
-    gssize         gss_receive = 0;
+    rt_timer_set(&link->timer, link->free_at - RT_LINK_AHEAD);
+}
+
+// Add a queue with packets due to the round.
+static void
+rt_link_activate (RtLink *link, RtQueue *rtqueue)
+{
+    if (!rtqueue->active) {
+        rtqueue->active = TRUE;
+        g_queue_push_tail(link->active, rtqueue);
+    }
+    // If the link is waiting to be free, it will come to the queue then.
+    if (!rt_timer_is_set(&link->timer))
+        rt_link_service(link);
+}
 
-    gchar          message[BUFSIZE];
-    gssize         size;
-    const gchar    *timestamp;
-    gchar          *peer;
+//////////////////////////////////////////////////////////////////////////////
+// Receive Packets
+
+// Printable form of a message: the text of plain and sequenced text messages,
+// or a summary of anything else.
+static gchar *
+rt_data_text (RtData *data)
+{
+    MsgHeader header;
+
+    if (!msg_header_read(data->message, data->length, &header))
+        return g_strndup(data->message, data->length);
+    if (header.type == MSG_TYPE_TEXT && (header.flags & MSG_FLAG_COMPRESSED))
+        return g_strdup_printf("[compressed, %" G_GSIZE_FORMAT " bytes from %08x seq %u]",
+                               data->length - MSG_HEADER_SIZE, header.sender, header.seq);
+    if (header.type == MSG_TYPE_TEXT)
+        return g_strndup(data->message + MSG_HEADER_SIZE, data->length - MSG_HEADER_SIZE);
+    return g_strdup_printf("[type %d from %08x seq %u]",
+                           header.type, header.sender, header.seq);
+}
+
+// The priority class of a datagram: acknowledgements and end of turn markers
+// ahead of chat, and chat ahead of file transfers.
+static RtClass
+rt_data_classify (const gchar *message, gsize length)
+{
+    MsgHeader header;
+
+    if (!msg_header_read(message, length, &header))
+        return g_str_has_prefix(message, "[OVER]") ? RT_CLASS_CONTROL : RT_CLASS_TEXT;
+
+    switch (header.type) {
+    case MSG_TYPE_ACK:
+    case MSG_TYPE_SACK:
+        return RT_CLASS_CONTROL;
+    case MSG_TYPE_TEXT:
+        // stage-compress leaves [OVER] markers as they are, so this finds
+        // them compressed or not.
+        if (length - MSG_HEADER_SIZE >= 6 &&
+            memcmp(message + MSG_HEADER_SIZE, "[OVER]", 6) == 0)
+            return RT_CLASS_CONTROL;
+        return RT_CLASS_TEXT;
+    default:
+        return RT_CLASS_BULK;
+    }
+}
 
+// Queue a received datagram, received at 'timestamp' (nanoseconds).
+static void
+rt_queue_accept (RtQueue *rtqueue_p, const gchar *message, gsize length, gint64 timestamp)
+{
     RtData         *data;
 
+    // Drop retransmitted and multipath duplicates before they take a queue
+    // slot.
+    if (rtqueue_p->dedup != NULL &&
+        msg_dedup_check(rtqueue_p->dedup,
+                        msg_dedup_key(message, length),
+                        timestamp / 1000)) {
+        D("[DEBUG] Duplicate dropped on queue %s\n", rtqueue_p->name);
+        return;
+    }
+
+    D("[DEBUG] Received UDP packet from client - %ld bytes\n", length);
+
+    // Copy and terminate message string, leaving room for the queue's stages
+    // to work in place.
+    data = g_slice_alloc(sizeof(RtData));
+    data->timein   = timestamp / 1000;
+    data->length   = length;
+    data->headroom = 0;
+    data->tailroom = 1;
+    if (msg_pipeline_get_length(rtqueue_p->pipeline) > 0) {
+        data->headroom  = MSG_STAGE_HEADROOM;
+        data->tailroom += MSG_STAGE_TAILROOM;
+    }
+    data->message = (gchar *) g_malloc(data->headroom + length + data->tailroom) + data->headroom;
+    memcpy(data->message, message, length);
+    data->message[length] = '\0';
+    data->class = rt_data_classify(data->message, length);
+    g_queue_push_tail(rtqueue_p->queue[data->class], data);
+    rtqueue_p->received++;
+    MSG_TRACE5(router, enqueue, rtqueue_p->name, data->class, length,
+               rt_queue_length(rtqueue_p), data->timein);
+
+    D("[DEBUG] Message: %s\n", data->message);
+
+    // First packet in the queue sets the next service time. While the queue
+    // is in its link's round the link finds it.
+    if (rt_queue_has_target(rtqueue_p) && !rtqueue_p->active &&
+        rt_queue_length(rtqueue_p) == 1) {
+        rtqueue_p->nextservice = MAX(data->timein + rt_queue_delay(rtqueue_p),
+                                     rt_queue_shape_time(rtqueue_p));
+        rt_queue_schedule(rtqueue_p);
+    }
+
+    // DEBUG
+    // rt_queue_display(rtqueue_p);
+    // rt_message_display(data);
+    if (opt_quiet)
+        return;
+
+    GDateTime *datetime;
+    datetime   = g_date_time_new_from_unix_local (data->timein/1000000);
+    gchar *str = g_date_time_format (datetime, "%Y/%m/%d %H:%M:%S %z");
+    gchar *msg = rt_data_text(data);
+    g_strchomp(msg);
+    g_print("%s | %s\n", str, msg);
+    g_free(str);
+    g_free(msg);
+    g_date_time_unref(datetime);
+}
+
+// Datagrams read by one call of the receive handler, passed through the
+// queue's stages together. The main loop has one for the queues it serves and
+// each busy polling worker has its own.
+typedef struct {
+    RtQueue   *rtqueue;
+    MsgPacket  packets[RT_BATCH];
+    gint64     timestamps[RT_BATCH];
+    gchar     *buffers[RT_BATCH + 1];   // The last holds a shard or bundle being unpacked
+    guint      count;
+    gint64     timestamp;               // Of the shard or bundle
+} RtBatch;
+
+static RtBatch batch;
+
+static void rt_worker_forward (RtBatch *batch);
+
+// Run the batch through the queue's stages and queue what is left, or on a
+// busy polling queue forward it there and then.
+static void
+rt_batch_flush (RtBatch *batch)
+{
+    msg_pipeline_process(batch->rtqueue->pipeline, MSG_STAGE_IN,
+                         batch->packets, batch->count);
+    if (batch->rtqueue->worker != NULL) {
+        rt_worker_forward(batch);
+        batch->count = 0;
+        return;
+    }
+    for (guint i = 0; i < batch->count; i++) {
+        if (batch->packets[i].length > 0)
+            rt_queue_accept(batch->rtqueue, batch->packets[i].data,
+                            batch->packets[i].length, batch->timestamps[i]);
+    }
+    batch->count = 0;
+}
+
+// Add a datagram from a shard or bundle.
+static gboolean
+rt_batch_add (const gchar *message, gsize length, gpointer user_data)
+{
+    RtBatch *batch = user_data;
+    guint    i;
+
+    if (batch->count == RT_BATCH)
+        rt_batch_flush(batch);
+    i = batch->count++;
+    msg_packet_init(&batch->packets[i], batch->buffers[i], RT_PACKET, MIN(length, BUFSIZE));
+    memcpy(batch->packets[i].data, message, batch->packets[i].length);
+    batch->timestamps[i] = batch->timestamp;
+    return TRUE;
+}
+
+// Add a datagram recovered from an FEC shard, which may be a bundle.
+static gboolean
+rt_batch_recovered (const gchar *message, gsize length, gpointer user_data)
+{
+    if (msg_bundle_is_bundle(message, length))
+        return msg_bundle_unpack(message, length, rt_batch_add, user_data) > 0;
+    return rt_batch_add(message, length, user_data);
+}
+
+// Read what is waiting on the queue's socket, up to a batch, along with each
+// datagram's kernel receive timestamp, and pass it on. Reads go straight into
+// the batch's buffers. Returns the number of datagrams read.
+static guint
+rt_queue_receive (RtQueue *rtqueue_p, RtBatch *batch)
+{
+    gssize             gss_receive = 0;
+    gint64             timestamp;
+    struct sockaddr_in src, dst;
+    guint              n;
+
+    if (batch->buffers[0] == NULL) {
+        for (guint i = 0; i <= RT_BATCH; i++)
+            batch->buffers[i] = g_malloc(RT_PACKET);
+    }
+    batch->rtqueue = rtqueue_p;
+
+    for (n = 0; n < RT_BATCH; n++) {
+        gchar *buffer = batch->buffers[batch->count];
+
+        gss_receive = rt_capture_receive (rtqueue_p->fd,
+                                          buffer + MSG_STAGE_HEADROOM,
+                                          BUFSIZE,
+                                          &src,
+                                          &dst,
+                                          &timestamp);
+
+        if (gss_receive < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                g_printerr("[ERROR] recvmsg() => %s\n", g_strerror(errno));
+            break;
+        }
+
+        MSG_TRACE3(router, receive, rtqueue_p->name, gss_receive, timestamp);
+        dst.sin_port = htons(rtqueue_p->port_in);
+        rt_capture_packet(capture, RT_CAPTURE_IN, timestamp, &src, &dst,
+                          buffer + MSG_STAGE_HEADROOM, gss_receive);
+
+        // FEC and bundles are undone hop by hop, so the queue holds, and
+        // forwards, the original datagrams. The shard or bundle moves to the
+        // spare buffer, out of the way of what comes out of it.
+        if (msg_fec_is_shard(buffer + MSG_STAGE_HEADROOM, gss_receive)) {
+            batch->buffers[batch->count] = batch->buffers[RT_BATCH];
+            batch->buffers[RT_BATCH]     = buffer;
+            batch->timestamp             = timestamp;
+            msg_fec_decoder_receive(rtqueue_p->fec_decoder,
+                                    buffer + MSG_STAGE_HEADROOM, gss_receive,
+                                    rt_batch_recovered, batch);
+            continue;
+        }
+        if (msg_bundle_is_bundle(buffer + MSG_STAGE_HEADROOM, gss_receive)) {
+            batch->buffers[batch->count] = batch->buffers[RT_BATCH];
+            batch->buffers[RT_BATCH]     = buffer;
+            batch->timestamp             = timestamp;
+            msg_bundle_unpack(buffer + MSG_STAGE_HEADROOM, gss_receive,
+                              rt_batch_add, batch);
+            continue;
+        }
+
+        msg_packet_init(&batch->packets[batch->count], buffer, RT_PACKET, gss_receive);
+        batch->timestamps[batch->count++] = timestamp;
+        if (batch->count == RT_BATCH)
+            rt_batch_flush(batch);
+    }
+    rt_batch_flush(batch);
+
+    return n;
+}
+
+static gboolean
+rt_queue_message_handler (GSocket *gSock, GIOCondition condition, RtQueue* rtqueue_p)
+{
     D("[DEBUG] Receivng UDP packet - Condition: %s\n",
       skn_gio_condition_to_string(condition));
     D("[DEBUG]   on queue %s\n", rtqueue_p->name);
@@ -145,46 +823,228 @@ rt_queue_message_handler (GSocket *gSock, GIOCondition condition, RtQueue* rtque
         return (G_SOURCE_CONTINUE);
     }
 
-    // If socket times out before reading data any operation will error with 'G_IO_ERROR_TIMED_OUT'.
-    gss_receive = g_socket_receive_from (gSock,
-                                         &gsRmtAddr,
-                                         message,
-                                         sizeof(message),
-                                         NULL,
-                                         &error);
+    rt_queue_receive(rtqueue_p, &batch);
 
-    if (error != NULL) {
-        // gss_receive = Number of bytes read, or 0 if the connection was closed by the peer, or -1 on error
-        g_error("[ERROR] g_socket_receive_from() => %s", error->message);
-        g_clear_error(&error);
-        return (G_SOURCE_CONTINUE);
+    return (G_SOURCE_CONTINUE);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Busy polling
+
+// A thread, pinned to a CPU, that spins on a zero delay queue's socket and
+// forwards each packet as soon as it is read, so the queue never waits for
+// the main loop to wake. Only it touches the queue until it is stopped.
+struct _RtWorker {
+    RtQueue  *rtqueue;
+    gint      cpu;
+    GThread  *thread;
+    gint      stop;                     // Set (atomically) to end the thread
+    RtBatch   batch;
+
+    // Time from the kernel's receive timestamp to the packet being sent, in
+    // nanoseconds: quarter octave buckets, see rt_worker_bucket().
+    guint64   packets;
+    guint64   histogram[RT_HISTOGRAM];
+    gint64    latency_max;
+};
+
+// Buckets 0-7 hold 0-7 ns; after that each power of two is split in four.
+// The last also holds anything longer.
+static guint
+rt_worker_bucket (gint64 ns)
+{
+    guint msb;
+
+    if (ns < 8)
+        return MAX(ns, 0);
+    msb = g_bit_storage(ns) - 1;
+    return MIN((msb - 1) * 4 + ((ns >> (msb - 2)) & 3), RT_HISTOGRAM - 1);
+}
+
+static gint64
+rt_worker_bucket_low (guint bucket)
+{
+    if (bucket < 8)
+        return bucket;
+    return (gint64) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static inline gint64
+rt_worker_now (void)
+{
+    struct timespec ts;
+
+    // Receive timestamps are CLOCK_REALTIME (SO_TIMESTAMPNS).
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Forward a batch straight from the socket, in place of queueing it.
+static void
+rt_worker_forward (RtBatch *batch)
+{
+    RtQueue  *rtqueue = batch->rtqueue;
+    RtWorker *worker  = rtqueue->worker;
+    guint     count   = 0;
+
+    for (guint i = 0; i < batch->count; i++) {
+        MsgPacket *packet = &batch->packets[i];
+
+        if (packet->length == 0)
+            continue;
+        if (rtqueue->dedup != NULL &&
+            msg_dedup_check(rtqueue->dedup,
+                            msg_dedup_key(packet->data, packet->length),
+                            batch->timestamps[i] / 1000))
+            continue;
+        rtqueue->received++;
+        batch->packets[count]      = *packet;
+        batch->timestamps[count++] = batch->timestamps[i];
     }
 
-    // Terminate message string.
-    message[gss_receive] = '\0';
+    msg_pipeline_process(rtqueue->pipeline, MSG_STAGE_OUT, batch->packets, count);
+    for (guint i = 0; i < count; i++) {
+        gint64 latency;
 
-    D("[DEBUG] Received UDP packet from client - %ld bytes\n", gss_receive);
-    D("[DEBUG] Message: %s\n", message);
+        if (batch->packets[i].length == 0 ||
+            !rt_queue_transmit(batch->packets[i].data, batch->packets[i].length, rtqueue))
+            continue;
 
-    data = g_slice_alloc(sizeof(RtData));
-    data->timein = g_get_real_time();
-    data->message = g_strdup(message);
-    g_queue_push_tail(rtqueue_p->queue, data);
+        latency = MAX(rt_worker_now() - batch->timestamps[i], 0);
+        worker->packets++;
+        worker->histogram[rt_worker_bucket(latency)]++;
+        worker->latency_max = MAX(worker->latency_max, latency);
 
-    // DEBUG
-    // rt_queue_display(rtqueue_p);
-    // rt_message_display(data);
-    GDateTime *datetime;
-    datetime   = g_date_time_new_from_unix_local (data->timein/1000000);
-    gchar *str = g_date_time_format (datetime, "%Y/%m/%d %H:%M:%S %z");
-    gchar *msg = g_strndup(data->message,BUFSIZE);
-    g_strchomp(msg);
-    g_print("%s | %s\n", str, msg);
-    g_free(str);
-    g_free(msg);
-    g_date_time_unref(datetime);
+        rtqueue->forwarded++;
+        rtqueue->residence_sum += latency / 1000;
+        rtqueue->residence_max  = MAX(rtqueue->residence_max, latency / 1000);
+        msg_quantile_add(&rtqueue->residence_p50, latency / 1000);
+        msg_quantile_add(&rtqueue->residence_p99, latency / 1000);
+    }
+}
 
-    return (G_SOURCE_CONTINUE);
+static inline void
+rt_worker_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+// Read whatever is there; when nothing is, back off from spinning to yielding
+// the CPU to blocking in poll(), and start spinning again once packets come.
+static gpointer
+rt_worker_run (gpointer user_data)
+{
+    RtWorker     *worker  = user_data;
+    RtQueue      *rtqueue = worker->rtqueue;
+    struct pollfd pfd     = { .fd = rtqueue->fd, .events = POLLIN };
+    guint         idle    = 0;
+    cpu_set_t     cpus;
+    gint          err;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0)
+        g_printerr("[BUSY] %s: unable to pin to cpu %d: %s\n",
+                   rtqueue->name, worker->cpu, g_strerror(err));
+
+    while (!g_atomic_int_get(&worker->stop)) {
+        if (rt_queue_receive(rtqueue, &worker->batch) > 0) {
+            idle = 0;
+        } else if (idle < RT_SPIN) {
+            idle++;
+            rt_worker_relax();
+        } else if (idle < RT_SPIN + RT_YIELD) {
+            idle++;
+            sched_yield();
+        } else if (poll(&pfd, 1, RT_BLOCK_MS) > 0) {
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+// Have the socket poll the device queue for a while before a read comes back
+// empty, where the kernel allows it (raising it may need CAP_NET_ADMIN).
+static void
+rt_worker_socket_init (RtQueue *rtqueue)
+{
+    gint usec = RT_BUSY_POLL;
+
+    if (setsockopt(rtqueue->fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+        g_printerr("[BUSY] %s: SO_BUSY_POLL: %s\n", rtqueue->name, g_strerror(errno));
+#ifdef SO_PREFER_BUSY_POLL
+    gint on = 1;
+
+    if (setsockopt(rtqueue->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0)
+        g_printerr("[BUSY] %s: SO_PREFER_BUSY_POLL: %s\n", rtqueue->name, g_strerror(errno));
+#endif
+}
+
+static void
+rt_worker_start (RtQueue *rtqueue)
+{
+    RtWorker *worker = rtqueue->worker;
+    gchar    *name = g_strdup_printf("busy-%s", rtqueue->name);
+
+    rt_worker_socket_init(rtqueue);
+    worker->rtqueue = rtqueue;
+    worker->thread  = g_thread_new(name, rt_worker_run, worker);
+    g_print("[BUSY] %s: polling on cpu %d\n", rtqueue->name, worker->cpu);
+    g_free(name);
+}
+
+static void
+rt_worker_stop (RtWorker *worker)
+{
+    g_atomic_int_set(&worker->stop, 1);
+    g_thread_join(worker->thread);
+    worker->thread = NULL;
+}
+
+// Smallest latency at or above fraction 'q' of the packets, to the upper end
+// of its bucket.
+static gint64
+rt_worker_percentile (RtWorker *worker, gdouble q)
+{
+    guint64 rank = MAX((guint64) (q * worker->packets + 0.5), 1);
+    guint64 seen = 0;
+
+    for (guint i = 0; i < RT_HISTOGRAM; i++) {
+        seen += worker->histogram[i];
+        if (seen >= rank)
+            return MIN(rt_worker_bucket_low(i + 1) - 1, worker->latency_max);
+    }
+    return worker->latency_max;
+}
+
+//   [BUSY] NAME: cpu N, N packets, latency p50 N p90 N p99 N p99.9 N max N ns
+// and with --stats the histogram, one non-empty bucket a line.
+static void
+rt_worker_print (RtWorker *worker, gboolean histogram)
+{
+    RtQueue *rtqueue = worker->rtqueue;
+
+    g_print("[BUSY] %s: cpu %d, %" G_GUINT64_FORMAT " packets, latency p50 %"
+            G_GINT64_FORMAT " p90 %" G_GINT64_FORMAT " p99 %" G_GINT64_FORMAT
+            " p99.9 %" G_GINT64_FORMAT " max %" G_GINT64_FORMAT " ns\n",
+            rtqueue->name, worker->cpu, worker->packets,
+            rt_worker_percentile(worker, 0.5), rt_worker_percentile(worker, 0.9),
+            rt_worker_percentile(worker, 0.99), rt_worker_percentile(worker, 0.999),
+            worker->latency_max);
+    if (!histogram)
+        return;
+    for (guint i = 0; i < RT_HISTOGRAM; i++) {
+        if (worker->histogram[i] == 0)
+            continue;
+        g_print("[BUSY] %s: %10" G_GINT64_FORMAT " - %10" G_GINT64_FORMAT " ns %10"
+                G_GUINT64_FORMAT "\n", rtqueue->name, rt_worker_bucket_low(i),
+                rt_worker_bucket_low(i + 1) - 1, worker->histogram[i]);
+    }
 }
 
 void
@@ -227,6 +1087,19 @@ rt_queue_open (RtQueue * rtqueue_p)
         g_clear_error(&error);
         exit(EXIT_FAILURE);
     }
+    rtqueue_p->fd = g_socket_get_fd(gSock);
+    rt_capture_socket_init(rtqueue_p->fd);
+    rtqueue_p->fec_decoder = msg_fec_decoder_new();
+    rt_timer_init(&rtqueue_p->timer, rt_queue_service, rtqueue_p);
+    msg_quantile_init(&rtqueue_p->residence_p50, 0.5);
+    msg_quantile_init(&rtqueue_p->residence_p99, 0.99);
+
+    // A busy polling queue is served by its worker instead.
+    if (rtqueue_p->worker != NULL) {
+        g_print("[QUEUE] Listening:%s port:%d\n", rtqueue_p->name, port);
+        rt_worker_start(rtqueue_p);
+        return;
+    }
 
     // Create and add socket to gmain loop for UDP service.
     D("[DEBUG] - Add socket to main loop to service received packets\n");
@@ -257,24 +1130,450 @@ rt_queue_display(RtQueue *rtqueue)
 
     GDateTime *datetime;
 
-    size = g_queue_get_length (rtqueue->queue);
+    size = rt_queue_length (rtqueue);
     D("[DEBUG] Queue: %s\n", rtqueue->name);
     D("[DEBUG] queue length: %d\n", size);
 
-    for (i=0; i<size; i++){
-        data = g_queue_peek_nth (rtqueue->queue, i);
+    for (gint class = 0; class < RT_CLASSES; class++) {
+        size = g_queue_get_length (rtqueue->queue[class]);
+        for (i=0; i<size; i++){
+            data = g_queue_peek_nth (rtqueue->queue[class], i);
 
-        // g_print("timein:  %8ld  \n", data->timein/1000000);
-        datetime = g_date_time_new_from_unix_local (data->timein/1000000);
-        gchar *str = g_date_time_format (datetime, "%Y/%m/%d %H:%M:%S %z");
-        D("[DEBUG]   %s | %s\n", str, data->message);
-        g_free(str);
-        g_date_time_unref(datetime);
+            // g_print("timein:  %8ld  \n", data->timein/1000000);
+            datetime = g_date_time_new_from_unix_local (data->timein/1000000);
+            gchar *str = g_date_time_format (datetime, "%Y/%m/%d %H:%M:%S %z");
+            D("[DEBUG]   %s | %s | %s\n", str, rt_class_names[class], data->message);
+            g_free(str);
+            g_date_time_unref(datetime);
+        }
     }
 }
 
 // Global Data
 GArray *queues;     // Array of Queues
+GPtrArray *links;   // Shared outbound links (RtLink)
+
+// Command line options
+static gchar    *opt_capture       = NULL;
+static gboolean  opt_capture_start = FALSE;
+static gint      opt_capture_slots = 4096;
+static gint      opt_capture_size  = 64;    // MiB per file
+static gint      opt_capture_files = 8;
+static gchar    *opt_routes        = NULL;
+static gchar    *opt_node          = NULL;
+static gchar   **opt_queues        = NULL;
+static gint      opt_dedup         = 0;     // Seconds, 0 = off
+static gint      opt_dedup_size    = 65536;
+static gchar   **opt_fec           = NULL;
+static gchar   **opt_stages        = NULL;
+static gchar   **opt_bundles       = NULL;
+static gchar   **opt_links         = NULL;
+static gchar   **opt_weights       = NULL;
+static gchar   **opt_shapes        = NULL;
+static gboolean  opt_stats         = FALSE;
+static gchar   **opt_busy_polls    = NULL;
+
+static GOptionEntry entries[] =
+{
+    { "capture",       0, 0, G_OPTION_ARG_FILENAME, &opt_capture,
+      "Capture packets to rotating pcap files PREFIX-NNN.pcap", "PREFIX" },
+    { "capture-start", 0, 0, G_OPTION_ARG_NONE,     &opt_capture_start,
+      "Start capturing immediately (otherwise toggle with SIGUSR1)", NULL },
+    { "capture-slots", 0, 0, G_OPTION_ARG_INT,      &opt_capture_slots,
+      "Capture ring size in packets (default 4096)", "N" },
+    { "capture-size",  0, 0, G_OPTION_ARG_INT,      &opt_capture_size,
+      "Rotate capture files after this many MiB (default 64)", "MIB" },
+    { "capture-files", 0, 0, G_OPTION_ARG_INT,      &opt_capture_files,
+      "Number of capture files to rotate through (default 8)", "N" },
+    { "routes",        0, 0, G_OPTION_ARG_FILENAME, &opt_routes,
+      "Routing topology (eg. routes.json), reloaded on SIGHUP", "FILE" },
+    { "node",          0, 0, G_OPTION_ARG_STRING,   &opt_node,
+      "Name of this router in the routing topology", "NAME" },
+    { "queue",         0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_queues,
+      "Add a queue. TARGET is a node in the topology or ADDRESS:PORT; DELAY "
+      "is in seconds (default: the topology link delay)", "NAME,PORT_IN,TARGET[,DELAY]" },
+    { "dedup",         0, 0, G_OPTION_ARG_INT,      &opt_dedup,
+      "Drop duplicate packets seen on a queue within this many seconds", "SECONDS" },
+    { "dedup-size",    0, 0, G_OPTION_ARG_INT,      &opt_dedup_size,
+      "Expected packets per queue per dedup window (default 65536)", "N" },
+    { "fec",           0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_fec,
+      "Add PARITY erasure coded packets to each DATA forwarded by queue NAME, "
+      "sent at most MS milliseconds after the first (default 20)",
+      "NAME,DATA,PARITY[,MS]" },
+    { "bundle",        0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_bundles,
+      "Pack packets forwarded by queue NAME into datagrams of up to SIZE bytes "
+      "(default 1400, at most 1500), holding them at most MS milliseconds (default 0: only "
+      "packets due together)", "NAME[,SIZE[,MS]]" },
+    { "link",          0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_links,
+      "Limit the queues sending to TARGET to KBPS kilobits per second between "
+      "them, shared by weight", "TARGET,KBPS" },
+    { "weight",        0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_weights,
+      "Give queue NAME WEIGHT shares of its link (default 1)", "NAME,WEIGHT" },
+    { "shape",         0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_shapes,
+      "Limit queue NAME to KBPS kilobits per second, in bursts of up to BURST "
+      "bytes (default 10ms worth)", "NAME,KBPS[,BURST]" },
+    { "stats",         0, 0, G_OPTION_ARG_NONE,     &opt_stats,
+      "Print each queue's packet counts and times from receipt to forwarding "
+      "on exit", NULL },
+    { "quiet",         0, 0, G_OPTION_ARG_NONE,     &opt_quiet,
+      "Do not print each packet received", NULL },
+    { "stage",         0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_stages,
+      "Run packets received and forwarded by queue NAME through the stage "
+      "module at PATH (repeat for more stages)", "NAME,PATH[,ARGS]" },
+    { "busy-poll",     0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_busy_polls,
+      "Forward zero delay queue NAME from a thread pinned to CPU that polls "
+      "its socket without sleeping", "NAME,CPU" },
+    { NULL }
+};
+
+// SIGINT/SIGTERM stop the main loop so that capture files are flushed.
+static gboolean
+rt_quit (gpointer user_data)
+{
+    gtk_main_quit ();
+    return (G_SOURCE_REMOVE);
+}
+
+// SIGHUP reloads the routing topology. Changed links are applied
+// incrementally.
+static gboolean
+rt_routes_reload (gpointer user_data)
+{
+    GError *error = NULL;
+
+    if (!rt_topology_reload(topology, opt_routes, &error)) {
+        g_printerr("[ROUTES] %s\n", error->message);
+        g_clear_error(&error);
+        return (G_SOURCE_CONTINUE);
+    }
+
+    self = rt_topology_node_index(topology, opt_node);
+    for (guint i = 0; i < queues->len; i++) {
+        RtQueue *rtqueue = &g_array_index(queues, RtQueue, i);
+        if (rtqueue->target.address != NULL)
+            continue;
+        rtqueue->target.node = rt_topology_node_index(topology, rtqueue->target.name);
+        if (rtqueue->target.node < 0)
+            g_printerr("[ROUTES] Queue %s: target %s no longer in %s\n",
+                       rtqueue->name, rtqueue->target.name, opt_routes);
+    }
+    if (self < 0)
+        g_printerr("[ROUTES] Node %s no longer in %s\n", opt_node, opt_routes);
+
+    return (G_SOURCE_CONTINUE);
+}
+
+// Parse a --queue specification, NAME,PORT_IN,TARGET[,DELAY].
+static gboolean
+rt_queue_parse (const gchar *spec, RtQueue *rtqueue)
+{
+    gchar **fields = g_strsplit(spec, ",", 4);
+    guint   count  = g_strv_length(fields);
+
+    memset(rtqueue, 0, sizeof(*rtqueue));
+    rtqueue->target.node = -1;
+
+    if (count < 3) {
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    rtqueue->name        = g_strdup(fields[0]);
+    rtqueue->port_in     = atoi(fields[1]);
+    rtqueue->target.name = g_strdup(fields[2]);
+    for (gint class = 0; class < RT_CLASSES; class++)
+        rtqueue->queue[class] = g_queue_new();
+    rtqueue->quantum     = RT_QUANTUM;
+
+    if (strchr(fields[2], ':') != NULL) {
+        // Fixed address
+        struct addrinfo  hints, *result;
+        gchar          **parts = g_strsplit(fields[2], ":", 2);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(parts[0], parts[1], &hints, &result) != 0) {
+            g_printerr("[QUEUE] Unable to resolve %s\n", fields[2]);
+            g_strfreev(parts);
+            g_strfreev(fields);
+            return FALSE;
+        }
+        memcpy(&rtqueue->target.addr, result->ai_addr, sizeof(rtqueue->target.addr));
+        freeaddrinfo(result);
+        rtqueue->target.address = g_strdup(parts[0]);
+        rtqueue->target.port    = atoi(parts[1]);
+        g_strfreev(parts);
+    } else {
+        // Node in the routing topology
+        if (topology == NULL || self < 0) {
+            g_printerr("[QUEUE] %s: target %s needs --routes and --node\n",
+                       fields[0], fields[2]);
+            g_strfreev(fields);
+            return FALSE;
+        }
+        rtqueue->target.node = rt_topology_node_index(topology, fields[2]);
+        if (rtqueue->target.node < 0) {
+            g_printerr("[QUEUE] %s: unknown node %s\n", fields[0], fields[2]);
+            g_strfreev(fields);
+            return FALSE;
+        }
+    }
+
+    if (count > 3)
+        rtqueue->delay = g_ascii_strtod(fields[3], NULL) * G_USEC_PER_SEC;
+    else
+        rtqueue->link_delay = (rtqueue->target.node >= 0);
+
+    g_strfreev(fields);
+    return TRUE;
+}
+
+// The queue called 'name', or NULL.
+static RtQueue *
+rt_queue_find (const gchar *name)
+{
+    for (guint i = 0; i < queues->len; i++) {
+        if (g_strcmp0(g_array_index(queues, RtQueue, i).name, name) == 0)
+            return &g_array_index(queues, RtQueue, i);
+    }
+    return NULL;
+}
+
+// Apply a --fec specification, NAME,DATA,PARITY[,MS], to its queue.
+static gboolean
+rt_queue_parse_fec (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 4);
+    guint    count  = g_strv_length(fields);
+    RtQueue *rtqueue = NULL;
+    gint     data, parity;
+    gint64   delay = 0;
+
+    if (count >= 3)
+        rtqueue = rt_queue_find(fields[0]);
+    if (rtqueue == NULL) {
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    data   = atoi(fields[1]);
+    parity = atoi(fields[2]);
+    if (count > 3)
+        delay = g_ascii_strtod(fields[3], NULL) * G_TIME_SPAN_MILLISECOND;
+    g_strfreev(fields);
+
+    if (data < 1 || data > MSG_FEC_MAX_DATA || parity < 1 || parity > MSG_FEC_MAX_PARITY)
+        return FALSE;
+
+    msg_fec_encoder_free(rtqueue->fec);
+    rtqueue->fec = msg_fec_encoder_new(data, parity, delay, rt_queue_transmit, rtqueue);
+    g_print("[QUEUE] %s: FEC %d+%d\n", rtqueue->name, data, parity);
+    return TRUE;
+}
+
+// Apply a --bundle specification, NAME[,SIZE[,MS]], to its queue's target.
+static gboolean
+rt_queue_parse_bundle (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 3);
+    guint    count  = g_strv_length(fields);
+    RtQueue *rtqueue = NULL;
+    gint     size = 0;
+    gint64   delay = 0;
+
+    rtqueue = rt_queue_find(fields[0]);
+    if (count > 1)
+        size = atoi(fields[1]);
+    if (count > 2)
+        delay = g_ascii_strtod(fields[2], NULL) * G_TIME_SPAN_MILLISECOND;
+    g_strfreev(fields);
+
+    if (rtqueue == NULL || size < 0 || size > MSG_BUNDLE_MAX || delay < 0)
+        return FALSE;
+
+    msg_bundler_free(rtqueue->target.bundler);
+    rtqueue->target.bundler = msg_bundler_new(size, delay, rt_queue_encode, rtqueue);
+    g_print("[QUEUE] %s: bundling to %s\n", rtqueue->name, rtqueue->target.name);
+    return TRUE;
+}
+
+// Apply a --link specification, TARGET,KBPS, to the queues sending to TARGET.
+static gboolean
+rt_queue_parse_link (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 2);
+    RtLink  *link;
+    gdouble  kbps;
+    guint    members = 0;
+
+    if (g_strv_length(fields) < 2 ||
+        (kbps = g_ascii_strtod(fields[1], NULL)) <= 0) {
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    link         = g_new0(RtLink, 1);
+    link->name   = g_strdup(fields[0]);
+    link->rate   = MAX(kbps * 1000 / 8, 1);
+    link->active = g_queue_new();
+    rt_timer_init(&link->timer, rt_link_service, link);
+    g_strfreev(fields);
+
+    for (guint i = 0; i < queues->len; i++) {
+        RtQueue *rtqueue = &g_array_index(queues, RtQueue, i);
+
+        if (g_strcmp0(rtqueue->target.name, link->name) == 0) {
+            rtqueue->link = link;
+            members++;
+        }
+    }
+    if (members == 0) {
+        g_queue_free(link->active);
+        g_free(link->name);
+        g_free(link);
+        return FALSE;
+    }
+
+    g_ptr_array_add(links, link);
+    g_print("[LINK] %s: %g kbit/s shared by %u queues\n", link->name, kbps, members);
+    return TRUE;
+}
+
+// Apply a --weight specification, NAME,WEIGHT, to its queue.
+static gboolean
+rt_queue_parse_weight (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 2);
+    RtQueue *rtqueue = NULL;
+    gint     weight = 0;
+
+    if (fields[1] != NULL)
+        rtqueue = rt_queue_find(fields[0]);
+    if (fields[1] != NULL)
+        weight = atoi(fields[1]);
+    g_strfreev(fields);
+
+    if (rtqueue == NULL || weight < 1 || weight > 1000)
+        return FALSE;
+
+    rtqueue->quantum = weight * RT_QUANTUM;
+    return TRUE;
+}
+
+// Apply a --shape specification, NAME,KBPS[,BURST], to its queue.
+static gboolean
+rt_queue_parse_shape (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 3);
+    guint    count  = g_strv_length(fields);
+    RtQueue *rtqueue = NULL;
+    gdouble  kbps = 0;
+    gint64   burst = -1;
+
+    if (count >= 2)
+        rtqueue = rt_queue_find(fields[0]);
+    if (count >= 2)
+        kbps = g_ascii_strtod(fields[1], NULL);
+    if (count > 2)
+        burst = g_ascii_strtoll(fields[2], NULL, 10);
+    g_strfreev(fields);
+
+    if (rtqueue == NULL || kbps <= 0 || (count > 2 && burst <= 0))
+        return FALSE;
+
+    rtqueue->rate  = MAX(kbps * 1000 / 8, 1);
+    rtqueue->burst = burst > 0 ? burst * G_USEC_PER_SEC / rtqueue->rate : RT_SHAPE_BURST;
+    g_print("[QUEUE] %s: shaped to %g kbit/s\n", rtqueue->name, kbps);
+    return TRUE;
+}
+
+// Apply a --stage specification, NAME,PATH[,ARGS], to its queue.
+static gboolean
+rt_queue_parse_stage (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 2);
+    RtQueue *rtqueue = NULL;
+    GError  *error = NULL;
+
+    if (fields[1] != NULL)
+        rtqueue = rt_queue_find(fields[0]);
+    if (rtqueue == NULL) {
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    if (rtqueue->pipeline == NULL)
+        rtqueue->pipeline = msg_pipeline_new();
+    if (!msg_pipeline_add(rtqueue->pipeline, fields[1], &error)) {
+        g_printerr("[QUEUE] %s: %s\n", rtqueue->name, error->message);
+        g_clear_error(&error);
+        g_strfreev(fields);
+        return FALSE;
+    }
+
+    g_print("[QUEUE] %s: stage %s\n", rtqueue->name, fields[1]);
+    g_strfreev(fields);
+    return TRUE;
+}
+
+// Apply a --busy-poll specification, NAME,CPU, to its queue. Only a queue that
+// forwards at once to a fixed address can: delays, links, shaping, bundles
+// and FEC all need the main loop's timers.
+static gboolean
+rt_queue_parse_busy_poll (const gchar *spec)
+{
+    gchar  **fields = g_strsplit(spec, ",", 2);
+    RtQueue *rtqueue = NULL;
+    gchar   *end = NULL;
+    gint64   cpu = -1;
+
+    if (fields[1] != NULL)
+        rtqueue = rt_queue_find(fields[0]);
+    if (fields[1] != NULL)
+        cpu = g_ascii_strtoll(fields[1], &end, 10);
+    if (rtqueue == NULL || end == fields[1] || *end != '\0' ||
+        cpu < 0 || cpu >= CPU_SETSIZE) {
+        g_strfreev(fields);
+        return FALSE;
+    }
+    g_strfreev(fields);
+
+    if (rtqueue->target.address == NULL || rtqueue->link_delay || rtqueue->delay != 0 ||
+        rtqueue->link != NULL || rtqueue->rate > 0 ||
+        rtqueue->target.bundler != NULL || rtqueue->fec != NULL) {
+        g_printerr("[BUSY] %s: needs a delay of 0 to an ADDRESS:PORT, and no "
+                   "--link, --shape, --bundle or --fec\n", rtqueue->name);
+        return FALSE;
+    }
+
+    if (rtqueue->worker == NULL)
+        rtqueue->worker = g_new0(RtWorker, 1);
+    rtqueue->worker->cpu = cpu;
+    return TRUE;
+}
+
+// One line per queue, for people and for 'router-testbed':
+//   [STATS] NAME: received N, forwarded N, residence mean N p50 N p99 N max N us
+static void
+rt_queue_print_stats (RtQueue *rtqueue)
+{
+    g_print("[STATS] %s: received %" G_GUINT64_FORMAT ", forwarded %" G_GUINT64_FORMAT
+            ", residence mean %.0f p50 %.0f p99 %.0f max %" G_GINT64_FORMAT " us\n",
+            rtqueue->name, rtqueue->received, rtqueue->forwarded,
+            (gdouble) rtqueue->residence_sum / MAX(rtqueue->forwarded, 1),
+            msg_quantile_get(&rtqueue->residence_p50),
+            msg_quantile_get(&rtqueue->residence_p99),
+            rtqueue->residence_max);
+}
+
+// SIGUSR1 toggles packet capture.
+static gboolean
+rt_capture_toggle (gpointer user_data)
+{
+    rt_capture_set_enabled(capture, !rt_capture_get_enabled(capture));
+    return (G_SOURCE_CONTINUE);
+}
 
 //////////////////////////////////////////////////////////////////////////////
 int
@@ -285,17 +1584,129 @@ main (int    argc,
     RtData *data = NULL;
     GQueue *queue;
 
+    GOptionContext *context;
+    GError *error = NULL;
+
+    context = g_option_context_new ("- store and forward UDP message router");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free (context);
+
+    // Packet capture
+    if (opt_capture != NULL) {
+        if (opt_capture_slots < 1 || opt_capture_slots > RT_CAPTURE_SLOTS_MAX) {
+            g_printerr("[ERROR] --capture-slots must be from 1 to %d\n", RT_CAPTURE_SLOTS_MAX);
+            exit(EXIT_FAILURE);
+        }
+        capture = rt_capture_new(opt_capture,
+                                 opt_capture_slots,
+                                 (gsize) opt_capture_size * 1024 * 1024,
+                                 opt_capture_files);
+        if (opt_capture_start)
+            rt_capture_set_enabled(capture, TRUE);
+        g_unix_signal_add(SIGUSR1, rt_capture_toggle, NULL);
+    }
+    g_unix_signal_add(SIGINT,  rt_quit, NULL);
+    g_unix_signal_add(SIGTERM, rt_quit, NULL);
+
     // Setup Queues
     queue = g_queue_new();
     queues = g_array_new (FALSE, FALSE, sizeof(RtQueue));
+    links  = g_ptr_array_new ();
+
+    // Routing topology
+    if (opt_routes != NULL) {
+        topology = rt_topology_load(opt_routes, &error);
+        if (topology == NULL) {
+            g_printerr("[ROUTES] %s\n", error->message);
+            g_clear_error(&error);
+            exit(EXIT_FAILURE);
+        }
+        self = rt_topology_node_index(topology, opt_node);
+        if (self < 0) {
+            g_printerr("[ROUTES] --node %s is not in %s\n",
+                       opt_node ? opt_node : "(none)", opt_routes);
+            exit(EXIT_FAILURE);
+        }
+        rt_topology_display(topology);
+        g_unix_signal_add(SIGHUP, rt_routes_reload, NULL);
+    }
 
     //widgets->queues = queues;
-    // TODO: Allow the queues to be configured via a config file.
-    // Default Queue
-    rtqueue.name       = "default";
-    rtqueue.port_in    = 4480;
-    rtqueue.queue      = g_queue_new();
-    g_array_append_val (queues, rtqueue);
+    for (gint i = 0; opt_queues != NULL && opt_queues[i] != NULL; i++) {
+        if (!rt_queue_parse(opt_queues[i], &rtqueue)) {
+            g_printerr("[QUEUE] Bad --queue %s\n", opt_queues[i]);
+            exit(EXIT_FAILURE);
+        }
+        g_array_append_val (queues, rtqueue);
+    }
+
+    // Default Queue (receive and log only)
+    if (queues->len == 0) {
+        memset(&rtqueue, 0, sizeof(rtqueue));
+        rtqueue.name        = "default";
+        rtqueue.port_in     = 4480;
+        for (gint class = 0; class < RT_CLASSES; class++)
+            rtqueue.queue[class] = g_queue_new();
+        rtqueue.quantum     = RT_QUANTUM;
+        rtqueue.target.node = -1;
+        g_array_append_val (queues, rtqueue);
+    }
+
+    if (opt_dedup > 0) {
+        for (guint i = 0; i < queues->len; i++) {
+            g_array_index(queues, RtQueue, i).dedup =
+                msg_dedup_new(opt_dedup_size, (gint64) opt_dedup * G_USEC_PER_SEC);
+        }
+    }
+
+    // The queues array is complete, so its elements no longer move.
+    for (gint i = 0; opt_fec != NULL && opt_fec[i] != NULL; i++) {
+        if (!rt_queue_parse_fec(opt_fec[i])) {
+            g_printerr("[QUEUE] Bad --fec %s\n", opt_fec[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (gint i = 0; opt_bundles != NULL && opt_bundles[i] != NULL; i++) {
+        if (!rt_queue_parse_bundle(opt_bundles[i])) {
+            g_printerr("[QUEUE] Bad --bundle %s\n", opt_bundles[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (gint i = 0; opt_links != NULL && opt_links[i] != NULL; i++) {
+        if (!rt_queue_parse_link(opt_links[i])) {
+            g_printerr("[LINK] Bad --link %s\n", opt_links[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (gint i = 0; opt_weights != NULL && opt_weights[i] != NULL; i++) {
+        if (!rt_queue_parse_weight(opt_weights[i])) {
+            g_printerr("[QUEUE] Bad --weight %s\n", opt_weights[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (gint i = 0; opt_shapes != NULL && opt_shapes[i] != NULL; i++) {
+        if (!rt_queue_parse_shape(opt_shapes[i])) {
+            g_printerr("[QUEUE] Bad --shape %s\n", opt_shapes[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (gint i = 0; opt_stages != NULL && opt_stages[i] != NULL; i++) {
+        if (!rt_queue_parse_stage(opt_stages[i])) {
+            g_printerr("[QUEUE] Bad --stage %s\n", opt_stages[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (gint i = 0; opt_busy_polls != NULL && opt_busy_polls[i] != NULL; i++) {
+        if (!rt_queue_parse_busy_poll(opt_busy_polls[i])) {
+            g_printerr("[BUSY] Bad --busy-poll %s\n", opt_busy_polls[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     D("[DEBUG] Number of queues: %d\n", queues->len);
     D("[DEBUG] Open router queue and UDP socket for receiving messages\n");
@@ -306,5 +1717,45 @@ main (int    argc,
     D("[DEBUG] Starting gtk_main\n");
     gtk_main ();
 
+    // Workers own their queues' counts until they stop.
+    for (guint i = 0; i < queues->len; i++) {
+        RtWorker *worker = g_array_index(queues, RtQueue, i).worker;
+
+        if (worker != NULL)
+            rt_worker_stop(worker);
+    }
+
+    for (guint i = 0; i < queues->len; i++) {
+        RtQueue *rtqueue = &g_array_index(queues, RtQueue, i);
+        gchar   *prefix = g_strdup_printf("[STAGE] %s: ", rtqueue->name);
+
+        msg_pipeline_print(rtqueue->pipeline, prefix);
+        g_free(prefix);
+        if (opt_stats)
+            rt_queue_print_stats(rtqueue);
+        if (rtqueue->worker != NULL)
+            rt_worker_print(rtqueue->worker, opt_stats);
+        if (rtqueue->link != NULL)
+            g_print("[QUEUE] %s: sent %" G_GUINT64_FORMAT " %s, %" G_GUINT64_FORMAT
+                    " %s, %" G_GUINT64_FORMAT " %s\n", rtqueue->name,
+                    rtqueue->sent[0], rt_class_names[0],
+                    rtqueue->sent[1], rt_class_names[1],
+                    rtqueue->sent[2], rt_class_names[2]);
+        if (rtqueue->target.bundler != NULL)
+            g_print("[BUNDLE] %s: %" G_GUINT64_FORMAT " packets in %" G_GUINT64_FORMAT
+                    " datagrams\n", rtqueue->name,
+                    msg_bundler_get_sent(rtqueue->target.bundler),
+                    msg_bundler_get_packets(rtqueue->target.bundler));
+    }
+    for (guint i = 0; i < links->len; i++) {
+        RtLink *link = g_ptr_array_index(links, i);
+
+        g_print("[LINK] %s: %" G_GUINT64_FORMAT " packets, %" G_GUINT64_FORMAT " bytes\n",
+                link->name, link->packets, link->bytes);
+    }
+
+    rt_capture_free(capture);
+    rt_topology_free(topology);
+
     return 0;
 }
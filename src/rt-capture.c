@@ -0,0 +1,417 @@
+// rt-capture
+
+// Packet capture tap for the router. See rt-capture.h.
+//
+// The ring is a bounded multi-producer queue (each slot carries a sequence
+// number, as described by D. Vyukov) with a single consumer, the writer
+// thread. Producers never block: if the slot they need is still owned by the
+// writer the packet is counted as dropped.
+
+#define _GNU_SOURCE // struct in_pktinfo
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include <glib.h>
+
+#include "rt-capture.h"
+
+// #define DEBUG
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+// pcap file format (nanosecond resolution, raw IPv4 link type)
+#define PCAP_MAGIC_NSEC   0xa1b23c4d
+#define PCAP_LINKTYPE_RAW 101
+#define PCAP_HEADERS      (20 + 8)   // Synthesised IPv4 and UDP headers
+
+// How long the writer sleeps when the ring is empty.
+#define WRITER_IDLE_USEC  10000
+
+typedef struct {
+    guint32 magic;
+    guint16 version_major;
+    guint16 version_minor;
+    gint32  thiszone;
+    guint32 sigfigs;
+    guint32 snaplen;
+    guint32 linktype;
+} PcapFileHeader;
+
+typedef struct {
+    guint32 ts_sec;
+    guint32 ts_nsec;
+    guint32 incl_len;
+    guint32 orig_len;
+} PcapRecordHeader;
+
+typedef struct {
+    guint     sequence;     // Slot ownership, see rt_capture_packet()
+    guint8    direction;
+    guint32   length;       // Original datagram length
+    gint64    timestamp;
+    guint32   saddr, daddr; // Network byte order
+    guint16   sport, dport; // Network byte order
+    gchar     data[RT_CAPTURE_SNAPLEN];
+} RtCaptureSlot;
+
+struct _RtCapture {
+    gint           enabled;
+    guint          dropped;
+
+    // Ring
+    RtCaptureSlot *slots;
+    guint          mask;
+    guint          enqueue;     // Shared by producers
+    guint          dequeue;     // Writer thread only
+
+    // Output files
+    gchar         *prefix;
+    gsize          file_size;
+    guint          file_count;
+    guint          file_index;
+    FILE          *file;
+    gsize          file_written;
+
+    GThread       *writer;
+    gint           running;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Writer thread
+
+static void
+rt_capture_file_close (RtCapture *capture)
+{
+    if (capture->file != NULL) {
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+}
+
+static gboolean
+rt_capture_file_open (RtCapture *capture)
+{
+    PcapFileHeader header;
+    gchar          *filename;
+
+    filename = g_strdup_printf("%s-%03u.pcap", capture->prefix, capture->file_index);
+    capture->file_index = (capture->file_index + 1) % capture->file_count;
+
+    capture->file = fopen(filename, "wb");
+    if (capture->file == NULL) {
+        g_printerr("[CAPTURE] Unable to open %s: %s\n", filename, g_strerror(errno));
+        g_free(filename);
+        return FALSE;
+    }
+    g_print("[CAPTURE] Writing %s\n", filename);
+    g_free(filename);
+
+    header.magic         = PCAP_MAGIC_NSEC;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.thiszone      = 0;
+    header.sigfigs       = 0;
+    header.snaplen       = RT_CAPTURE_SNAPLEN + PCAP_HEADERS;
+    header.linktype      = PCAP_LINKTYPE_RAW;
+    fwrite(&header, sizeof(header), 1, capture->file);
+    capture->file_written = sizeof(header);
+
+    return TRUE;
+}
+
+static guint16
+rt_capture_ip_checksum (const guint16 *words, guint count)
+{
+    guint32 sum = 0;
+
+    while (count--)
+        sum += *words++;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (guint16) ~sum;
+}
+
+static void
+rt_capture_write_slot (RtCapture *capture, RtCaptureSlot *slot)
+{
+    PcapRecordHeader record;
+    struct iphdr     ip;
+    guint16          udp[4];
+    guint32          caplen;
+
+    if (capture->file != NULL && capture->file_written >= capture->file_size)
+        rt_capture_file_close(capture);
+    if (capture->file == NULL && !rt_capture_file_open(capture))
+        return;
+
+    caplen = MIN(slot->length, RT_CAPTURE_SNAPLEN);
+
+    record.ts_sec   = slot->timestamp / 1000000000;
+    record.ts_nsec  = slot->timestamp % 1000000000;
+    record.incl_len = caplen + PCAP_HEADERS;
+    record.orig_len = slot->length + PCAP_HEADERS;
+
+    memset(&ip, 0, sizeof(ip));
+    ip.version  = 4;
+    ip.ihl      = 5;
+    ip.tot_len  = htons(MIN(slot->length + PCAP_HEADERS, G_MAXUINT16));
+    ip.id       = htons(slot->direction); // Filter with ip.id == 1 for forwarded
+    ip.ttl      = 64;
+    ip.protocol = IPPROTO_UDP;
+    ip.saddr    = slot->saddr;
+    ip.daddr    = slot->daddr;
+    ip.check    = rt_capture_ip_checksum((guint16 *) &ip, sizeof(ip) / 2);
+
+    udp[0] = slot->sport;
+    udp[1] = slot->dport;
+    udp[2] = htons(MIN(slot->length + 8, G_MAXUINT16));
+    udp[3] = 0;     // No checksum
+
+    fwrite(&record, sizeof(record), 1, capture->file);
+    fwrite(&ip, sizeof(ip), 1, capture->file);
+    fwrite(udp, sizeof(udp), 1, capture->file);
+    fwrite(slot->data, caplen, 1, capture->file);
+    capture->file_written += sizeof(record) + record.incl_len;
+}
+
+// Write out everything currently in the ring. Returns the number of packets
+// written.
+static guint
+rt_capture_drain (RtCapture *capture)
+{
+    RtCaptureSlot *slot;
+    guint          count = 0;
+
+    for (;;) {
+        slot = &capture->slots[capture->dequeue & capture->mask];
+        if ((gint) (g_atomic_int_get(&slot->sequence) - (capture->dequeue + 1)) < 0)
+            break;
+
+        rt_capture_write_slot(capture, slot);
+
+        // Hand the slot back to the producers, one lap ahead.
+        g_atomic_int_set(&slot->sequence, capture->dequeue + capture->mask + 1);
+        capture->dequeue++;
+        count++;
+    }
+
+    return count;
+}
+
+static gpointer
+rt_capture_writer (gpointer data)
+{
+    RtCapture *capture = data;
+
+    while (g_atomic_int_get(&capture->running)) {
+        if (rt_capture_drain(capture) == 0) {
+            if (capture->file != NULL)
+                fflush(capture->file);
+            g_usleep(WRITER_IDLE_USEC);
+        }
+    }
+    rt_capture_drain(capture);
+    rt_capture_file_close(capture);
+
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Public interface
+
+RtCapture *
+rt_capture_new (const gchar *prefix,
+                guint        slots,
+                gsize        file_size,
+                guint        file_count)
+{
+    RtCapture *capture;
+    guint      size = 1;
+
+    g_assert(slots <= RT_CAPTURE_SLOTS_MAX);
+    while (size < slots)
+        size <<= 1;
+
+    capture = g_new0(RtCapture, 1);
+    capture->slots      = g_new0(RtCaptureSlot, size);
+    capture->mask       = size - 1;
+    capture->prefix     = g_strdup(prefix);
+    capture->file_size  = MAX(file_size, sizeof(PcapFileHeader));
+    capture->file_count = MAX(file_count, 1);
+
+    for (guint i = 0; i < size; i++)
+        capture->slots[i].sequence = i;
+
+    capture->running = TRUE;
+    capture->writer  = g_thread_new("rt-capture", rt_capture_writer, capture);
+
+    D("[DEBUG] Capture ring: %u slots\n", size);
+    return capture;
+}
+
+void
+rt_capture_free (RtCapture *capture)
+{
+    if (capture == NULL)
+        return;
+
+    g_atomic_int_set(&capture->enabled, FALSE);
+    g_atomic_int_set(&capture->running, FALSE);
+    g_thread_join(capture->writer);
+
+    if (capture->dropped)
+        g_print("[CAPTURE] %u packets dropped (ring full)\n", capture->dropped);
+
+    g_free(capture->slots);
+    g_free(capture->prefix);
+    g_free(capture);
+}
+
+void
+rt_capture_set_enabled (RtCapture *capture, gboolean enabled)
+{
+    g_atomic_int_set(&capture->enabled, enabled);
+    g_print("[CAPTURE] %s (%u dropped so far)\n",
+            enabled ? "Enabled" : "Disabled",
+            g_atomic_int_get(&capture->dropped));
+}
+
+gboolean
+rt_capture_get_enabled (RtCapture *capture)
+{
+    return capture != NULL && g_atomic_int_get(&capture->enabled);
+}
+
+guint
+rt_capture_get_dropped (RtCapture *capture)
+{
+    return g_atomic_int_get(&capture->dropped);
+}
+
+void
+rt_capture_packet (RtCapture                *capture,
+                   RtCaptureDirection        direction,
+                   gint64                    timestamp,
+                   const struct sockaddr_in *src,
+                   const struct sockaddr_in *dst,
+                   const gchar              *data,
+                   gsize                     length)
+{
+    RtCaptureSlot *slot;
+    guint          pos;
+    gint           diff;
+
+    if (capture == NULL || !g_atomic_int_get(&capture->enabled))
+        return;
+
+    // Claim a slot. A slot is free for position 'pos' when its sequence equals
+    // 'pos'; if it is still one lap behind, the writer has not caught up.
+    pos = g_atomic_int_get(&capture->enqueue);
+    for (;;) {
+        slot = &capture->slots[pos & capture->mask];
+        diff = (gint) (g_atomic_int_get(&slot->sequence) - pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange(&capture->enqueue, pos, pos + 1))
+                break;
+            pos = g_atomic_int_get(&capture->enqueue);
+        } else if (diff < 0) {
+            g_atomic_int_inc(&capture->dropped);
+            return;
+        } else {
+            pos = g_atomic_int_get(&capture->enqueue);
+        }
+    }
+
+    slot->direction = direction;
+    slot->length    = length;
+    slot->timestamp = timestamp;
+    slot->saddr     = src ? src->sin_addr.s_addr : 0;
+    slot->sport     = src ? src->sin_port : 0;
+    slot->daddr     = dst ? dst->sin_addr.s_addr : 0;
+    slot->dport     = dst ? dst->sin_port : 0;
+    memcpy(slot->data, data, MIN(length, RT_CAPTURE_SNAPLEN));
+
+    // Publish to the writer.
+    g_atomic_int_set(&slot->sequence, pos + 1);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Socket helpers
+
+void
+rt_capture_socket_init (gint fd)
+{
+    gint on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+        g_printerr("[CAPTURE] SO_TIMESTAMPNS: %s\n", g_strerror(errno));
+    if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0)
+        g_printerr("[CAPTURE] IP_PKTINFO: %s\n", g_strerror(errno));
+}
+
+gssize
+rt_capture_receive (gint                fd,
+                    gchar              *buffer,
+                    gsize               size,
+                    struct sockaddr_in *src,
+                    struct sockaddr_in *dst,
+                    gint64             *timestamp)
+{
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr *cmsg;
+    gchar           control[CMSG_SPACE(sizeof(struct timespec)) +
+                            CMSG_SPACE(sizeof(struct in_pktinfo))];
+    gssize          received;
+
+    iov.iov_base = buffer;
+    iov.iov_len  = size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name       = src;
+    msg.msg_namelen    = src ? sizeof(*src) : 0;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        received = recvmsg(fd, &msg, 0);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0)
+        return received;
+
+    *timestamp = 0;
+    if (dst != NULL)
+        memset(dst, 0, sizeof(*dst));
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *timestamp = (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        } else if (dst != NULL &&
+                   cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+            dst->sin_family = AF_INET;
+            dst->sin_addr   = info.ipi_addr;
+        }
+    }
+
+    if (*timestamp == 0)
+        *timestamp = g_get_real_time() * 1000;
+
+    return received;
+}
@@ -0,0 +1,62 @@
+// rt-capture
+
+// Packet capture tap for the router. Datagrams are copied into a fixed size
+// in-memory ring by the receive and forward paths and written out as rotating
+// pcap files by a background thread. Capture can be switched on and off at
+// runtime; when off, or when the ring is full, a packet costs one atomic load.
+
+#ifndef RT_CAPTURE_H
+#define RT_CAPTURE_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+// Largest payload stored per packet. Longer datagrams are truncated in the
+// capture file (the original length is still recorded).
+#define RT_CAPTURE_SNAPLEN 1024
+
+// Largest capture ring, in packets.
+#define RT_CAPTURE_SLOTS_MAX (1 << 20)
+
+typedef enum {
+    RT_CAPTURE_IN,      // Received on a queue's port_in
+    RT_CAPTURE_OUT      // Forwarded to a queue's target
+} RtCaptureDirection;
+
+typedef struct _RtCapture RtCapture;
+
+// Create a capture tap. Files are named <prefix>-NNN.pcap and rotated when they
+// exceed 'file_size' bytes, re-using the oldest once 'file_count' exist.
+// 'slots' (1 to RT_CAPTURE_SLOTS_MAX) is rounded up to a power of two.
+RtCapture *rt_capture_new         (const gchar *prefix,
+                                   guint        slots,
+                                   gsize        file_size,
+                                   guint        file_count);
+void       rt_capture_free        (RtCapture *capture);
+
+void       rt_capture_set_enabled (RtCapture *capture, gboolean enabled);
+gboolean   rt_capture_get_enabled (RtCapture *capture);
+guint      rt_capture_get_dropped (RtCapture *capture);
+
+// Copy one datagram into the ring. Safe to call from any thread. 'timestamp'
+// is in nanoseconds since the epoch.
+void       rt_capture_packet      (RtCapture                *capture,
+                                   RtCaptureDirection        direction,
+                                   gint64                    timestamp,
+                                   const struct sockaddr_in *src,
+                                   const struct sockaddr_in *dst,
+                                   const gchar              *data,
+                                   gsize                     length);
+
+// Socket helpers. Ask the kernel to timestamp received datagrams and report
+// their destination address, then receive with that information attached.
+// Falls back to the system clock if no kernel timestamp is available.
+void       rt_capture_socket_init (gint fd);
+gssize     rt_capture_receive     (gint                fd,
+                                   gchar              *buffer,
+                                   gsize               size,
+                                   struct sockaddr_in *src,
+                                   struct sockaddr_in *dst,
+                                   gint64             *timestamp);
+
+#endif // RT_CAPTURE_H
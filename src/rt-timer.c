@@ -0,0 +1,172 @@
+// rt-timer
+
+// Heap of router timers. See rt-timer.h.
+
+#include <glib.h>
+
+#include "rt-timer.h"
+
+// Debug
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+static GPtrArray *heap   = NULL;   // RtTimer *, earliest first
+static GSource   *source = NULL;
+
+#define HEAP(i) ((RtTimer *) g_ptr_array_index(heap, i))
+
+static inline void
+heap_put (guint i, RtTimer *timer)
+{
+    g_ptr_array_index(heap, i) = timer;
+    timer->index = i + 1;
+}
+
+static void
+heap_up (guint i)
+{
+    RtTimer *timer = HEAP(i);
+
+    while (i > 0 && HEAP((i - 1) / 2)->due > timer->due) {
+        heap_put(i, HEAP((i - 1) / 2));
+        i = (i - 1) / 2;
+    }
+    heap_put(i, timer);
+}
+
+static void
+heap_down (guint i)
+{
+    RtTimer *timer = HEAP(i);
+
+    for (;;) {
+        guint child = 2 * i + 1;
+
+        if (child >= heap->len)
+            break;
+        if (child + 1 < heap->len && HEAP(child + 1)->due < HEAP(child)->due)
+            child++;
+        if (HEAP(child)->due >= timer->due)
+            break;
+        heap_put(i, HEAP(child));
+        i = child;
+    }
+    heap_put(i, timer);
+}
+
+// Take out the timer at 'i', filling the gap with the last.
+static void
+heap_remove (guint i)
+{
+    RtTimer *last = g_ptr_array_remove_index(heap, heap->len - 1);
+
+    if (i < heap->len) {
+        heap_put(i, last);
+        heap_up(i);
+        heap_down(last->index - 1);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Main loop source
+
+static gboolean
+timer_prepare (GSource *source, gint *timeout)
+{
+    gint64 wait;
+
+    if (heap->len == 0) {
+        *timeout = -1;
+        return FALSE;
+    }
+    wait = HEAP(0)->due - g_get_real_time();
+    if (wait <= 0) {
+        *timeout = 0;
+        return TRUE;
+    }
+    *timeout = MIN((wait + 999) / 1000, G_MAXINT);
+    return FALSE;
+}
+
+static gboolean
+timer_check (GSource *source)
+{
+    return heap->len > 0 && HEAP(0)->due <= g_get_real_time();
+}
+
+// Fire everything due. Only timers due when dispatch started run, so one set
+// again for now waits for the next iteration.
+static gboolean
+timer_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    gint64 now = g_get_real_time();
+    guint  limit = heap->len;
+
+    while (limit-- > 0 && heap->len > 0 && HEAP(0)->due <= now) {
+        RtTimer *timer = HEAP(0);
+
+        rt_timer_cancel(timer);
+        timer->func(timer->user_data);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs timer_funcs = {
+    .prepare  = timer_prepare,
+    .check    = timer_check,
+    .dispatch = timer_dispatch,
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+void
+rt_timer_init (RtTimer *timer, RtTimerFunc func, gpointer user_data)
+{
+    timer->due       = 0;
+    timer->index     = 0;
+    timer->func      = func;
+    timer->user_data = user_data;
+
+    if (source == NULL) {
+        heap   = g_ptr_array_new();
+        source = g_source_new(&timer_funcs, sizeof(GSource));
+        g_source_set_priority(source, G_PRIORITY_HIGH);
+        g_source_attach(source, NULL);
+    }
+}
+
+void
+rt_timer_set (RtTimer *timer, gint64 due)
+{
+    gint64 old = timer->due;
+
+    timer->due = due;
+    if (timer->index == 0) {
+        g_ptr_array_add(heap, timer);
+        heap_up(heap->len - 1);
+    } else if (due < old) {
+        heap_up(timer->index - 1);
+    } else {
+        heap_down(timer->index - 1);
+    }
+}
+
+void
+rt_timer_cancel (RtTimer *timer)
+{
+    guint i = timer->index;
+
+    if (i == 0)
+        return;
+    timer->index = 0;
+    heap_remove(i - 1);
+}
+
+guint
+rt_timer_count (void)
+{
+    return heap != NULL ? heap->len : 0;
+}
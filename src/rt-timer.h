@@ -0,0 +1,44 @@
+// rt-timer
+
+// Timers for the router's queues and links, kept in one binary heap ordered
+// by due time and serviced by a single main loop source.
+//
+// Every queue has its next service time, and with thousands of queues one
+// GLib timeout each would make every main loop iteration walk them all, and
+// every reschedule free and allocate a source. Here setting a timer is
+// O(log n), an idle queue costs nothing, and the main loop only ever sees the
+// earliest due time. Timers fire at G_PRIORITY_HIGH, on the default main
+// context, and are only used from the main loop's thread.
+
+#ifndef RT_TIMER_H
+#define RT_TIMER_H
+
+#include <glib.h>
+
+typedef void (*RtTimerFunc) (gpointer user_data);
+
+// Embedded in its owner, which must not move while the timer is set.
+typedef struct {
+    gint64      due;                // g_get_real_time() at which to fire
+    guint       index;              // Position in the heap + 1, 0 if not set
+    RtTimerFunc func;
+    gpointer    user_data;
+} RtTimer;
+
+void     rt_timer_init    (RtTimer *timer, RtTimerFunc func, gpointer user_data);
+
+// Fire once at 'due' (microseconds, real time), replacing any time already
+// set. A time already past fires on the next main loop iteration.
+void     rt_timer_set     (RtTimer *timer, gint64 due);
+void     rt_timer_cancel  (RtTimer *timer);
+
+static inline gboolean
+rt_timer_is_set (const RtTimer *timer)
+{
+    return timer->index != 0;
+}
+
+// Timers set, for reporting.
+guint    rt_timer_count   (void);
+
+#endif // RT_TIMER_H
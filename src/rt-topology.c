@@ -0,0 +1,545 @@
+// rt-topology
+
+// Routing topology built from 'routes.json'. See rt-topology.h.
+//
+// The configuration looks like:
+//
+//   {"regions":
+//    [{"id": "earth-moon", "delay": 1.28,
+//      "routes": [["earth-gw", "-.-.-.-", "4478"],
+//                 ["moon-gw",  "-.-.-.-", "4479"]]},
+//     ...]}
+//
+// where each route is a node's name, address and port within the region and
+// 'delay' is the one way link delay between members of the region, in
+// seconds. An address of "-.-.-.-" means the node's address from another
+// region, with the port given here.
+//
+// Shortest paths are found with Dijkstra's algorithm from every node (the
+// graphs are small and dense, so the O(n^2) array version is used).
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "rt-topology.h"
+
+// #define DEBUG
+#ifdef DEBUG
+#define   D(...) g_printerr(__VA_ARGS__);
+#else
+#define   D(...)
+#endif
+
+#define RT_TOPOLOGY_ERROR (g_quark_from_static_string("rt-topology"))
+
+//////////////////////////////////////////////////////////////////////////////
+// Shortest paths
+
+// Recompute row 'source' of the dist and next tables.
+static void
+rt_topology_dijkstra (RtTopology *topology, gint source)
+{
+    guint     n     = topology->n;
+    gint64   *dist  = topology->dist + source * n;
+    gint     *next  = topology->next + source * n;
+    gboolean *done  = g_new0(gboolean, n);
+
+    for (guint i = 0; i < n; i++) {
+        dist[i] = RT_TOPOLOGY_UNREACHABLE;
+        next[i] = -1;
+    }
+    dist[source] = 0;
+    next[source] = source;
+
+    for (guint round = 0; round < n; round++) {
+        gint   u = -1;
+        gint64 best = RT_TOPOLOGY_UNREACHABLE;
+
+        for (guint i = 0; i < n; i++) {
+            if (!done[i] && dist[i] < best) {
+                best = dist[i];
+                u    = i;
+            }
+        }
+        if (u < 0)
+            break;
+        done[u] = TRUE;
+
+        for (guint v = 0; v < n; v++) {
+            gint64 link = topology->link[u * n + v];
+
+            if (done[v] || link == RT_TOPOLOGY_UNREACHABLE)
+                continue;
+            if (dist[u] + link < dist[v]) {
+                dist[v] = dist[u] + link;
+                next[v] = (u == source) ? (gint) v : next[u];
+            }
+        }
+    }
+
+    g_free(done);
+}
+
+static void
+rt_topology_compute (RtTopology *topology)
+{
+    for (guint s = 0; s < topology->n; s++)
+        rt_topology_dijkstra(topology, s);
+}
+
+// Is the link a-b (with delay 'link') on a shortest path from 'source'?
+static gboolean
+rt_topology_link_used (RtTopology *topology, gint source, gint a, gint b, gint64 link)
+{
+    gint64 *dist = topology->dist + source * topology->n;
+
+    if (link == RT_TOPOLOGY_UNREACHABLE)
+        return FALSE;
+    return (dist[a] != RT_TOPOLOGY_UNREACHABLE && dist[a] + link == dist[b]) ||
+           (dist[b] != RT_TOPOLOGY_UNREACHABLE && dist[b] + link == dist[a]);
+}
+
+void
+rt_topology_set_link (RtTopology *topology,
+                      gint        a,
+                      gint        b,
+                      gint64      delay,
+                      gint        region)
+{
+    guint  n   = topology->n;
+    gint64 old = topology->link[a * n + b];
+
+    topology->link_region[a * n + b] = topology->link_region[b * n + a] = region;
+    if (delay == old)
+        return;
+
+    if (delay < old) {
+        // A cheaper link can only shorten paths, and any shortened path goes
+        // i -> a -> b -> j (or the reverse), so relax every pair through it.
+        // The old paths are still valid, so this is O(n^2).
+        topology->link[a * n + b] = topology->link[b * n + a] = delay;
+
+        for (guint i = 0; i < n; i++) {
+            for (gint dir = 0; dir < 2; dir++) {
+                gint   u  = dir ? b : a;
+                gint   v  = dir ? a : b;
+                gint64 iu = topology->dist[i * n + u];
+
+                if (iu == RT_TOPOLOGY_UNREACHABLE)
+                    continue;
+                for (guint j = 0; j < n; j++) {
+                    gint64 vj = topology->dist[v * n + j];
+
+                    if (vj == RT_TOPOLOGY_UNREACHABLE)
+                        continue;
+                    if (iu + delay + vj < topology->dist[i * n + j]) {
+                        topology->dist[i * n + j] = iu + delay + vj;
+                        topology->next[i * n + j] = ((gint) i == u) ? v : topology->next[i * n + u];
+                    }
+                }
+            }
+        }
+    } else {
+        // A dearer (or removed) link only affects sources whose shortest path
+        // tree used it. Recompute just those rows.
+        GArray *affected = g_array_new(FALSE, FALSE, sizeof(gint));
+
+        for (gint i = 0; i < (gint) n; i++) {
+            if (rt_topology_link_used(topology, i, a, b, old))
+                g_array_append_val(affected, i);
+        }
+
+        topology->link[a * n + b] = topology->link[b * n + a] = delay;
+
+        for (guint k = 0; k < affected->len; k++)
+            rt_topology_dijkstra(topology, g_array_index(affected, gint, k));
+        D("[DEBUG] Link %d-%d: recomputed %u of %u rows\n", a, b, affected->len, n);
+        g_array_free(affected, TRUE);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Loading
+
+static void
+rt_node_free (gpointer data)
+{
+    RtNode *node = data;
+
+    for (guint i = 0; i < node->interfaces->len; i++) {
+        RtInterface *iface = &g_array_index(node->interfaces, RtInterface, i);
+        g_free(iface->region);
+        g_free(iface->address);
+    }
+    g_array_free(node->interfaces, TRUE);
+    g_free(node->name);
+    g_free(node);
+}
+
+gint
+rt_topology_node_index (RtTopology *topology, const gchar *name)
+{
+    for (guint i = 0; i < topology->nodes->len; i++) {
+        RtNode *node = g_ptr_array_index(topology->nodes, i);
+        if (g_strcmp0(node->name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Fill in "-.-.-.-" addresses from the node's other interfaces and resolve
+// everything to socket addresses.
+static void
+rt_node_resolve (RtNode *node)
+{
+    const gchar *known = NULL;
+
+    for (guint i = 0; i < node->interfaces->len; i++) {
+        RtInterface *iface = &g_array_index(node->interfaces, RtInterface, i);
+        if (g_strcmp0(iface->address, "-.-.-.-") != 0) {
+            known = iface->address;
+            break;
+        }
+    }
+
+    for (guint i = 0; i < node->interfaces->len; i++) {
+        RtInterface     *iface = &g_array_index(node->interfaces, RtInterface, i);
+        const gchar     *host  = iface->address;
+        struct addrinfo  hints, *result;
+
+        if (g_strcmp0(host, "-.-.-.-") == 0)
+            host = known ? known : "127.0.0.1";
+
+        memset(&iface->addr, 0, sizeof(iface->addr));
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(host, NULL, &hints, &result) == 0) {
+            memcpy(&iface->addr, result->ai_addr, sizeof(iface->addr));
+            freeaddrinfo(result);
+        } else {
+            g_printerr("[ROUTES] Unable to resolve %s for %s\n", host, node->name);
+        }
+        iface->addr.sin_family = AF_INET;
+        iface->addr.sin_port   = htons(iface->port);
+    }
+}
+
+static guint16
+rt_json_port (JsonNode *node)
+{
+    if (json_node_get_value_type(node) == G_TYPE_STRING)
+        return atoi(json_node_get_string(node));
+    return json_node_get_int(node);
+}
+
+static gboolean
+rt_json_is (JsonNode *node, GType type)
+{
+    return node != NULL && JSON_NODE_HOLDS_VALUE(node) && json_node_get_value_type(node) == type;
+}
+
+static gboolean
+rt_json_is_number (JsonNode *node)
+{
+    return rt_json_is(node, G_TYPE_INT64) || rt_json_is(node, G_TYPE_DOUBLE);
+}
+
+// Check that the file has the shape the loader expects, so that nothing below
+// is handed a member of the wrong type:
+//
+//   { "regions": [ { "id": "...", "delay": N,
+//                    "routes": [ [ "node", "address", port ], ... ] }, ... ] }
+//
+// "delay" and "routes" may be left out; a port may be a number or a string.
+static gboolean
+rt_topology_check (JsonNode *root, const gchar *filename, GError **error)
+{
+    JsonArray *regions;
+
+    if (root == NULL || !JSON_NODE_HOLDS_OBJECT(root) ||
+        !json_object_has_member(json_node_get_object(root), "regions") ||
+        !JSON_NODE_HOLDS_ARRAY(json_object_get_member(json_node_get_object(root), "regions"))) {
+        g_set_error(error, RT_TOPOLOGY_ERROR, 0, "%s: no \"regions\" array", filename);
+        return FALSE;
+    }
+    regions = json_object_get_array_member(json_node_get_object(root), "regions");
+
+    for (guint r = 0; r < json_array_get_length(regions); r++) {
+        JsonNode   *element = json_array_get_element(regions, r);
+        JsonObject *region;
+        JsonNode   *routes;
+
+        if (!JSON_NODE_HOLDS_OBJECT(element) ||
+            !rt_json_is(json_object_get_member(json_node_get_object(element), "id"), G_TYPE_STRING)) {
+            g_set_error(error, RT_TOPOLOGY_ERROR, 0,
+                        "%s: region %u is not an object with a string \"id\"", filename, r);
+            return FALSE;
+        }
+        region = json_node_get_object(element);
+
+        if (json_object_has_member(region, "delay") &&
+            !rt_json_is_number(json_object_get_member(region, "delay"))) {
+            g_set_error(error, RT_TOPOLOGY_ERROR, 0, "%s: region %s: \"delay\" is not a number",
+                        filename, json_object_get_string_member(region, "id"));
+            return FALSE;
+        }
+
+        routes = json_object_get_member(region, "routes");
+        if (routes == NULL)
+            continue;
+        if (!JSON_NODE_HOLDS_ARRAY(routes)) {
+            g_set_error(error, RT_TOPOLOGY_ERROR, 0, "%s: region %s: \"routes\" is not an array",
+                        filename, json_object_get_string_member(region, "id"));
+            return FALSE;
+        }
+        for (guint i = 0; i < json_array_get_length(json_node_get_array(routes)); i++) {
+            JsonNode  *node = json_array_get_element(json_node_get_array(routes), i);
+            JsonArray *route;
+
+            if (!JSON_NODE_HOLDS_ARRAY(node) ||
+                json_array_get_length(route = json_node_get_array(node)) < 3 ||
+                !rt_json_is(json_array_get_element(route, 0), G_TYPE_STRING) ||
+                !rt_json_is(json_array_get_element(route, 1), G_TYPE_STRING) ||
+                !(rt_json_is(json_array_get_element(route, 2), G_TYPE_INT64) ||
+                  rt_json_is(json_array_get_element(route, 2), G_TYPE_STRING))) {
+                g_set_error(error, RT_TOPOLOGY_ERROR, 0,
+                            "%s: region %s: route %u is not [ \"node\", \"address\", port ]",
+                            filename, json_object_get_string_member(region, "id"), i);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+RtTopology *
+rt_topology_load (const gchar *filename, GError **error)
+{
+    JsonParser *parser;
+    JsonObject *root;
+    JsonArray  *regions;
+    RtTopology *topology;
+    guint       n;
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_file (parser, filename, error)) {
+        g_object_unref (parser);
+        return NULL;
+    }
+
+    if (!rt_topology_check(json_parser_get_root(parser), filename, error)) {
+        g_object_unref (parser);
+        return NULL;
+    }
+    root    = json_node_get_object (json_parser_get_root (parser));
+    regions = json_object_get_array_member (root, "regions");
+
+    topology = g_new0(RtTopology, 1);
+    topology->nodes   = g_ptr_array_new_with_free_func(rt_node_free);
+    topology->regions = g_ptr_array_new_with_free_func(g_free);
+
+    // Nodes and their interfaces
+    for (guint r = 0; r < json_array_get_length(regions); r++) {
+        JsonObject  *region = json_array_get_object_element(regions, r);
+        JsonArray   *routes = json_object_get_array_member(region, "routes");
+        const gchar *id     = json_object_get_string_member(region, "id");
+
+        g_ptr_array_add(topology->regions, g_strdup(id));
+
+        for (guint i = 0; routes != NULL && i < json_array_get_length(routes); i++) {
+            JsonArray   *route = json_array_get_array_element(routes, i);
+            const gchar *name;
+            RtInterface  iface;
+            RtNode      *node;
+            gint         index;
+
+            name = json_array_get_string_element(route, 0);
+
+            index = rt_topology_node_index(topology, name);
+            if (index < 0) {
+                node = g_new0(RtNode, 1);
+                node->name       = g_strdup(name);
+                node->interfaces = g_array_new(FALSE, TRUE, sizeof(RtInterface));
+                g_ptr_array_add(topology->nodes, node);
+            } else {
+                node = g_ptr_array_index(topology->nodes, index);
+            }
+
+            iface.region  = g_strdup(id);
+            iface.address = g_strdup(json_array_get_string_element(route, 1));
+            iface.port    = rt_json_port(json_array_get_element(route, 2));
+            g_array_append_val(node->interfaces, iface);
+        }
+    }
+
+    n = topology->n   = topology->nodes->len;
+    topology->link        = g_new(gint64, n * n);
+    topology->link_region = g_new(gint,   n * n);
+    topology->dist        = g_new(gint64, n * n);
+    topology->next        = g_new(gint,   n * n);
+
+    for (guint i = 0; i < n * n; i++) {
+        topology->link[i]        = RT_TOPOLOGY_UNREACHABLE;
+        topology->link_region[i] = -1;
+    }
+    for (guint i = 0; i < n; i++) {
+        rt_node_resolve(g_ptr_array_index(topology->nodes, i));
+        topology->link[i * n + i] = 0;
+    }
+
+    // Links: every pair of members of a region, keeping the fastest region if
+    // two nodes share more than one.
+    for (guint r = 0; r < json_array_get_length(regions); r++) {
+        JsonObject *region = json_array_get_object_element(regions, r);
+        JsonArray  *routes = json_object_get_array_member(region, "routes");
+        gint64      delay  = 0;
+        guint       count  = routes ? json_array_get_length(routes) : 0;
+
+        if (json_object_has_member(region, "delay"))
+            delay = json_object_get_double_member(region, "delay") * G_USEC_PER_SEC;
+
+        for (guint i = 0; i < count; i++) {
+            for (guint j = i + 1; j < count; j++) {
+                gint a = rt_topology_node_index(topology,
+                             json_array_get_string_element(json_array_get_array_element(routes, i), 0));
+                gint b = rt_topology_node_index(topology,
+                             json_array_get_string_element(json_array_get_array_element(routes, j), 0));
+
+                if (a < 0 || b < 0 || a == b || delay >= topology->link[a * n + b])
+                    continue;
+                topology->link[a * n + b]        = topology->link[b * n + a]        = delay;
+                topology->link_region[a * n + b] = topology->link_region[b * n + a] = r;
+            }
+        }
+    }
+
+    g_object_unref (parser);
+
+    rt_topology_compute(topology);
+    return topology;
+}
+
+void
+rt_topology_free (RtTopology *topology)
+{
+    if (topology == NULL)
+        return;
+
+    g_ptr_array_unref(topology->nodes);
+    g_ptr_array_unref(topology->regions);
+    g_free(topology->link);
+    g_free(topology->link_region);
+    g_free(topology->dist);
+    g_free(topology->next);
+    g_free(topology);
+}
+
+gboolean
+rt_topology_reload (RtTopology  *topology,
+                    const gchar *filename,
+                    GError     **error)
+{
+    RtTopology *fresh;
+    gboolean    same = TRUE;
+    guint       n = topology->n;
+
+    fresh = rt_topology_load(filename, error);
+    if (fresh == NULL)
+        return FALSE;
+
+    if (fresh->n != n || fresh->regions->len != topology->regions->len)
+        same = FALSE;
+    for (guint i = 0; same && i < n; i++) {
+        RtNode *a = g_ptr_array_index(topology->nodes, i);
+        RtNode *b = g_ptr_array_index(fresh->nodes, i);
+        same = g_strcmp0(a->name, b->name) == 0 &&
+               a->interfaces->len == b->interfaces->len;
+    }
+
+    if (same) {
+        // Same nodes: keep the tables and apply each changed link.
+        guint changed = 0;
+
+        for (guint i = 0; i < n; i++) {
+            for (guint j = i + 1; j < n; j++) {
+                if (fresh->link[i * n + j] != topology->link[i * n + j] ||
+                    fresh->link_region[i * n + j] != topology->link_region[i * n + j]) {
+                    rt_topology_set_link(topology, i, j,
+                                         fresh->link[i * n + j],
+                                         fresh->link_region[i * n + j]);
+                    changed++;
+                }
+            }
+        }
+
+        // Interfaces may have new addresses, and link_region now refers to the
+        // new list of regions.
+        g_ptr_array_unref(topology->nodes);
+        g_ptr_array_unref(topology->regions);
+        topology->nodes   = g_ptr_array_ref(fresh->nodes);
+        topology->regions = g_ptr_array_ref(fresh->regions);
+        g_print("[ROUTES] Reloaded %s: %u links changed\n", filename, changed);
+    } else {
+        // Different nodes: node indices change, so swap in the new tables.
+        RtTopology old = *topology;
+
+        *topology = *fresh;
+        *fresh    = old;
+        g_print("[ROUTES] Reloaded %s: %u nodes (rebuilt)\n", filename, topology->n);
+    }
+
+    rt_topology_free(fresh);
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Queries
+
+const RtInterface *
+rt_topology_interface (RtTopology *topology, gint from, gint hop)
+{
+    RtNode      *node = g_ptr_array_index(topology->nodes, hop);
+    gint         region = topology->link_region[from * topology->n + hop];
+    const gchar *id;
+
+    if (region < 0)
+        return NULL;
+    id = g_ptr_array_index(topology->regions, region);
+
+    for (guint i = 0; i < node->interfaces->len; i++) {
+        RtInterface *iface = &g_array_index(node->interfaces, RtInterface, i);
+        if (g_strcmp0(iface->region, id) == 0)
+            return iface;
+    }
+    return NULL;
+}
+
+void
+rt_topology_display (RtTopology *topology)
+{
+    for (guint i = 0; i < topology->n; i++) {
+        RtNode *from = g_ptr_array_index(topology->nodes, i);
+
+        for (guint j = 0; j < topology->n; j++) {
+            RtNode *to  = g_ptr_array_index(topology->nodes, j);
+            gint    hop = rt_topology_next_hop(topology, i, j);
+
+            if (i == j)
+                continue;
+            if (hop < 0) {
+                g_print("[ROUTES] %-12s -> %-12s  unreachable\n", from->name, to->name);
+                continue;
+            }
+            g_print("[ROUTES] %-12s -> %-12s  via %-12s  %10.3f s\n",
+                    from->name, to->name,
+                    ((RtNode *) g_ptr_array_index(topology->nodes, hop))->name,
+                    rt_topology_delay(topology, i, j) / (gdouble) G_USEC_PER_SEC);
+        }
+    }
+}
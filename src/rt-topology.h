@@ -0,0 +1,81 @@
+// rt-topology
+
+// Routing topology built from 'routes.json'. Every region is a set of nodes
+// that can reach each other directly with the region's link delay; nodes that
+// appear in several regions (gateways) join them together. All-pairs next hop
+// tables, by cumulative link delay, are precomputed so that a forwarding
+// decision is a single array lookup.
+
+#ifndef RT_TOPOLOGY_H
+#define RT_TOPOLOGY_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#define RT_TOPOLOGY_UNREACHABLE G_MAXINT64
+
+// A node's address in one region. Gateways have one interface per region.
+typedef struct {
+    gchar              *region;
+    gchar              *address;
+    guint16             port;
+    struct sockaddr_in  addr;     // Resolved when the topology is loaded
+} RtInterface;
+
+typedef struct {
+    gchar    *name;
+    GArray   *interfaces;         // RtInterface
+} RtNode;
+
+typedef struct {
+    GPtrArray *nodes;             // RtNode
+    GPtrArray *regions;           // gchar* region id
+    guint      n;                 // Number of nodes
+
+    // n x n tables, indexed [from * n + to]
+    gint64    *link;              // Direct link delay (microseconds)
+    gint      *link_region;       // Region the direct link is in (-1 if none)
+    gint64    *dist;              // Cumulative delay along the best path
+    gint      *next;              // First hop along the best path (-1 if none)
+} RtTopology;
+
+RtTopology        *rt_topology_load       (const gchar *filename, GError **error);
+void               rt_topology_free       (RtTopology *topology);
+
+// Re-read 'filename' and apply any changed link delays incrementally. Falls
+// back to a full rebuild if nodes were added or removed.
+gboolean           rt_topology_reload     (RtTopology  *topology,
+                                           const gchar *filename,
+                                           GError     **error);
+
+gint               rt_topology_node_index (RtTopology *topology, const gchar *name);
+
+// Change the delay of the direct link between 'a' and 'b' (use
+// RT_TOPOLOGY_UNREACHABLE to remove it) and update the tables. Only paths
+// that can be affected by the change are recomputed.
+void               rt_topology_set_link   (RtTopology *topology,
+                                           gint        a,
+                                           gint        b,
+                                           gint64      delay,
+                                           gint        region);
+
+// Interface of neighbour 'hop' to send to from 'from'.
+const RtInterface *rt_topology_interface  (RtTopology *topology, gint from, gint hop);
+
+void               rt_topology_display    (RtTopology *topology);
+
+// Next node on the shortest-delay path from 'from' to 'to', or -1.
+static inline gint
+rt_topology_next_hop (RtTopology *topology, gint from, gint to)
+{
+    return topology->next[from * topology->n + to];
+}
+
+// Cumulative delay from 'from' to 'to' in microseconds.
+static inline gint64
+rt_topology_delay (RtTopology *topology, gint from, gint to)
+{
+    return topology->dist[from * topology->n + to];
+}
+
+#endif // RT_TOPOLOGY_H
@@ -0,0 +1,129 @@
+// stage-compress
+
+// Stage module (see msg-stage.h) compressing the text of sequenced chat
+// messages against the shared dictionary in msg-compress.h. A message sent
+// compressed has MSG_FLAG_COMPRESSED set in its header, so each one says how
+// to read it: a receiver without the stage shows a placeholder for it (and a
+// router a summary) rather than garbage, and one with the stage passes
+// uncompressed messages through. Messages that would not get shorter, [OVER]
+// markers (which routers look for, see rt_data_classify()), and anything that
+// is not MSG_TYPE_TEXT, are left alone. Load it at both ends of a link, eg.
+//
+//   ./router --queue=out,4479,10.1.1.83:4478 --stage=out,./stage-compress.so
+//
+// or for a single peer in 'messages', by adding it to the 'stages' setting.
+
+#include <string.h>
+
+#include <glib.h>
+#include <gmodule.h>
+
+#include "msg-compress.h"
+#include "msg-header.h"
+#include "msg-stage.h"
+
+#define FLAGS_OFFSET    3           // Of the flags byte in the header
+
+typedef struct {
+    MsgCompressor *compressor;
+    gchar          scratch[MSG_COMPRESS_MAX];
+} StageCompress;
+
+static gpointer
+stage_compress_create (const gchar *args, GError **error)
+{
+    StageCompress *stage = g_new0(StageCompress, 1);
+
+    stage->compressor = msg_compressor_new();
+    return stage;
+}
+
+static void
+stage_compress_destroy (gpointer state)
+{
+    StageCompress *stage = state;
+
+    msg_compressor_free(stage->compressor);
+    g_free(stage);
+}
+
+static void
+stage_compress_out (StageCompress *stage, MsgPacket *packet)
+{
+    MsgHeader  header;
+    gchar     *body = packet->data + MSG_HEADER_SIZE;
+    gsize      length, n;
+
+    if (!msg_header_read(packet->data, packet->length, &header) ||
+        header.type != MSG_TYPE_TEXT || (header.flags & MSG_FLAG_COMPRESSED))
+        return;
+
+    length = packet->length - MSG_HEADER_SIZE;
+    if (length > MSG_COMPRESS_MAX ||
+        (length >= 6 && memcmp(body, "[OVER]", 6) == 0))
+        return;
+
+    n = msg_compress(stage->compressor, body, length, stage->scratch, sizeof(stage->scratch));
+    if (n == 0)
+        return;
+
+    memcpy(body, stage->scratch, n);
+    msg_packet_trim(packet, length - n);
+    packet->data[FLAGS_OFFSET] |= MSG_FLAG_COMPRESSED;
+}
+
+static void
+stage_compress_in (StageCompress *stage, MsgPacket *packet)
+{
+    MsgHeader  header;
+    gchar     *body = packet->data + MSG_HEADER_SIZE;
+    gsize      length;
+    gssize     n;
+
+    if (!msg_header_read(packet->data, packet->length, &header) ||
+        !(header.flags & MSG_FLAG_COMPRESSED))
+        return;
+
+    length = packet->length - MSG_HEADER_SIZE;
+    n = msg_decompress(body, length, stage->scratch, sizeof(stage->scratch));
+    if (n < 0 || (gsize) n < length || msg_packet_put(packet, n - length) == NULL) {
+        packet->length = 0;
+        return;
+    }
+
+    memcpy(body, stage->scratch, n);
+    packet->data[FLAGS_OFFSET] &= ~MSG_FLAG_COMPRESSED;
+}
+
+static void
+stage_compress_process (gpointer           state,
+                        MsgStageDirection  direction,
+                        MsgPacket         *packets,
+                        guint              count)
+{
+    StageCompress *stage = state;
+
+    for (guint i = 0; i < count; i++) {
+        if (packets[i].length == 0)
+            continue;
+
+        if (direction == MSG_STAGE_OUT)
+            stage_compress_out(stage, &packets[i]);
+        else
+            stage_compress_in(stage, &packets[i]);
+    }
+}
+
+static const MsgStageInfo stage_compress_info = {
+    .api     = MSG_STAGE_API,
+    .name    = "compress",
+    .create  = stage_compress_create,
+    .destroy = stage_compress_destroy,
+    .process = stage_compress_process,
+};
+
+G_MODULE_EXPORT const MsgStageInfo *
+msg_stage_module_info (void)
+{
+    return &stage_compress_info;
+}